@@ -136,6 +136,13 @@ void FileWriter::Write(const absl::Cord& msg) {
     int chunk_idx = 0;
     const int chunk_size = chunk.size();
     bytes_received_ += chunk_size;
+    // Large chunks (e.g. values) would only be copied into the buffer to fill
+    // it, so write them out directly, in order after what's buffered.
+    if (chunk_size >= buffer_size_max_) {
+      WriteBuffer();
+      WriteUnbuffered(chunk);
+      continue;
+    }
     // Write the largest part of the chunk to the buffer as possible.
     while (chunk_idx < chunk_size) {
       int remaining = buffer_size_max_ - buffer_size_;
@@ -171,17 +178,21 @@ void FileWriter::WriteBuffer() {
     return;
   }
 
-  ssize_t res = write(fd_, buffer_.get(), buffer_size_);
+  WriteUnbuffered(absl::string_view(buffer_.get(), buffer_size_));
+  buffer_size_ = 0;
+}
+
+void FileWriter::WriteUnbuffered(absl::string_view data) {
+  ssize_t res = write(fd_, data.data(), data.size());
   if (res == -1) {
     LOG(FATAL) << "Error writing chunk of Cord to file, errno: " << errno
                << ": " << std::strerror(errno) << ", filename: " << filename_;
   }
   bytes_written_ += res;
-  if (res < buffer_size_) {
+  if (static_cast<size_t>(res) < data.size()) {
     LOG(FATAL) << "Error writing chunk of Cord to file, size written: " << res
-               << ", size expected: " << buffer_size_;
+               << ", size expected: " << data.size();
   }
-  buffer_size_ = 0;
 }
 
 void FileWriter::Flush() {
@@ -9,6 +9,7 @@
 
 #include "absl/cleanup/cleanup.h"
 #include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
 
 namespace witnesskvs::log {
 
@@ -60,6 +61,8 @@ class FileWriter {
  private:
   void InitialSync(const std::filesystem::path& path);
   void WriteBuffer();
+  // Writes data straight to the file, bypassing the buffer.
+  void WriteUnbuffered(absl::string_view data);
 
   int fd_;
   std::string filename_;
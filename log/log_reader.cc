@@ -229,6 +229,13 @@ void LogReader::iterator::next() {
   pos = 0;
 }
 
+absl::StatusOr<long> LogReader::FirstMessagePos() { return ReadHeader(); }
+
+absl::StatusOr<Log::Message> LogReader::ReadMessageAt(long& pos) {
+  RETURN_IF_ERROR(ReadHeader().status());
+  return ReadNextMessage(pos);
+}
+
 absl::StatusOr<Log::Message> LogReader::next() {
   absl::MutexLock l(&lock_);
   return NextLocked();
@@ -80,6 +80,13 @@ class LogReader {
   // Returns the next message if any, or an error if not.
   absl::StatusOr<Log::Message> next() ABSL_LOCKS_EXCLUDED(lock_);
 
+  // Returns the position of the first message, right after the header.
+  absl::StatusOr<long> FirstMessagePos() ABSL_LOCKS_EXCLUDED(lock_);
+  // Returns the message at pos, e.g. one seen on an earlier pass, without
+  // reading the ones before it, and moves pos past it.
+  absl::StatusOr<Log::Message> ReadMessageAt(long& pos)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
  private:
   // Returns the position of the header or
   absl::StatusOr<Log::Message> NextLocked()
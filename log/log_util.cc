@@ -79,19 +79,21 @@ absl::StatusOr<FileParts> ParseFilename(absl::string_view filename) {
   return file_parts;
 }
 
-// Reads the list of files under prefix from the directory.
-// and optionally sorts them by their suffix (presumes suffix is a
-// uint64).
+// Reads the list of files under prefix from the directory, optionally
+// reconciling interrupted truncations first, and optionally sorts them by
+// their suffix (presumes suffix is a uint64).
 absl::StatusOr<std::vector<std::filesystem::path>> ReadDir(
-    absl::string_view dir, absl::string_view prefix, bool sort, bool cleanup) {
+    absl::string_view dir, absl::string_view prefix, bool cleanup, bool sort) {
   const std::filesystem::path path{std::string(dir)};
   struct FileEntry {
     uint64_t ext_micros;
     std::filesystem::path path;
   };
   absl::flat_hash_map<std::string, FileEntry> entries;
-  std::vector<std::string> cleanup_files;
-  absl::flat_hash_map<std::string, FileEntry> truncated_entries;
+  if (cleanup) {
+    // We may have crashed during a truncation.
+    ReconcileTruncations(dir, prefix);
+  }
   for (const auto& dir_entry : std::filesystem::directory_iterator{path}) {
     if (!dir_entry.is_regular_file()) {
       // TODO(mmucklo): maybe consider following symlinks or not?
@@ -111,42 +113,11 @@ absl::StatusOr<std::vector<std::filesystem::path>> ReadDir(
     }
     ASSIGN_OR_RETURN(FileParts file_parts, ParseFilename(filename));
     if (file_parts.prefix != prefix) {
-      // Either files to cleanup or we crashed during a truncation.
-      if (!cleanup) {
-        continue;
-      }
-      if (absl::StrCat(file_parts.prefix, "_truncated") == prefix) {
-        truncated_entries.emplace(filename,
-                                  FileEntry{.ext_micros = file_parts.micros,
-                                            .path = dir_entry.path()});
-      }
-    } else {
-      entries.emplace(filename, FileEntry{.ext_micros = file_parts.micros,
-                                          .path = dir_entry.path()});
-    }
-  }
-
-  if (cleanup && cleanup_files.size() > 0) {
-    CleanupFiles(cleanup_files);
-  }
-
-  // From our truncation algorithm, if we crash mid-file swap, we may have
-  // legit, but not swapped into place "_truncated" files hanging around.
-  //
-  // Any temporaries will get cleaned up separately as they have a different
-  // prefix.
-  if (truncated_entries.size() > 0) {
-    for (const auto& [filename, file_entry] : truncated_entries) {
-      std::string untruncated_filename =
-          absl::StrCat(prefix, ".", file_entry.ext_micros);
-      if (!entries.contains(untruncated_filename)) {
-        entries.emplace(
-            untruncated_filename,
-            FileEntry{.ext_micros = file_entry.ext_micros,
-                      .path = std::filesystem::path(untruncated_filename)});
-      }
-      ReplaceFile(untruncated_filename, filename);
+      // Temporaries of a truncation, see ReconcileTruncations().
+      continue;
     }
+    entries.emplace(filename, FileEntry{.ext_micros = file_parts.micros,
+                                        .path = dir_entry.path()});
   }
 
   // Convert to something sortable.
@@ -208,19 +179,11 @@ absl::Cord GetIdxCord(uint64_t min_idx, uint64_t max_idx) {
 
 void ReplaceFile(std::string orig_filename,
                  std::string new_filename) {
-  // If a crash happens here, our loading mechanism will reconcile the two
-  // files.
+  // rename(2) atomically replaces orig_filename, so a crash leaves either the
+  // original or the new file in its place, never neither. If a crash happens
+  // before it, ReconcileTruncations() finishes the swap.
   std::filesystem::path new_path(new_filename);
   std::filesystem::path orig_path(orig_filename);
-  if (std::filesystem::exists(orig_path)) {
-    if (!std::filesystem::remove(orig_path)) {
-      LOG(FATAL) << absl::StrCat(
-          "LogTruncator::DoSingleFileTruncation: Can't remove: ", orig_filename,
-          " ", std::strerror(errno));
-    }
-  }
-
-  // Now rename the perm_filename
   std::error_code ec;
   std::filesystem::rename(new_path, orig_path, ec);
   if (ec) {
@@ -234,6 +197,64 @@ void ReplaceFile(std::string orig_filename,
   FileWriter::SyncDir(dir);
 }
 
+void ReconcileTruncations(absl::string_view dir, absl::string_view prefix) {
+  const std::string truncation_prefix = absl::StrCat(prefix, "_truncation");
+  const std::string temp_prefix = absl::StrCat(prefix, "_temp_truncation");
+  const std::filesystem::path path{std::string(dir)};
+  std::vector<std::string> cleanup_files;
+  for (const auto& dir_entry : std::filesystem::directory_iterator{path}) {
+    if (!dir_entry.is_regular_file()) {
+      continue;
+    }
+    const std::string filename = dir_entry.path().filename();
+    absl::StatusOr<FileParts> file_parts = ParseFilename(filename);
+    if (!file_parts.ok()) {
+      continue;
+    }
+    if (file_parts->prefix == temp_prefix) {
+      // Never completely written, the original is still in place.
+      cleanup_files.push_back(dir_entry.path().string());
+    } else if (file_parts->prefix == truncation_prefix) {
+      // Complete and sync'd, but not swapped into place yet. The original may
+      // or may not still be there.
+      const std::filesystem::path orig_path =
+          dir_entry.path().parent_path() /
+          absl::StrCat(prefix, ".", file_parts->micros);
+      LOG(INFO) << "ReconcileTruncations: swapping " << dir_entry.path()
+                << " into place as " << orig_path;
+      ReplaceFile(orig_path.string(), dir_entry.path().string());
+    }
+  }
+  CleanupFiles(cleanup_files);
+}
+
+void CleanupSortTemporaries(absl::string_view dir, absl::string_view prefix) {
+  // See SortingLogsLoader::Init() for the naming.
+  const std::string sorted_prefix = absl::StrCat(prefix, "_sorted");
+  const std::string merge_prefix = absl::StrCat(prefix, "_merge_sorted");
+  const std::filesystem::path path{std::string(dir)};
+  std::vector<std::string> cleanup_files;
+  for (const auto& dir_entry : std::filesystem::directory_iterator{path}) {
+    if (!dir_entry.is_regular_file()) {
+      continue;
+    }
+    absl::StatusOr<FileParts> file_parts =
+        ParseFilename(dir_entry.path().filename().string());
+    if (!file_parts.ok()) {
+      continue;
+    }
+    if (absl::StartsWith(file_parts->prefix, sorted_prefix) ||
+        absl::StartsWith(file_parts->prefix, merge_prefix)) {
+      cleanup_files.push_back(dir_entry.path().string());
+    }
+  }
+  if (!cleanup_files.empty()) {
+    LOG(INFO) << "CleanupSortTemporaries: removing " << cleanup_files.size()
+              << " files under " << prefix;
+  }
+  CleanupFiles(cleanup_files);
+}
+
 void CleanupFiles(const std::vector<std::string>& files) {
   for (const auto& filename : files) {
     if (!std::filesystem::remove(std::filesystem::path(filename))) {
@@ -25,7 +25,15 @@ struct FileParts {
   uint64_t micros;
 };
 absl::StatusOr<FileParts> ParseFilename(absl::string_view filename);
+// Atomically replaces orig_filename with new_filename.
 void ReplaceFile(std::string orig_filename, std::string new_filename);
+// Finishes the truncations of segments under prefix in dir that a crash
+// interrupted: swaps completed truncated copies into place, and removes the
+// ones that were still being written.
+void ReconcileTruncations(absl::string_view dir, absl::string_view prefix);
+// Removes the temporaries a SortingLogsLoader for prefix left in dir if it
+// didn't get to clean up after itself (e.g. a crash during recovery).
+void CleanupSortTemporaries(absl::string_view dir, absl::string_view prefix);
 void CleanupFiles(const std::vector<std::string>& files);
 
 }  // namespace witnesskvs::log
@@ -11,6 +11,7 @@
 #include "absl/log/check.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/strings/str_join.h"
@@ -62,7 +63,8 @@ LogWriter::LogWriter(std::string dir, std::string prefix,
       entries_count_(0),
       max_idx_(kIdxSentinelValue),
       min_idx_(kIdxSentinelValue),
-      rotation_enabled_(true) {
+      rotation_enabled_(true),
+      micros_(0) {
   CheckWriteDir(dir_);
   CheckPrefix(prefix_);
   absl::MutexLock l(&lock_);
@@ -77,7 +79,8 @@ LogWriter::LogWriter(std::string filename, int64_t micros,
       total_entries_output_(0),
       max_idx_(kIdxSentinelValue),
       min_idx_(kIdxSentinelValue),
-      rotation_enabled_(false) {
+      rotation_enabled_(false),
+      micros_(0) {
   absl::MutexLock l(&lock_);
   InitFileWriterWithFileLocked(std::move(filename), micros);
 }
@@ -88,28 +91,42 @@ LogWriter::~LogWriter() {
   LOG(INFO) << "LogWriter::~LogWriter: filenames: "
             << absl::StrJoin(filenames_, ",");
   // If we have an open file, we need to write out the max_idx.
+  absl::MutexLock l(&lock_);
   if (file_writer_->bytes_received() > 0 && max_idx_ != kIdxSentinelValue) {
     std::filesystem::path prev_path =
         std::filesystem::path(file_writer_->filename());
     file_writer_.release();
     CHECK_EQ(file_writer_, nullptr);
     VLOG(2) << "Writing min_idx: " << min_idx_ << " max_idx: " << max_idx_;
-    FileWriter::WriteHeader(prev_path, GetIdxCord(min_idx_, max_idx_));
+    SealLocked(prev_path);
   }
 }
 
-void LogWriter::Write(absl::string_view str) {
+void LogWriter::SealLocked(const std::filesystem::path& path) {
+  lock_.AssertHeld();
+  FileWriter::WriteHeader(path, GetIdxCord(min_idx_, max_idx_));
+  if (seal_callback_) {
+    seal_callback_(path.string(), min_idx_, max_idx_);
+  }
+}
+
+void LogWriter::Write(const absl::Cord& msg) {
   absl::Cord cord;
-  const size_t size = str.size();
+  const size_t size = msg.size();
   cord.Append(byte_str(static_cast<uint64_t>(size)));
-  uint32_t crc32_res = static_cast<uint32_t>(absl::ComputeCrc32c(str));
+  absl::crc32c_t crc{0};
+  for (absl::string_view chunk : msg.Chunks()) {
+    crc = absl::ExtendCrc32c(crc, chunk);
+  }
+  uint32_t crc32_res = static_cast<uint32_t>(crc);
   VLOG(1) << "crc32_res: " << crc32_res;
   cord.Append(byte_str(crc32_res));
-  cord.Append(str);
+  // Shares msg's buffers, the only copy is FileWriter's.
+  cord.Append(msg);
   VLOG(2) << "LogWriter::Write size bytes: "
-          << byte_str(static_cast<uint64_t>(str.size()));
+          << byte_str(static_cast<uint64_t>(msg.size()));
   VLOG(2) << "LogWriter::Write crc32_res: " << crc32_res;
-  VLOG(2) << "LogWriter::Write str length: " << str.size();
+  VLOG(2) << "LogWriter::Write msg length: " << msg.size();
   file_writer_->Write(cord);
   return;
 }
@@ -128,19 +145,23 @@ void LogWriter::InitFileWriterWithFileLocked(const std::string& filename,
                                              const uint64_t micros) {
   file_writer_ = std::make_unique<FileWriter>(filename);
   filenames_.push_back(filename);
+  micros_ = micros;
   Log::Header header;
   header.set_timestamp_micros(micros);
   header.set_prefix(prefix_);
   header.set_id(micros);
-  std::string header_str;
-  header.SerializeToString(&header_str);
+  absl::Cord header_cord;
+  header.SerializeToCord(&header_cord);
 
   // We will update the max index at the end. For now set it to a temporary
   // value.
   file_writer_->Write(GetIdxCord(kIdxSentinelValue, kIdxSentinelValue));
-  Write(header_str);
+  Write(header_cord);
   VLOG(1) << "LogWriter::InitFileWriterLocked header bytes: "
           << file_writer_->bytes_received();
+  if (create_callback_) {
+    create_callback_(filename, micros);
+  }
 }
 
 void LogWriter::MaybeForceRotate() {
@@ -160,7 +181,7 @@ void LogWriter::RotateLocked() {
   std::filesystem::path prev_path =
       std::filesystem::path(file_writer_->filename());
   InitFileWriterLocked();
-  FileWriter::WriteHeader(prev_path, GetIdxCord(min_idx_, max_idx_));
+  SealLocked(prev_path);
   if (rotate_callback_) {
     // Let those who need to know that we rotated (e.g. LogTruncator who tracks
     // the file available to truncate).
@@ -211,12 +232,8 @@ std::vector<std::shared_ptr<LogWriter::ListEntry>> LogWriter::GetNextMsgBatch(
     absl::MutexLock wl(&write_list_lock_);
     uint64_t size = 0;
 
-    // Always get our own entry off the list first.
-    if (std::shared_ptr<ListEntry> shared = entry.lock(); shared != nullptr) {
-      size += shared->msg->size() + kSizeChecksumBytes;
-      msgs.push_back(shared);
-      write_list_.erase(shared->it);
-    } else {
+    std::shared_ptr<ListEntry> own = entry.lock();
+    if (own == nullptr) {
       // Our entry has already been written. Just return. Let another thread
       // handle the waiting messages. Since each thread is at minimum
       // responsible for its own message we are guaranteed that each message
@@ -225,42 +242,54 @@ std::vector<std::shared_ptr<LogWriter::ListEntry>> LogWriter::GetNextMsgBatch(
       // regardless.
       return msgs;
     }
+
+    // Take messages in the order they were enqueued, up to and including our
+    // own regardless of size, then more up to the threshold.
+    bool found_own = false;
     while (!write_list_.empty() &&
-           size < absl::GetFlag(FLAGS_log_writer_max_write_size_threshold)) {
+           (!found_own ||
+            size < absl::GetFlag(FLAGS_log_writer_max_write_size_threshold))) {
       std::shared_ptr<ListEntry> list_entry = write_list_.front();
-      size += list_entry->msg->size() + kSizeChecksumBytes;
+      size += list_entry->msg.size() + kSizeChecksumBytes;
+      found_own = found_own || list_entry == own;
       msgs.push_back(std::move(list_entry));
       write_list_.pop_front();
     }
+    CHECK(found_own);
   }
   return msgs;
 }
 
 absl::Status LogWriter::Log(const Log::Message& msg) {
+  absl::StatusOr<Pending> pending = Enqueue(msg);
+  if (!pending.ok()) {
+    return pending.status();
+  }
+  return Wait(*std::move(pending));
+}
+
+absl::StatusOr<LogWriter::Pending> LogWriter::Enqueue(const Log::Message& msg) {
   VLOG(2) << "LogWriter::Log msg(1): " << msg.DebugString();
-  // Append the message to the queue first.
-  std::weak_ptr<ListEntry> my_entry;
-  {
-    std::string msg_str;
-    msg.AppendToString(&msg_str);
-    if (msg_str.size() > absl::GetFlag(FLAGS_log_writer_max_msg_size)) {
-      return absl::OutOfRangeError(absl::StrFormat(
-          "msg size when serialized '%d' is greater than max '%d'.",
-          msg_str.size(), absl::GetFlag(FLAGS_log_writer_max_msg_size)));
-    }
-    VLOG(2) << "LogWriter::Log msg(2): " << msg.DebugString();
-    const uint64_t idx = idxfn_ ? idxfn_(msg) : kIdxSentinelValue;
-    VLOG(2) << "found idx: " << idx;
-    std::shared_ptr<ListEntry> entry = std::make_shared<ListEntry>(
-        std::make_unique<std::string>(std::move(msg_str)), idx);
-    my_entry = entry;
-    absl::MutexLock wl(&write_list_lock_);
-    // unique_ptr used here as a hack to get around copies when going in and out
-    // of the queue.
-    write_list_.push_back(entry);
-    entry->it = --(write_list_.end());
+  // Append the message to the queue.
+  // Large Cord fields (e.g. paxos values) are referenced rather than copied.
+  absl::Cord msg_cord;
+  msg.AppendToCord(&msg_cord);
+  if (msg_cord.size() > absl::GetFlag(FLAGS_log_writer_max_msg_size)) {
+    return absl::OutOfRangeError(absl::StrFormat(
+        "msg size when serialized '%d' is greater than max '%d'.",
+        msg_cord.size(), absl::GetFlag(FLAGS_log_writer_max_msg_size)));
   }
+  VLOG(2) << "LogWriter::Log msg(2): " << msg.DebugString();
+  const uint64_t idx = idxfn_ ? idxfn_(msg) : kIdxSentinelValue;
+  VLOG(2) << "found idx: " << idx;
+  std::shared_ptr<ListEntry> entry = std::make_shared<ListEntry>(std::move(msg_cord), idx);
+  Pending pending = entry;
+  absl::MutexLock wl(&write_list_lock_);
+  write_list_.push_back(std::move(entry));
+  return pending;
+}
 
+absl::Status LogWriter::Wait(Pending my_entry) {
   // Read all pending messages off the queue and write them.
   //
   // NOTE: because this will in some cases result in an I/O operation,
@@ -278,12 +307,14 @@ absl::Status LogWriter::Log(const Log::Message& msg) {
 
     // Loop over any waiting messages and write them, as long as messages
     // are still on the queue
+    bool wrote = false;
     while (true) {
       // Get messages off the queue.
       std::vector<std::shared_ptr<ListEntry>> msgs = GetNextMsgBatch(my_entry);
       if (msgs.empty()) {
         break;
       }
+      wrote = true;
 
       // This is where we write the log messages to disk.
       //
@@ -291,10 +322,9 @@ absl::Status LogWriter::Log(const Log::Message& msg) {
       for (std::shared_ptr<ListEntry>& entry : msgs) {
         // Size estimate of the next log entry (includes length (8) and checksum
         // (4))
-        CHECK_NE(entry->msg, nullptr);
-        const uint64_t size_est = entry->msg->length() + kSizeChecksumBytes;
+        const uint64_t size_est = entry->msg.size() + kSizeChecksumBytes;
         MaybeRotate(size_est);
-        Write(*entry->msg);
+        Write(entry->msg);
         ++entries_count_;
         ++total_entries_output_;
 
@@ -313,8 +343,9 @@ absl::Status LogWriter::Log(const Log::Message& msg) {
       }
     }
     // This will be the operation that could stall a bit.
-    // So we do this after all writes have been done.
-    if (!skip_flush_) {
+    // So we do this after all writes have been done. If another thread
+    // already wrote our message it also sync'd it before releasing lock_.
+    if (wrote && !skip_flush_) {
       file_writer_->Flush();
     }
   }
@@ -352,6 +383,28 @@ void LogWriter::RegisterRotateCallback(
   rotate_callback_ = std::move(fn);
 }
 
+void LogWriter::RegisterCreateCallback(
+    absl::AnyInvocable<void(std::string, int64_t)> fn) {
+  absl::MutexLock l(&lock_);
+  create_callback_ = std::move(fn);
+  if (file_writer_ != nullptr) {
+    create_callback_(file_writer_->filename(), micros_);
+  }
+}
+
+void LogWriter::RegisterSealCallback(
+    absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> fn) {
+  absl::MutexLock l(&lock_);
+  seal_callback_ = std::move(fn);
+}
+
+void LogWriter::Flush() {
+  absl::MutexLock l(&lock_);
+  if (file_writer_ != nullptr) {
+    file_writer_->Flush();
+  }
+}
+
 int64_t LogWriter::total_entries_output() const {
   absl::MutexLock l(&lock_);
   return total_entries_output_;
@@ -11,6 +11,8 @@
 
 #include "absl/base/thread_annotations.h"
 #include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/cord.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
 #include "log.pb.h"
@@ -20,7 +22,13 @@ namespace witnesskvs::log {
 class LogWriterTestPeer;
 
 class LogWriter {
+ private:
+  struct ListEntry;
+
  public:
+  // A message enqueued but possibly not yet written, see Enqueue().
+  using Pending = std::weak_ptr<ListEntry>;
+
   LogWriter() = delete;
   // Create a LogWriter with directory and filename prefix as specified.
 
@@ -43,12 +51,37 @@ class LogWriter {
   // Logs msg, returns when sync'd.
   absl::Status Log(const Log::Message& msg);
 
+  // Enqueue() and Wait() split Log() in two so that callers can order their
+  // messages under their own lock, then wait for durability outside of it.
+  //
+  // Messages are written out in the order they're enqueued, so once Wait()
+  // returns for a message, every message enqueued before it is sync'd too.
+  // Every message enqueued needs to be waited on, or it's only written out
+  // along with a later message.
+  absl::StatusOr<Pending> Enqueue(const Log::Message& msg);
+
+  // Returns once the message for pending has been written and sync'd.
+  absl::Status Wait(Pending pending);
+
   // Will force a log rotation if the file has any entries.
   void MaybeForceRotate();
 
   void RegisterRotateCallback(
       absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> fn);
 
+  // Registers a callback called with (filename, micros) whenever a new log file
+  // is created. It's called immediately for the log file currently in use.
+  void RegisterCreateCallback(absl::AnyInvocable<void(std::string, int64_t)> fn);
+
+  // Registers a callback called with (filename, min_idx, max_idx) whenever a
+  // log file is sealed, i.e. its header is written out on rotation or on
+  // destruction, after which no more entries go to it.
+  void RegisterSealCallback(
+      absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> fn);
+
+  // Writes out and syncs anything buffered, e.g. while skip_flush is set.
+  void Flush();
+
   // Returns the current filename in use.
   std::string filename() const ABSL_LOCKS_EXCLUDED(lock_);
 
@@ -61,11 +94,10 @@ class LogWriter {
 
  private:
   struct ListEntry {
-    std::list<std::shared_ptr<ListEntry>>::iterator it;
-    std::unique_ptr<std::string> msg;
+    // The serialized message, sharing the buffers of its Cord fields.
+    absl::Cord msg;
     uint64_t idx;
-    explicit ListEntry(std::unique_ptr<std::string> m, uint64_t i)
-        : msg(std::move(m)), idx(i) {}
+    explicit ListEntry(absl::Cord m, uint64_t i) : msg(std::move(m)), idx(i) {}
   };
 
   // Initializes a new FileWriter.
@@ -74,9 +106,14 @@ class LogWriter {
                                     uint64_t micros)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  // Writes a raw str to the log, preceeding with size, and ending with a 32-bit
+  // Writes the min/max idx header of the current file and notifies
+  // seal_callback_.
+  void SealLocked(const std::filesystem::path& path)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Writes a raw msg to the log, preceeding with size, and ending with a 32-bit
   // checksum.
-  void Write(absl::string_view str) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void Write(const absl::Cord& msg) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
   // Writes the idx specified at the beginning of the file, with a checksum.
   void WriteIdx(uint64_t idx);
@@ -96,8 +133,10 @@ class LogWriter {
   // write.
   //
   // Nevertheless we use the weak_ptr entry to ensure that we at least return a
-  // vector containing that element so that we can be sure we've logged our own
-  // message even if we leave other messages still waiting on the list.
+  // vector reaching up to that element so that we can be sure we've logged our
+  // own message even if we leave other messages still waiting on the list.
+  // Messages are always taken from the front, so they're written in the order
+  // enqueued.
   //
   // The reason we expect that messages will queue up is that we serialize
   // writes out to the log file. These writes in order to be durable call a sync
@@ -133,6 +172,11 @@ class LogWriter {
   const bool rotation_enabled_;
   absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> rotate_callback_
       ABSL_GUARDED_BY(lock_);
+  absl::AnyInvocable<void(std::string, int64_t)> create_callback_
+      ABSL_GUARDED_BY(lock_);
+  absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> seal_callback_
+      ABSL_GUARDED_BY(lock_);
+  int64_t micros_ ABSL_GUARDED_BY(lock_);  // micros of the current file.
   friend LogWriterTestPeer;
 };
 
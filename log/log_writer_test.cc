@@ -17,6 +17,7 @@
 #include "absl/strings/str_join.h"
 #include "absl/time/time.h"
 #include "log.pb.h"
+#include "log_reader.h"
 #include "tests/test_util.h"
 #include "third_party/absl_local/test_macros.h"
 
@@ -25,6 +26,7 @@ ABSL_DECLARE_FLAG(uint64_t, log_writer_max_msg_size);
 ABSL_DECLARE_FLAG(std::string, tests_test_util_temp_dir);
 
 using ::testing::AllOf;
+using ::testing::ElementsAre;
 using ::testing::HasSubstr;
 using ::testing::Not;
 MATCHER(IsError, "") { return (!arg.ok()); }
@@ -101,5 +103,40 @@ TEST(LogWriterTest, Rotation) {
   ASSERT_THAT(witnesskvs::test::Cleanup(cleanup_files), IsOk());
 }
 
+TEST(LogWriterTest, EnqueueWaitInOrder) {
+  std::vector<std::string> cleanup_files;
+  {
+    LogWriter log_writer(
+        absl::GetFlag(FLAGS_tests_test_util_temp_dir), "log_writer_test",
+        [](const Log::Message& msg) { return msg.paxos().idx(); });
+    std::vector<LogWriter::Pending> pending;
+    for (int i = 0; i < 5; i++) {
+      Log::Message log_message;
+      log_message.mutable_paxos()->set_idx(i);
+      absl::StatusOr<LogWriter::Pending> p = log_writer.Enqueue(log_message);
+      ASSERT_THAT(p.status(), IsOk());
+      pending.push_back(*p);
+    }
+    EXPECT_EQ(log_writer.total_entries_output(), 0);
+
+    // Waiting on a message also writes everything enqueued before it.
+    EXPECT_THAT(log_writer.Wait(pending[2]), IsOk());
+    EXPECT_GE(log_writer.total_entries_output(), 3);
+    for (int i = 0; i < 5; i++) {
+      EXPECT_THAT(log_writer.Wait(pending[i]), IsOk());
+    }
+    EXPECT_EQ(log_writer.total_entries_output(), 5);
+    cleanup_files = log_writer.filenames();
+  }
+  ASSERT_EQ(cleanup_files.size(), 1);
+  std::vector<uint64_t> indexes;
+  LogReader log_reader(cleanup_files[0]);
+  for (const Log::Message& msg : log_reader) {
+    indexes.push_back(msg.paxos().idx());
+  }
+  EXPECT_THAT(indexes, ElementsAre(0, 1, 2, 3, 4));
+  ASSERT_THAT(witnesskvs::test::Cleanup(cleanup_files), IsOk());
+}
+
 }  // namespace
 }  // namespace witnesskvs::log
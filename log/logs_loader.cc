@@ -55,6 +55,13 @@ LogsLoader::LogsLoader(
     std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn)
     : files_(std::move(files)), sortfn_(std::move(sortfn)) {}
 
+LogsLoader::LogsLoader(const Manifest& manifest)
+    : LogsLoader(manifest.files()) {}
+LogsLoader::LogsLoader(
+    const Manifest& manifest,
+    std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn)
+    : LogsLoader(manifest.files(), std::move(sortfn)) {}
+
 void LogsLoader::Init(absl::string_view dir, absl::string_view prefix) {
   CheckReadDir(dir);
   CheckPrefix(prefix);
@@ -202,10 +209,11 @@ std::vector<std::string> SortLogsFile(
   return log_writer.filenames();
 }
 
-// Merges the list of input_prefixes into output_prefix in directory dir.
+// Merges the sorted runs in inputs, each a list of the files it was written
+// to, into output_prefix in directory dir.
 // Returns a list of filenames outputted into.
 std::vector<std::string> MergeSortedFiles(
-    absl::string_view dir, const std::vector<std::string>& input_prefixes,
+    absl::string_view dir, const std::vector<std::vector<std::string>>& inputs,
     absl::string_view output_prefix,
     const std::function<bool(const Log::Message& a, const Log::Message& b)>&
         sortfn) {
@@ -224,9 +232,9 @@ std::vector<std::string> MergeSortedFiles(
   std::set<LogMessageContainer, decltype(cmp)> ordered_messages(cmp);
 
   // Initialize the set of messages.
-  for (const auto& prefix : input_prefixes) {
-    std::shared_ptr<LogsLoader> logs_loader =
-        std::make_shared<LogsLoader>(dir, prefix);
+  for (const auto& input : inputs) {
+    std::shared_ptr<LogsLoader> logs_loader = std::make_shared<LogsLoader>(
+        std::vector<std::filesystem::path>(input.begin(), input.end()));
     LogMessageContainer container{.logs_loader = logs_loader,
                                   .it = logs_loader->begin()};
     if (container.it != logs_loader->end()) {
@@ -255,20 +263,19 @@ std::vector<std::string> MergeSortedFiles(
 SortingLogsLoader::SortingLogsLoader(
     absl::string_view dir, absl::string_view prefix,
     std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn) {
-  Init(dir, prefix, std::move(sortfn));
+  CheckReadDir(dir);
+  CheckPrefix(prefix);
+  absl::StatusOr<std::vector<std::filesystem::path>> entries =
+      ReadDir(dir, prefix, /*cleanup=*/true, /*sort=*/false);
+  CHECK_OK(entries) << "Bad result reading the directory: "
+                    << entries.status().ToString();
+  Init(dir, prefix, std::move(entries.value()), std::move(sortfn));
 }
 
-void CleanupDir(absl::string_view dir, absl::string_view prefix) {
-  absl::StatusOr<std::vector<std::filesystem::path>> entries =
-      ReadDir(dir, prefix, /*cleanup=*/false, /*sort=*/false);
-  CHECK_OK(entries);
-  if (entries.value().size() > 0) {
-    std::vector<std::string> files;
-    for (const auto& entry : entries.value()) {
-      files.push_back(entry.string());
-    }
-    CleanupFiles(files);
-  }
+SortingLogsLoader::SortingLogsLoader(
+    const Manifest& manifest,
+    std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn) {
+  Init(manifest.dir(), manifest.prefix(), manifest.files(), std::move(sortfn));
 }
 
 // Sorting the files will cause some temporary files to be created.
@@ -280,24 +287,19 @@ void CleanupDir(absl::string_view dir, absl::string_view prefix) {
 // worst case space blowup should be O(2n).
 void SortingLogsLoader::Init(
     absl::string_view dir, absl::string_view prefix,
+    std::vector<std::filesystem::path> files,
     std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn) {
   CheckReadDir(dir);
   CheckPrefix(prefix);
+  // Temporaries left behind by a crash are removed when the Manifest is
+  // recovered, see CleanupSortTemporaries(). The ones written here are tracked
+  // by name, so any that are still around don't get in the way.
   const std::string prefix_sorted = absl::StrCat(prefix, "_sorted");
   const std::string prefix_merge = absl::StrCat(prefix, "_merge_sorted");
-  CleanupDir(dir, prefix_sorted);
-  CleanupDir(dir, prefix_merge);
-
-  absl::StatusOr<std::vector<std::filesystem::path>> entries =
-      ReadDir(dir, prefix, /*cleanup=*/true, /*sort=*/false);
-  CHECK_OK(entries) << "Bad result reading the directory: "
-                    << entries.status().ToString();
-  std::vector<std::filesystem::path> files = std::move(entries.value());
 
   // Step 1, sort all the files.
-  std::vector<std::string>
-      sorted_prefixes;  // This will be a list of all the file prefixes that has
-                        // been sorted.
+  std::vector<std::vector<std::string>>
+      sorted_runs;  // This will be a list of the files of each sorted run.
   std::vector<std::string>
       cleanup_files;  // This will be an ongoing list of temporary intermediate
                       // files to cleanup.
@@ -305,12 +307,12 @@ void SortingLogsLoader::Init(
     uint64_t sort_idx = 0;
     for (auto& path : files) {
       std::string prefix_sorted_idx = absl::StrCat(prefix_sorted, sort_idx);
-      sorted_prefixes.push_back(prefix_sorted_idx);
       std::vector<std::string> sorted_files =
           SortLogsFile(path, prefix_sorted_idx, sortfn);
       sort_idx++;
       cleanup_files.insert(cleanup_files.end(), sorted_files.begin(),
                            sorted_files.end());
+      sorted_runs.push_back(std::move(sorted_files));
     }
   }
 
@@ -322,20 +324,20 @@ void SortingLogsLoader::Init(
   CHECK_GT(max_files, 1);
   VLOG(1) << "SortingLogsLoader: max_files: " << max_files;
   int merge_round = 0;
-  while (sorted_prefixes.size() > 0) {
+  while (sorted_runs.size() > 0) {
     merge_round++;
-    std::list<std::vector<std::string>> merge_lists;
-    std::vector<std::string> cur_paths;
-    for (size_t i = 0; i < sorted_prefixes.size(); i++) {
+    std::list<std::vector<std::vector<std::string>>> merge_lists;
+    std::vector<std::vector<std::string>> cur_runs;
+    for (size_t i = 0; i < sorted_runs.size(); i++) {
       if ((i + 1) % max_files == 0) {
-        merge_lists.push_back(cur_paths);
-        cur_paths.clear();
+        merge_lists.push_back(cur_runs);
+        cur_runs.clear();
       }
-      cur_paths.push_back(sorted_prefixes[i]);
+      cur_runs.push_back(std::move(sorted_runs[i]));
     }
-    merge_lists.push_back(cur_paths);
-    cur_paths.clear();
-    sorted_prefixes.clear();
+    merge_lists.push_back(cur_runs);
+    cur_runs.clear();
+    sorted_runs.clear();
     CHECK_GT(merge_lists.size(), 0);
 
     // Final merge.
@@ -347,6 +349,7 @@ void SortingLogsLoader::Init(
 
     // Intermediary merge.
     uint64_t group = 0;
+    std::vector<std::string> round_files;
     for (auto& merge_list : merge_lists) {
       ++group;
       std::string prefix_merge_round =
@@ -354,12 +357,15 @@ void SortingLogsLoader::Init(
       CHECK_GT(merge_list.size(), 0);
       std::vector<std::string> merge_files =
           MergeSortedFiles(dir, merge_list, prefix_merge_round, sortfn);
-      sorted_prefixes.push_back(prefix_merge_round);
-
-      // Can get rid of intermediate files now.
-      CleanupFiles(cleanup_files);
-      cleanup_files.swap(merge_files);
+      round_files.insert(round_files.end(), merge_files.begin(),
+                         merge_files.end());
+      sorted_runs.push_back(std::move(merge_files));
     }
+
+    // Can get rid of the previous round's files now that every group of this
+    // round has been merged out of them.
+    CleanupFiles(cleanup_files);
+    cleanup_files.swap(round_files);
   }
 
   if (cleanup_files.size() > 0) {
@@ -367,7 +373,9 @@ void SortingLogsLoader::Init(
     cleanup_files.clear();
   }
 
-  logs_loader_ = std::make_unique<LogsLoader>(dir, prefix_merge);
+  logs_loader_ = std::make_unique<LogsLoader>(
+      std::vector<std::filesystem::path>(temp_files_.begin(),
+                                         temp_files_.end()));
   prefix_merge_ = prefix_merge;
 }
 
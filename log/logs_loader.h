@@ -9,6 +9,7 @@
 #include "absl/strings/string_view.h"
 #include "log.pb.h"
 #include "log_reader.h"
+#include "manifest.h"
 
 namespace witnesskvs::log {
 
@@ -60,8 +61,8 @@ struct logs_iterator {
 };
 
 /**
- * A LogsLoader that takes in a directory and a prefix and provides an
- * iterator to read all the log entries out.
+ * A LogsLoader that takes in the segments of a log, normally from its
+ * Manifest, and provides an iterator to read all the log entries out.
  *
  * Optionally takes in a sort function to sort the entries first before
  * returning them. Sorting requires a certain amount of memory to
@@ -75,9 +76,18 @@ class LogsLoader {
   LogsLoader(const LogsLoader&) = delete;
   LogsLoader& operator=(const LogsLoader&) = delete;
 
+  // Reads the segments listed in the manifest.
+  explicit LogsLoader(const Manifest& manifest);
+  LogsLoader(
+      const Manifest& manifest,
+      std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn);
+
   // dir is the directory to find the log messages
   // prefix is the file naming scheme.
   //
+  // Lists the directory to find the segments, intended for directories that
+  // aren't tracked by a Manifest (e.g. inspecting a log from a test or tool).
+  //
   // TODO(mmucklo) - RAFT dissertation seems to call a prefix something
   // discardable like the timestamp we use to suffix our logfiles. Maybe we
   // should try to see if this is standard convention and if so, maybe call this
@@ -177,9 +187,18 @@ class SortingLogsLoader {
   SortingLogsLoader(const SortingLogsLoader&) = delete;
   SortingLogsLoader& operator=(const SortingLogsLoader&) = delete;
   ~SortingLogsLoader();
+  // Sorts the segments listed in the manifest.
+  // sortfn is the logs sorting function.
+  SortingLogsLoader(
+      const Manifest& manifest,
+      std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn);
+
   // dir is the directory to find the log messages.
   // prefix is the file naming scheme.
-  // sortfn is the logs sorting function.
+  //
+  // Same as above but lists the directory to find the segments, intended for
+  // directories that aren't tracked by a Manifest (e.g. inspecting a log from a
+  // test or tool).
   SortingLogsLoader(
       absl::string_view dir, absl::string_view prefix,
       std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn);
@@ -208,6 +227,7 @@ class SortingLogsLoader {
  private:
   void Init(
       absl::string_view dir, absl::string_view prefix,
+      std::vector<std::filesystem::path> files,
       std::function<bool(const Log::Message& a, const Log::Message& b)> sortfn);
   std::unique_ptr<LogsLoader> logs_loader_;
   std::optional<std::string> prefix_merge_;
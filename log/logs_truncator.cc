@@ -1,5 +1,6 @@
 #include "logs_truncator.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <functional>
 #include <memory>
@@ -26,22 +27,58 @@
 #include "log_writer.h"
 #include "third_party/mediapipe/status_macros.h"
 
+ABSL_FLAG(uint64_t, logs_truncator_delete_bytes_per_sec, 64 << 20,
+          "Maximum rate at which the truncator frees disk space when deleting "
+          "log files. 0 means unlimited.");
+
+ABSL_FLAG(uint64_t, logs_truncator_delete_chunk_bytes, 8 << 20,
+          "Files larger than this are shrunk by this many bytes at a time "
+          "before being unlinked, so their extents are freed gradually.");
+
+ABSL_FLAG(uint64_t, logs_truncator_delete_batch_size, 16,
+          "Number of files deleted between directory syncs.");
+
 namespace witnesskvs::log {
 
 extern const uint64_t kIdxSentinelValue;
 
 LogsTruncator::LogsTruncator(std::string dir, std::string prefix,
                              std::function<uint64_t(const Log::Message&)> idxfn)
+    : LogsTruncator(std::move(dir), std::move(prefix), std::move(idxfn),
+                    nullptr) {}
+
+LogsTruncator::LogsTruncator(std::string dir, std::string prefix,
+                             std::function<uint64_t(const Log::Message&)> idxfn,
+                             std::shared_ptr<Manifest> manifest)
     : dir_(std::move(dir)),
       prefix_(std::move(prefix)),
-      idxfn_(std::move(idxfn)) {
+      idxfn_(std::move(idxfn)),
+      manifest_(std::move(manifest)) {
+  {
+    absl::MutexLock l(&lock_);
+    now_fn_ = [] { return absl::Now(); };
+    sleep_fn_ = [](absl::Duration duration) { absl::SleepFor(duration); };
+  }
   Init();
   worker_ = std::jthread(std::bind_front(&LogsTruncator::Run, this));
 }
 
 LogsTruncator::~LogsTruncator() {
-  absl::MutexLock l(&queue_lock_);
-  worker_.get_stop_source().request_stop();
+  {
+    absl::MutexLock l(&queue_lock_);
+    worker_.get_stop_source().request_stop();
+  }
+  // Wait for any in-flight truncation here, before the members it uses are
+  // destroyed.
+  worker_.join();
+}
+
+void LogsTruncator::SetClockForTest(
+    std::function<absl::Time()> now_fn,
+    std::function<void(absl::Duration)> sleep_fn) {
+  absl::MutexLock l(&lock_);
+  now_fn_ = std::move(now_fn);
+  sleep_fn_ = std::move(sleep_fn);
 }
 
 void LogsTruncator::Truncate(TruncationIdx max_idx) {
@@ -75,7 +112,7 @@ void LogsTruncator::Run(std::stop_token stop_token) {
       queue_.pop();
     }
     if (std::holds_alternative<TruncationIdx>(entry)) {
-      DoTruncation(std::get<TruncationIdx>(entry));
+      DoTruncation(std::get<TruncationIdx>(entry), stop_token);
     } else {
       CHECK(std::holds_alternative<TruncationFileInfo>(entry));
       TruncationFileInfo& file_info = std::get<TruncationFileInfo>(entry);
@@ -94,8 +131,8 @@ void LogsTruncator::Run(std::stop_token stop_token) {
   }
 }
 
-void LogsTruncator::DoSingleFileTruncation(absl::string_view filename,
-                                           uint64_t max_idx) {
+LogsTruncator::TruncationFileInfo LogsTruncator::DoSingleFileTruncation(
+    absl::string_view filename, uint64_t max_idx) {
   /***
    * Algorithm
    *   Read file and write out temporary version in a single file, discarding
@@ -107,9 +144,7 @@ void LogsTruncator::DoSingleFileTruncation(absl::string_view filename,
    *
    *   Sync Directory.
    *
-   *   Remove original file
-   *
-   *   Move semi-permanent to original file
+   *   Move semi-permanent over the original file, atomically replacing it
    *
    *   Sync Directory.
    *
@@ -128,6 +163,8 @@ void LogsTruncator::DoSingleFileTruncation(absl::string_view filename,
   const std::string temp_filename =
       absl::StrCat(file_parts.prefix, "_temp_truncation.", file_parts.micros);
   LOG(INFO) << "LogsTruncation temp_filename: " << temp_filename;
+  TruncationFileInfo kept{.min_idx = kIdxSentinelValue,
+                          .max_idx = kIdxSentinelValue};
   {
     const std::string filename_str(filename);
     LogReader log_reader(filename_str);
@@ -142,6 +179,12 @@ void LogsTruncator::DoSingleFileTruncation(absl::string_view filename,
         continue;
       }
       ++kept_count;
+      if (kept.min_idx == kIdxSentinelValue || kept.min_idx > idx) {
+        kept.min_idx = idx;
+      }
+      if (kept.max_idx == kIdxSentinelValue || kept.max_idx < idx) {
+        kept.max_idx = idx;
+      }
       absl::Status status = log_writer.Log(msg);
       if (!status.ok()) {
         LOG(FATAL) << "Could not log: " << temp_filename << status.ToString();
@@ -166,45 +209,138 @@ void LogsTruncator::DoSingleFileTruncation(absl::string_view filename,
   std::string dir = std::filesystem::path(perm_filename).parent_path().string();
   FileWriter::SyncDir(dir);
   // We are assured at this point that both perm_filename and filename exists.
-  // Now we can safely delete filename.
-
   // If a crash happens here, our loading mechanism will reconcile the two
   // files.
   LOG(INFO) << "LogsTruncation replace " << filename
             << " with perm_filename: " << perm_filename;
   ReplaceFile(std::string(filename), perm_filename);
+  return kept;
 }
 
-void LogsTruncator::DoTruncation(uint64_t max_idx) {
+void LogsTruncator::DoTruncation(uint64_t max_idx,
+                                 std::stop_token stop_token) {
   LOG(INFO) << "LogsTruncator::DoTruncation max_idx: " << max_idx;
-  absl::MutexLock l(&lock_);
-  std::vector<std::string> erase_files;
-  for (const auto& [filename, file_info] : filename_max_idx_) {
-    if (file_info.max_idx < max_idx) {
-      // Delete file.
-      LOG(INFO) << "LogsTruncator: deleting: " << filename
-                << " max_idx: " << file_info.max_idx << " < " << max_idx;
-      if (!std::filesystem::remove(std::filesystem::path(filename))) {
-        LOG(FATAL) << absl::StrCat(
-            "LogsTruncator::DoTruncation: Can't remove: ", filename, " ",
-            std::strerror(errno));
+  std::vector<std::string> delete_files;
+  std::vector<std::string> truncate_files;
+  {
+    absl::MutexLock l(&lock_);
+    for (const auto& [filename, file_info] : filename_max_idx_) {
+      if (file_info.max_idx < max_idx) {
+        LOG(INFO) << "LogsTruncator: deleting: " << filename
+                  << " max_idx: " << file_info.max_idx << " < " << max_idx;
+        delete_files.push_back(filename);
+      } else if (file_info.min_idx < max_idx) {
+        // can remove individual entries...
+        LOG(INFO) << "LogsTruncator: truncating: " << filename
+                  << " min_idx: " << file_info.min_idx
+                  << " max_idx: " << file_info.max_idx;
+        truncate_files.push_back(filename);
       }
-      erase_files.push_back(filename);
-    } else if (file_info.min_idx < max_idx) {
-      // can remove individual entries...
-      LOG(INFO) << "LogsTruncator: truncating: " << filename
-                << " min_idx: " << file_info.min_idx
-                << " max_idx: " << file_info.max_idx;
-      DoSingleFileTruncation(filename, max_idx);
-      CHECK(filename_max_idx_.contains(filename))
+    }
+    for (const auto& file : delete_files) {
+      CHECK_EQ(filename_max_idx_.erase(file), 1);
+    }
+  }
+
+  // filename_max_idx_ is only modified from the worker thread, so we don't
+  // need to hold lock_ through the I/O below.
+  std::vector<std::pair<std::string, TruncationFileInfo>> truncated_files;
+  for (const auto& file : truncate_files) {
+    TruncationFileInfo kept = DoSingleFileTruncation(file, max_idx);
+    if (manifest_ != nullptr) {
+      manifest_->RecordTruncate(file, kept.min_idx, kept.max_idx);
+    }
+    truncated_files.emplace_back(file, kept);
+  }
+  {
+    absl::MutexLock l(&lock_);
+    for (const auto& [file, kept] : truncated_files) {
+      CHECK(filename_max_idx_.contains(file))
           << "Strange, expected filename in the filename_max_idx_ table: "
-          << filename;
-      CHECK_OK(ReadHeader(std::filesystem::path(filename), false))
-          << "Trouble reading header of " << filename;
+          << file;
+      TruncationFileInfo& file_info = filename_max_idx_[file];
+      file_info.min_idx = kept.min_idx;
+      file_info.max_idx = kept.max_idx;
     }
   }
-  for (const auto& file : erase_files) {
-    CHECK_EQ(filename_max_idx_.erase(file), 1);
+
+  DeleteFiles(delete_files, stop_token);
+}
+
+void LogsTruncator::DeleteFiles(const std::vector<std::string>& filenames,
+                                std::stop_token stop_token) {
+  if (filenames.empty()) {
+    return;
+  }
+  const uint64_t bytes_per_sec =
+      absl::GetFlag(FLAGS_logs_truncator_delete_bytes_per_sec);
+  const uint64_t chunk_bytes = std::max<uint64_t>(
+      1, absl::GetFlag(FLAGS_logs_truncator_delete_chunk_bytes));
+  const uint64_t batch_size = std::max<uint64_t>(
+      1, absl::GetFlag(FLAGS_logs_truncator_delete_batch_size));
+
+  std::function<absl::Time()> now_fn;
+  std::function<void(absl::Duration)> sleep_fn;
+  {
+    absl::MutexLock l(&lock_);
+    now_fn = now_fn_;
+    sleep_fn = sleep_fn_;
+  }
+
+  const absl::Time start = now_fn();
+  uint64_t bytes_deleted = 0;
+  // Sleeps as needed to keep the deletion rate at or under bytes_per_sec. On
+  // shutdown we just finish up as quickly as possible.
+  auto pace = [&](uint64_t bytes) {
+    bytes_deleted += bytes;
+    if (bytes_per_sec == 0 || stop_token.stop_requested()) {
+      return;
+    }
+    const absl::Duration target =
+        absl::Seconds(static_cast<double>(bytes_deleted) / bytes_per_sec);
+    const absl::Duration elapsed = now_fn() - start;
+    if (elapsed < target) {
+      sleep_fn(target - elapsed);
+    }
+  };
+
+  for (size_t begin = 0; begin < filenames.size(); begin += batch_size) {
+    const size_t end = std::min(filenames.size(), begin + batch_size);
+    const std::vector<std::string> batch(filenames.begin() + begin,
+                                         filenames.begin() + end);
+    if (manifest_ != nullptr) {
+      // Record first, if we crash before the unlink the file is merely
+      // orphaned rather than referenced but missing (or partially shrunk).
+      manifest_->RecordDeletes(batch);
+    }
+    for (const auto& filename : batch) {
+      const std::filesystem::path path(filename);
+      std::error_code ec;
+      uint64_t size = std::filesystem::file_size(path, ec);
+      if (ec) {
+        LOG(FATAL) << "LogsTruncator::DeleteFiles: Can't stat: " << filename
+                   << ": " << ec.message();
+      }
+      // Shrinking from the end keeps the header and the leading records
+      // readable should we crash part way through.
+      while (size > chunk_bytes) {
+        size -= chunk_bytes;
+        std::filesystem::resize_file(path, size, ec);
+        if (ec) {
+          LOG(FATAL) << "LogsTruncator::DeleteFiles: Can't resize: "
+                     << filename << ": " << ec.message();
+        }
+        pace(chunk_bytes);
+      }
+      if (!std::filesystem::remove(path)) {
+        LOG(FATAL) << absl::StrCat("LogsTruncator::DeleteFiles: Can't remove: ",
+                                   filename, " ", std::strerror(errno));
+      }
+      pace(size);
+    }
+    FileWriter::SyncDir(dir_);
+    VLOG(1) << "LogsTruncator::DeleteFiles deleted batch of " << batch.size()
+            << " files, " << bytes_deleted << " bytes so far.";
   }
 }
 
@@ -265,6 +401,22 @@ absl::Status LogsTruncator::ReadHeader(const std::filesystem::path& path,
 void LogsTruncator::Init() {
   CheckReadDir(dir_);
   CheckPrefix(prefix_);
+  if (manifest_ != nullptr) {
+    absl::MutexLock l(&lock_);
+    for (const Manifest::Segment& segment : manifest_->segments()) {
+      if (!segment.sealed) {
+        // Still being written to, it will be registered on rotation.
+        continue;
+      }
+      CHECK(filename_max_idx_
+                .emplace(segment.filename,
+                         TruncationFileInfo{.min_idx = segment.min_idx,
+                                            .max_idx = segment.max_idx})
+                .second)
+          << " duplicate filename: " << segment.filename;
+    }
+    return;
+  }
   absl::StatusOr<std::vector<std::filesystem::path>> files =
       ReadDir(dir_, prefix_, /*cleanup=*/false, /*sort=*/false);
   CHECK_OK(files.status());
@@ -7,6 +7,7 @@
 #include <stop_token>
 #include <thread>
 #include <variant>
+#include <vector>
 
 #include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
@@ -14,7 +15,9 @@
 #include "absl/status/status.h"
 #include "absl/strings/string_view.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "log.pb.h"
+#include "manifest.h"
 
 namespace witnesskvs::log {
 
@@ -25,6 +28,13 @@ class LogsTruncator {
  public:
   LogsTruncator(std::string dir, std::string prefix,
                 std::function<uint64_t(const Log::Message&)> idxfn);
+
+  // Uses manifest as the source of truth for the files available to truncate
+  // rather than reading every file header in the directory, and records
+  // truncations and deletions in it.
+  LogsTruncator(std::string dir, std::string prefix,
+                std::function<uint64_t(const Log::Message&)> idxfn,
+                std::shared_ptr<Manifest> manifest);
   ~LogsTruncator();
   using TruncationIdx = uint64_t;
   struct TruncationFileInfo {
@@ -43,12 +53,30 @@ class LogsTruncator {
   // rotations.
   absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> GetCallbackFn();
 
+  // Replaces the clock that deletions are paced against and how they wait on
+  // it, for tests. Call before Truncate().
+  void SetClockForTest(std::function<absl::Time()> now_fn,
+                       std::function<void(absl::Duration)> sleep_fn)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
  private:
   // TODO(mmucklo): method comments.
   void Init();
   void Run(std::stop_token stop_token) ABSL_LOCKS_EXCLUDED(queue_lock_);
-  void DoTruncation(uint64_t max_idx) ABSL_LOCKS_EXCLUDED(lock_);
-  void DoSingleFileTruncation(absl::string_view filename, uint64_t max_idx);
+  void DoTruncation(uint64_t max_idx, std::stop_token stop_token)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Deletes filenames in batches of --logs_truncator_delete_batch_size with a
+  // directory sync per batch, freeing at most
+  // --logs_truncator_delete_bytes_per_sec so that bursts of unlinks don't
+  // stall the log's own fsyncs on the same disk.
+  void DeleteFiles(const std::vector<std::string>& filenames,
+                   std::stop_token stop_token) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Rewrites filename without the entries below max_idx, returns the min/max
+  // idx of the entries kept.
+  TruncationFileInfo DoSingleFileTruncation(absl::string_view filename,
+                                            uint64_t max_idx);
 
   // Registers a set of max_idx and min_idx against a filename.
   void Register(TruncationFileInfo truncation_file_info)
@@ -73,6 +101,8 @@ class LogsTruncator {
   // This is a list of rotatable filenames, and their min/max idx values.
   absl::flat_hash_map<std::string, TruncationFileInfo> filename_max_idx_
       ABSL_GUARDED_BY(lock_);
+  std::function<absl::Time()> now_fn_ ABSL_GUARDED_BY(lock_);
+  std::function<void(absl::Duration)> sleep_fn_ ABSL_GUARDED_BY(lock_);
 
   // TODO(mmucklo) if there are a lot of log files, the map could get a bit big
   // in which case we can just iterate over the directory and directly read each
@@ -83,6 +113,7 @@ class LogsTruncator {
   const std::string prefix_;
   std::jthread worker_;
   const std::function<uint64_t(const Log::Message&)> idxfn_;
+  const std::shared_ptr<Manifest> manifest_;  // May be nullptr.
 };
 
 }  // namespace witnesskvs::log
@@ -10,6 +10,7 @@
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/flags/declare.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "log.pb.h"
@@ -28,6 +29,9 @@ using ::testing::SizeIs;
 using ::testing::UnorderedElementsAre;
 
 ABSL_DECLARE_FLAG(std::string, tests_test_util_temp_dir);
+ABSL_DECLARE_FLAG(uint64_t, logs_truncator_delete_bytes_per_sec);
+ABSL_DECLARE_FLAG(uint64_t, logs_truncator_delete_chunk_bytes);
+ABSL_DECLARE_FLAG(uint64_t, logs_truncator_delete_batch_size);
 
 namespace witnesskvs::log {
 extern const uint64_t kIdxSentinelValue;
@@ -245,4 +249,88 @@ TEST(LogTruncatorTest, RotationTest) {
   }
 }
 
+TEST(LogTruncatorTest, RateLimitedDeletion) {
+  std::vector<std::string> files;
+  std::string prefix = test::GetTempPrefix("logs_truncator_");
+  for (int start : {0, 10, 20}) {
+    LogWriter log_writer(
+        absl::GetFlag(FLAGS_tests_test_util_temp_dir), prefix,
+        [](const Log::Message& msg) { return msg.paxos().idx(); });
+    for (int i = start; i < start + 5; i++) {
+      Log::Message log_message;
+      log_message.mutable_paxos()->set_idx(i);
+      log_message.mutable_paxos()->set_min_proposal(4);
+      log_message.mutable_paxos()->set_accepted_proposal(9);
+      log_message.mutable_paxos()->set_accepted_value("test1234");
+      log_message.mutable_paxos()->set_is_chosen(true);
+      ASSERT_THAT(log_writer.Log(log_message), IsOk());
+    }
+    files.push_back(log_writer.filename());
+  }
+  constexpr uint64_t kChunkBytes = 16;
+  uint64_t delete_bytes = 0;
+  // Each file is shrunk a chunk at a time and then removed, with a wait after
+  // each step.
+  uint64_t expected_sleeps = 0;
+  for (int i = 0; i < 2; ++i) {
+    const uint64_t size =
+        std::filesystem::file_size(std::filesystem::path(files[i]));
+    delete_bytes += size;
+    expected_sleeps += (size - 1) / kChunkBytes + 1;
+  }
+
+  const uint64_t bytes_per_sec =
+      absl::GetFlag(FLAGS_logs_truncator_delete_bytes_per_sec);
+  const uint64_t chunk_bytes =
+      absl::GetFlag(FLAGS_logs_truncator_delete_chunk_bytes);
+  const uint64_t batch_size =
+      absl::GetFlag(FLAGS_logs_truncator_delete_batch_size);
+  // Deleting the first two files should take about 2 seconds.
+  absl::SetFlag(&FLAGS_logs_truncator_delete_bytes_per_sec, delete_bytes / 2);
+  absl::SetFlag(&FLAGS_logs_truncator_delete_chunk_bytes, kChunkBytes);
+  absl::SetFlag(&FLAGS_logs_truncator_delete_batch_size, 1);
+  {
+    // Time only moves when the truncator waits.
+    absl::Mutex clock_lock;
+    absl::Time now = absl::UnixEpoch();
+    uint64_t sleeps = 0;
+    LogsTruncator logs_truncator(
+        absl::GetFlag(FLAGS_tests_test_util_temp_dir), prefix,
+        [](const Log::Message& msg) { return msg.paxos().idx(); });
+    logs_truncator.SetClockForTest(
+        [&] {
+          absl::MutexLock l(&clock_lock);
+          return now;
+        },
+        [&](absl::Duration duration) {
+          absl::MutexLock l(&clock_lock);
+          now += duration;
+          ++sleeps;
+        });
+    EXPECT_THAT(logs_truncator.filename_max_idx(), SizeIs(3));
+    logs_truncator.Truncate(20);
+    {
+      absl::MutexLock l(&clock_lock);
+      auto paced = [&] { return sleeps == expected_sleeps; };
+      EXPECT_TRUE(clock_lock.AwaitWithTimeout(absl::Condition(&paced),
+                                              absl::Seconds(10)));
+      // Paced at the configured rate, to within the flag's rounding.
+      EXPECT_GE(now - absl::UnixEpoch(), absl::Seconds(2));
+      EXPECT_LT(now - absl::UnixEpoch(), absl::Seconds(3));
+    }
+    EXPECT_FALSE(std::filesystem::exists(std::filesystem::path(files[0])));
+    EXPECT_FALSE(std::filesystem::exists(std::filesystem::path(files[1])));
+    EXPECT_TRUE(std::filesystem::exists(std::filesystem::path(files[2])));
+    absl::flat_hash_map<std::string, LogsTruncator::TruncationFileInfo>
+        filename_max_idx = logs_truncator.filename_max_idx();
+    EXPECT_THAT(filename_max_idx, SizeIs(1));
+    EXPECT_EQ(filename_max_idx[files[2]].min_idx, 20);
+    EXPECT_EQ(filename_max_idx[files[2]].max_idx, 24);
+  }
+  absl::SetFlag(&FLAGS_logs_truncator_delete_bytes_per_sec, bytes_per_sec);
+  absl::SetFlag(&FLAGS_logs_truncator_delete_chunk_bytes, chunk_bytes);
+  absl::SetFlag(&FLAGS_logs_truncator_delete_batch_size, batch_size);
+  CleanupFiles({files[2]});
+}
+
 }  // namespace witnesskvs::log
@@ -0,0 +1,378 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/functional/any_invocable.h"
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "file_writer.h"
+#include "log.pb.h"
+#include "log_reader.h"
+#include "log_util.h"
+#include "log_writer.h"
+#include "third_party/mediapipe/status_macros.h"
+
+ABSL_FLAG(int64_t, log_manifest_max_edits, 1 << 16,
+          "Number of edits appended to a manifest before it is compacted into "
+          "a fresh snapshot.");
+
+namespace witnesskvs::log {
+
+extern const uint64_t kIdxSentinelValue;
+
+namespace {
+
+std::string Basename(const std::string& filename) {
+  return std::filesystem::path(filename).filename().string();
+}
+
+}  // namespace
+
+Manifest::Manifest(std::string dir, std::string prefix,
+                   std::function<uint64_t(const Log::Message&)> idxfn)
+    : dir_(std::move(dir)),
+      prefix_(std::move(prefix)),
+      idxfn_(std::move(idxfn)),
+      edits_since_snapshot_(0) {
+  CHECK(idxfn_);
+  Init();
+}
+
+std::string Manifest::FullPath(absl::string_view basename) const {
+  return absl::StrCat(
+      dir_, std::string(1, std::filesystem::path::preferred_separator),
+      basename);
+}
+
+std::string Manifest::filename() const {
+  return FullPath(absl::StrCat(prefix_, "_manifest.0"));
+}
+
+void Manifest::Init() {
+  CheckWriteDir(dir_);
+  CheckPrefix(prefix_);
+  absl::MutexLock l(&lock_);
+  // Before the segments are looked up, so that one whose truncation a crash
+  // interrupted is found under its own name.
+  ReconcileTruncations(dir_, prefix_);
+  // Nothing is reading the log yet, so any sorted copies of it are leftovers.
+  CleanupSortTemporaries(dir_, prefix_);
+  const std::string manifest_filename = filename();
+  absl::Status status = absl::NotFoundError("no manifest");
+  if (std::filesystem::exists(std::filesystem::path(manifest_filename))) {
+    status = Replay(manifest_filename);
+    if (!status.ok()) {
+      LOG(WARNING) << "Manifest: could not replay " << manifest_filename
+                   << ", rebuilding from the directory: " << status.ToString();
+      segments_.clear();
+    }
+  }
+  if (!status.ok()) {
+    CHECK_OK(Bootstrap());
+  }
+  RecoverUnsealedLocked();
+  WriteSnapshotLocked();
+  LOG(INFO) << "Manifest: " << manifest_filename << " tracking "
+            << segments_.size() << " segments.";
+}
+
+absl::Status Manifest::Replay(const std::string& filename) {
+  LogReader reader(filename);
+  RETURN_IF_ERROR(reader.header().status());
+  uint64_t edits = 0;
+  // A torn write at the tail (crash mid-append) will simply end the
+  // iteration, edits after it were never acknowledged.
+  for (const Log::Message& msg : reader) {
+    if (!msg.has_manifest_edit()) {
+      continue;
+    }
+    ApplyLocked(msg.manifest_edit());
+    ++edits;
+  }
+  VLOG(1) << "Manifest::Replay replayed " << edits << " edits from "
+          << filename;
+  return absl::OkStatus();
+}
+
+absl::Status Manifest::Bootstrap() {
+  LOG(INFO) << "Manifest: bootstrapping from directory " << dir_
+            << " prefix: " << prefix_;
+  ASSIGN_OR_RETURN(std::vector<std::filesystem::path> files,
+                   ReadDir(dir_, prefix_, /*cleanup=*/true, /*sort=*/true));
+  for (const auto& path : files) {
+    const std::string basename = path.filename().string();
+    ASSIGN_OR_RETURN(FileParts file_parts, ParseFilename(basename));
+    LogReader reader(path.string());
+    absl::StatusOr<Log::Header> header = reader.header();
+    if (!header.ok()) {
+      VLOG(1) << "Manifest::Bootstrap - bad header in file: " << path.string()
+              << ": " << header.status().ToString();
+      continue;
+    }
+    // Unpatched headers are left unsealed and recovered by
+    // RecoverUnsealedLocked().
+    const bool sealed = header->min_idx() != kIdxSentinelValue &&
+                        header->max_idx() != kIdxSentinelValue;
+    segments_[basename] =
+        Segment{.filename = FullPath(basename),
+                .micros = static_cast<int64_t>(file_parts.micros),
+                .min_idx = header->min_idx(),
+                .max_idx = header->max_idx(),
+                .sealed = sealed};
+  }
+  return absl::OkStatus();
+}
+
+void Manifest::RecoverUnsealedLocked() {
+  std::vector<std::string> erase;
+  for (auto& [basename, segment] : segments_) {
+    if (segment.sealed) {
+      continue;
+    }
+    const std::filesystem::path path(segment.filename);
+    if (!std::filesystem::exists(path)) {
+      LOG(WARNING) << "Manifest: segment missing, dropping: "
+                   << segment.filename;
+      erase.push_back(basename);
+      continue;
+    }
+
+    // The segment was left open by a previous process, find out what's in it.
+    uint64_t min_idx = kIdxSentinelValue;
+    uint64_t max_idx = kIdxSentinelValue;
+    {
+      LogReader reader(segment.filename);
+      for (const Log::Message& msg : reader) {
+        const uint64_t idx = idxfn_(msg);
+        if (idx == kIdxSentinelValue) {
+          continue;
+        }
+        if (min_idx == kIdxSentinelValue || min_idx > idx) {
+          min_idx = idx;
+        }
+        if (max_idx == kIdxSentinelValue || max_idx < idx) {
+          max_idx = idx;
+        }
+      }
+    }
+    if (max_idx == kIdxSentinelValue) {
+      // Nothing was ever logged to it.
+      LOG(INFO) << "Manifest: removing empty segment: " << segment.filename;
+      CleanupFiles({segment.filename});
+      erase.push_back(basename);
+      continue;
+    }
+    // Patch the header as well so the file is self-describing.
+    FileWriter::WriteHeader(path, GetIdxCord(min_idx, max_idx));
+    segment.min_idx = min_idx;
+    segment.max_idx = max_idx;
+    segment.sealed = true;
+    LOG(INFO) << "Manifest: sealed recovered segment: " << segment.filename
+              << " min_idx: " << min_idx << " max_idx: " << max_idx;
+  }
+  for (const auto& basename : erase) {
+    segments_.erase(basename);
+  }
+}
+
+void Manifest::WriteSnapshotLocked() {
+  const std::string temp_filename =
+      FullPath(absl::StrCat(prefix_, "_manifest_temp.0"));
+  if (std::filesystem::exists(std::filesystem::path(temp_filename))) {
+    // Left over from a crash mid-snapshot, the manifest itself is intact.
+    CleanupFiles({temp_filename});
+  }
+
+  auto writer = std::make_unique<LogWriter>(
+      temp_filename, absl::ToUnixMicros(absl::Now()), /*idxfn=*/nullptr);
+  // One sync for the whole snapshot.
+  writer->SetSkipFlush(true);
+  for (const auto& [basename, segment] : segments_) {
+    Log::Message msg;
+    Log::Message::ManifestEdit* edit = msg.mutable_manifest_edit();
+    edit->set_type(Log::Message::ManifestEdit::CREATE);
+    edit->set_filename(basename);
+    edit->set_micros(segment.micros);
+    CHECK_OK(writer->Log(msg));
+    if (segment.sealed) {
+      edit->set_type(Log::Message::ManifestEdit::SEAL);
+      edit->set_min_idx(segment.min_idx);
+      edit->set_max_idx(segment.max_idx);
+      CHECK_OK(writer->Log(msg));
+    }
+  }
+  writer->SetSkipFlush(false);
+  writer->Flush();
+
+  // rename(2) atomically replaces the previous manifest. The writer keeps
+  // appending to the same (now renamed) file.
+  std::error_code ec;
+  std::filesystem::rename(std::filesystem::path(temp_filename),
+                          std::filesystem::path(filename()), ec);
+  if (ec) {
+    LOG(FATAL) << "Manifest: Can't rename: " << temp_filename << " to "
+               << filename() << ": " << ec.message();
+  }
+  FileWriter::SyncDir(dir_);
+  writer_ = std::move(writer);
+  edits_since_snapshot_ = 0;
+}
+
+void Manifest::ApplyLocked(const Log::Message::ManifestEdit& edit) {
+  switch (edit.type()) {
+    case Log::Message::ManifestEdit::CREATE:
+      segments_[edit.filename()] = Segment{.filename = FullPath(edit.filename()),
+                                           .micros = edit.micros(),
+                                           .min_idx = kIdxSentinelValue,
+                                           .max_idx = kIdxSentinelValue,
+                                           .sealed = false};
+      break;
+    case Log::Message::ManifestEdit::SEAL:
+    case Log::Message::ManifestEdit::TRUNCATE: {
+      auto it = segments_.find(edit.filename());
+      if (it == segments_.end()) {
+        LOG(WARNING) << "Manifest: edit for unknown segment: "
+                     << edit.filename();
+        break;
+      }
+      it->second.min_idx = edit.min_idx();
+      it->second.max_idx = edit.max_idx();
+      it->second.sealed = true;
+      break;
+    }
+    case Log::Message::ManifestEdit::DELETE:
+      segments_.erase(edit.filename());
+      break;
+    default:
+      LOG(WARNING) << "Manifest: unknown edit type: " << edit.type();
+  }
+}
+
+void Manifest::AppendLocked(const Log::Message::ManifestEdit& edit) {
+  ApplyLocked(edit);
+  Log::Message msg;
+  *msg.mutable_manifest_edit() = edit;
+  CHECK_OK(writer_->Log(msg));
+  ++edits_since_snapshot_;
+  MaybeSnapshotLocked();
+}
+
+void Manifest::MaybeSnapshotLocked() {
+  if (edits_since_snapshot_ > absl::GetFlag(FLAGS_log_manifest_max_edits)) {
+    WriteSnapshotLocked();
+  }
+}
+
+void Manifest::RecordCreate(const std::string& filename, int64_t micros) {
+  Log::Message::ManifestEdit edit;
+  edit.set_type(Log::Message::ManifestEdit::CREATE);
+  edit.set_filename(Basename(filename));
+  edit.set_micros(micros);
+  absl::MutexLock l(&lock_);
+  AppendLocked(edit);
+}
+
+void Manifest::RecordSeal(const std::string& filename, uint64_t min_idx,
+                          uint64_t max_idx) {
+  Log::Message::ManifestEdit edit;
+  edit.set_type(Log::Message::ManifestEdit::SEAL);
+  edit.set_filename(Basename(filename));
+  edit.set_min_idx(min_idx);
+  edit.set_max_idx(max_idx);
+  absl::MutexLock l(&lock_);
+  AppendLocked(edit);
+}
+
+void Manifest::RecordTruncate(const std::string& filename, uint64_t min_idx,
+                              uint64_t max_idx) {
+  Log::Message::ManifestEdit edit;
+  edit.set_type(Log::Message::ManifestEdit::TRUNCATE);
+  edit.set_filename(Basename(filename));
+  edit.set_min_idx(min_idx);
+  edit.set_max_idx(max_idx);
+  absl::MutexLock l(&lock_);
+  AppendLocked(edit);
+}
+
+void Manifest::RecordDelete(const std::string& filename) {
+  Log::Message::ManifestEdit edit;
+  edit.set_type(Log::Message::ManifestEdit::DELETE);
+  edit.set_filename(Basename(filename));
+  absl::MutexLock l(&lock_);
+  AppendLocked(edit);
+}
+
+void Manifest::RecordDeletes(const std::vector<std::string>& filenames) {
+  absl::MutexLock l(&lock_);
+  writer_->SetSkipFlush(true);
+  for (const auto& filename : filenames) {
+    Log::Message msg;
+    Log::Message::ManifestEdit* edit = msg.mutable_manifest_edit();
+    edit->set_type(Log::Message::ManifestEdit::DELETE);
+    edit->set_filename(Basename(filename));
+    ApplyLocked(*edit);
+    CHECK_OK(writer_->Log(msg));
+    ++edits_since_snapshot_;
+  }
+  writer_->SetSkipFlush(false);
+  writer_->Flush();
+  MaybeSnapshotLocked();
+}
+
+absl::AnyInvocable<void(std::string, int64_t)> Manifest::GetCreateCallbackFn() {
+  return [this](std::string filename, int64_t micros) {
+    RecordCreate(filename, micros);
+  };
+}
+
+absl::AnyInvocable<void(std::string, uint64_t, uint64_t)>
+Manifest::GetSealCallbackFn() {
+  return [this](std::string filename, uint64_t min_idx, uint64_t max_idx) {
+    RecordSeal(filename, min_idx, max_idx);
+  };
+}
+
+std::vector<Manifest::Segment> Manifest::segments() const {
+  std::vector<Segment> segments;
+  {
+    absl::MutexLock l(&lock_);
+    segments.reserve(segments_.size());
+    for (const auto& [_, segment] : segments_) {
+      segments.push_back(segment);
+    }
+  }
+  std::sort(segments.begin(), segments.end(),
+            [](const Segment& a, const Segment& b) {
+              return a.micros < b.micros;
+            });
+  return segments;
+}
+
+std::vector<std::filesystem::path> Manifest::files() const {
+  std::vector<std::filesystem::path> files;
+  for (const Segment& segment : segments()) {
+    files.emplace_back(segment.filename);
+  }
+  return files;
+}
+
+int64_t Manifest::edits_since_snapshot() const {
+  absl::MutexLock l(&lock_);
+  return edits_since_snapshot_;
+}
+
+}  // namespace witnesskvs::log
@@ -0,0 +1,145 @@
+#ifndef LOG_MANIFEST_H
+#define LOG_MANIFEST_H
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/functional/any_invocable.h"
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "log.pb.h"
+#include "log_writer.h"
+
+namespace witnesskvs::log {
+
+/**
+ * An append-only, checksummed record of the log segments that exist for a
+ * directory and prefix.
+ *
+ * Every segment creation, sealing (rotation), truncation and deletion is
+ * recorded as a Log::Message::ManifestEdit using the same framing as the log
+ * files themselves (size + crc32c + message). Components that would otherwise
+ * scan the directory and open every segment to read its header (LogsLoader,
+ * SortingLogsLoader, LogsTruncator) can instead consult the manifest, which
+ * makes startup and truncation bookkeeping proportional to the number of
+ * changes rather than the number of files.
+ *
+ * The manifest lives in a single file named "<prefix>_manifest.0" in dir. On
+ * open, the edits are replayed and a compacted snapshot is written to a
+ * temporary file which is then atomically renamed over the manifest. The same
+ * happens once the number of edits since the last snapshot exceeds
+ * --log_manifest_max_edits.
+ *
+ * If no manifest exists yet (e.g. a directory written by an older version),
+ * one is bootstrapped by scanning the directory once. Opening is also the only
+ * other time the directory is listed: to finish interrupted truncations and to
+ * remove the temporaries of an interrupted SortingLogsLoader.
+ *
+ * IMPORTANT: must be instantiated before any LogWriter that reports to it or
+ * LogsTruncator it is passed to, and destroyed after them.
+ */
+class Manifest {
+ public:
+  struct Segment {
+    std::string filename;  // The full path to the segment.
+    int64_t micros;
+    uint64_t min_idx;
+    uint64_t max_idx;
+    bool sealed;
+  };
+
+  // idxfn - a function that returns the idx for the log message passed in. It
+  // is used to recover min_idx and max_idx of segments that were never sealed
+  // (e.g. after a crash).
+  Manifest(std::string dir, std::string prefix,
+           std::function<uint64_t(const Log::Message&)> idxfn);
+  Manifest() = delete;
+
+  // Disable copy (and move) semantics.
+  Manifest(const Manifest&) = delete;
+  Manifest& operator=(const Manifest&) = delete;
+
+  // Each of the following durably records an edit, returning once it's
+  // sync'd. filename is the full path to the segment.
+  //
+  // RecordCreate and RecordSeal are normally driven by a LogWriter through the
+  // callbacks below.
+  void RecordCreate(const std::string& filename, int64_t micros)
+      ABSL_LOCKS_EXCLUDED(lock_);
+  void RecordSeal(const std::string& filename, uint64_t min_idx,
+                  uint64_t max_idx) ABSL_LOCKS_EXCLUDED(lock_);
+  void RecordTruncate(const std::string& filename, uint64_t min_idx,
+                      uint64_t max_idx) ABSL_LOCKS_EXCLUDED(lock_);
+  void RecordDelete(const std::string& filename) ABSL_LOCKS_EXCLUDED(lock_);
+  // Records the deletion of all of filenames with a single sync.
+  void RecordDeletes(const std::vector<std::string>& filenames)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns callbacks for use in LogWriter::RegisterCreateCallback and
+  // LogWriter::RegisterSealCallback respectively.
+  absl::AnyInvocable<void(std::string, int64_t)> GetCreateCallbackFn();
+  absl::AnyInvocable<void(std::string, uint64_t, uint64_t)> GetSealCallbackFn();
+
+  // Returns all the segments, ordered by their micros suffix.
+  std::vector<Segment> segments() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the paths of all the segments, ordered by their micros suffix.
+  std::vector<std::filesystem::path> files() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  const std::string& dir() const { return dir_; }
+  const std::string& prefix() const { return prefix_; }
+
+  // The full path of the manifest file.
+  std::string filename() const;
+
+  // Number of edits appended since the last snapshot.
+  int64_t edits_since_snapshot() const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  void Init() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Replays the edits in the manifest file.
+  absl::Status Replay(const std::string& filename)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Builds the segment list from the segments found in the directory.
+  absl::Status Bootstrap() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Seals segments left unsealed by a previous process by reading them, or
+  // drops them if they're missing or hold no entries.
+  void RecoverUnsealedLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Writes the current state out as a new manifest and swaps it into place.
+  void WriteSnapshotLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  void ApplyLocked(const Log::Message::ManifestEdit& edit)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void AppendLocked(const Log::Message::ManifestEdit& edit)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Compacts into a new snapshot if enough edits have accumulated.
+  void MaybeSnapshotLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  std::string FullPath(absl::string_view basename) const;
+
+  const std::string dir_;
+  const std::string prefix_;
+  const std::function<uint64_t(const Log::Message&)> idxfn_;
+
+  mutable absl::Mutex lock_;
+  // Keyed by the segment's basename.
+  std::map<std::string, Segment> segments_ ABSL_GUARDED_BY(lock_);
+  std::unique_ptr<LogWriter> writer_ ABSL_GUARDED_BY(lock_);
+  int64_t edits_since_snapshot_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace witnesskvs::log
+
+#endif
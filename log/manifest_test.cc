@@ -0,0 +1,333 @@
+#include "manifest.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "log.pb.h"
+#include "log_util.h"
+#include "log_writer.h"
+#include "logs_loader.h"
+#include "logs_truncator.h"
+#include "tests/test_util.h"
+#include "third_party/absl_local/test_macros.h"
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+using ::testing::SizeIs;
+
+ABSL_DECLARE_FLAG(std::string, tests_test_util_temp_dir);
+ABSL_DECLARE_FLAG(uint64_t, log_writer_max_file_size);
+ABSL_DECLARE_FLAG(int64_t, log_manifest_max_edits);
+
+namespace witnesskvs::log {
+extern const uint64_t kIdxSentinelValue;
+
+namespace {
+
+uint64_t IdxFn(const Log::Message& msg) { return msg.paxos().idx(); }
+
+Log::Message MakeMessage(uint64_t idx) {
+  Log::Message log_message;
+  log_message.mutable_paxos()->set_idx(idx);
+  log_message.mutable_paxos()->set_min_proposal(4);
+  log_message.mutable_paxos()->set_accepted_proposal(9);
+  log_message.mutable_paxos()->set_accepted_value("test1234");
+  log_message.mutable_paxos()->set_is_chosen(true);
+  return log_message;
+}
+
+}  // namespace
+
+TEST(ManifestTest, RecordsCreateAndSeal) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string filename;
+  {
+    Manifest manifest(dir, prefix, IdxFn);
+    EXPECT_THAT(manifest.segments(), IsEmpty());
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest.GetCreateCallbackFn());
+    log_writer.RegisterSealCallback(manifest.GetSealCallbackFn());
+    for (int i = 0; i < 5; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    filename = log_writer.filename();
+    std::vector<Manifest::Segment> segments = manifest.segments();
+    ASSERT_THAT(segments, SizeIs(1));
+    EXPECT_EQ(segments[0].filename, filename);
+    EXPECT_FALSE(segments[0].sealed);
+  }
+
+  // Reopening replays the manifest.
+  Manifest manifest(dir, prefix, IdxFn);
+  std::vector<Manifest::Segment> segments = manifest.segments();
+  ASSERT_THAT(segments, SizeIs(1));
+  EXPECT_EQ(segments[0].filename, filename);
+  EXPECT_TRUE(segments[0].sealed);
+  EXPECT_EQ(segments[0].min_idx, 0);
+  EXPECT_EQ(segments[0].max_idx, 4);
+  EXPECT_EQ(manifest.edits_since_snapshot(), 0);
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, Rotation) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  const uint64_t max_file_size = absl::GetFlag(FLAGS_log_writer_max_file_size);
+  absl::SetFlag(&FLAGS_log_writer_max_file_size, 128);
+  std::vector<std::string> filenames;
+  {
+    Manifest manifest(dir, prefix, IdxFn);
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest.GetCreateCallbackFn());
+    log_writer.RegisterSealCallback(manifest.GetSealCallbackFn());
+    for (int i = 0; i < 10; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    filenames = log_writer.filenames();
+    ASSERT_GT(filenames.size(), 1);
+    std::vector<Manifest::Segment> segments = manifest.segments();
+    ASSERT_THAT(segments, SizeIs(filenames.size()));
+    for (size_t i = 0; i < segments.size(); ++i) {
+      EXPECT_EQ(segments[i].filename, filenames[i]);
+      // Only the last one is still open.
+      EXPECT_EQ(segments[i].sealed, i + 1 < segments.size());
+    }
+  }
+  absl::SetFlag(&FLAGS_log_writer_max_file_size, max_file_size);
+
+  Manifest manifest(dir, prefix, IdxFn);
+  std::vector<std::filesystem::path> files = manifest.files();
+  ASSERT_THAT(files, SizeIs(filenames.size()));
+  for (size_t i = 0; i < files.size(); ++i) {
+    EXPECT_EQ(files[i].string(), filenames[i]);
+  }
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, BootstrapsFromDirectory) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string filename;
+  {
+    // Written without a manifest, e.g. by an older version.
+    LogWriter log_writer(dir, prefix, IdxFn);
+    for (int i = 3; i < 7; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    filename = log_writer.filename();
+  }
+  Manifest manifest(dir, prefix, IdxFn);
+  EXPECT_TRUE(std::filesystem::exists(manifest.filename()));
+  std::vector<Manifest::Segment> segments = manifest.segments();
+  ASSERT_THAT(segments, SizeIs(1));
+  EXPECT_EQ(segments[0].filename, filename);
+  EXPECT_TRUE(segments[0].sealed);
+  EXPECT_EQ(segments[0].min_idx, 3);
+  EXPECT_EQ(segments[0].max_idx, 6);
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, RecoversUnsealedSegment) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string filename;
+  {
+    Manifest manifest(dir, prefix, IdxFn);
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest.GetCreateCallbackFn());
+    for (int i = 2; i < 5; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    filename = log_writer.filename();
+    // No seal callback registered, as if we crashed before sealing.
+  }
+  Manifest manifest(dir, prefix, IdxFn);
+  std::vector<Manifest::Segment> segments = manifest.segments();
+  ASSERT_THAT(segments, SizeIs(1));
+  EXPECT_TRUE(segments[0].sealed);
+  EXPECT_EQ(segments[0].min_idx, 2);
+  EXPECT_EQ(segments[0].max_idx, 4);
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, FinishesInterruptedTruncation) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string filename;
+  {
+    Manifest manifest(dir, prefix, IdxFn);
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest.GetCreateCallbackFn());
+    log_writer.RegisterSealCallback(manifest.GetSealCallbackFn());
+    for (int i = 0; i < 5; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    filename = log_writer.filename();
+  }
+  // As if we crashed after the original segment went away, but before its
+  // truncated copy took its place.
+  absl::StatusOr<FileParts> file_parts = ParseFilename(filename);
+  ASSERT_THAT(file_parts, IsOk());
+  const std::string truncated_filename =
+      absl::StrCat(file_parts->prefix, "_truncation.", file_parts->micros);
+  std::filesystem::rename(filename, truncated_filename);
+  // And left a copy of another truncation half written.
+  const std::string temp_filename =
+      absl::StrCat(file_parts->prefix, "_temp_truncation.", file_parts->micros);
+  std::filesystem::copy_file(truncated_filename, temp_filename);
+
+  Manifest manifest(dir, prefix, IdxFn);
+  EXPECT_TRUE(std::filesystem::exists(filename));
+  EXPECT_FALSE(std::filesystem::exists(truncated_filename));
+  EXPECT_FALSE(std::filesystem::exists(temp_filename));
+  std::vector<uint64_t> indexes;
+  SortingLogsLoader loader(manifest,
+                           [](const Log::Message& a, const Log::Message& b) {
+                             return a.paxos().idx() < b.paxos().idx();
+                           });
+  for (const Log::Message& msg : loader) {
+    indexes.push_back(msg.paxos().idx());
+  }
+  EXPECT_THAT(indexes, ElementsAre(0, 1, 2, 3, 4));
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, LoadersReadTheManifestsSegments) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  Manifest manifest(dir, prefix, IdxFn);
+  {
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest.GetCreateCallbackFn());
+    log_writer.RegisterSealCallback(manifest.GetSealCallbackFn());
+    for (uint64_t i : {3, 1, 2}) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+  }
+  // A segment the manifest doesn't know about is not read.
+  {
+    LogWriter log_writer(dir, prefix, IdxFn);
+    ASSERT_THAT(log_writer.Log(MakeMessage(7)), IsOk());
+  }
+
+  std::vector<uint64_t> indexes;
+  LogsLoader loader(manifest);
+  for (const Log::Message& msg : loader) {
+    indexes.push_back(msg.paxos().idx());
+  }
+  EXPECT_THAT(indexes, ElementsAre(3, 1, 2));
+
+  indexes.clear();
+  LogsLoader sorted_loader(manifest,
+                           [](const Log::Message& a, const Log::Message& b) {
+                             return a.paxos().idx() < b.paxos().idx();
+                           });
+  for (const Log::Message& msg : sorted_loader) {
+    indexes.push_back(msg.paxos().idx());
+  }
+  EXPECT_THAT(indexes, ElementsAre(1, 2, 3));
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, RemovesSortTemporaries) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string sorted_filename;
+  std::string merged_filename;
+  {
+    // As if a SortingLogsLoader crashed mid-sort.
+    LogWriter sorted_writer(dir, absl::StrCat(prefix, "_sorted0"), IdxFn);
+    ASSERT_THAT(sorted_writer.Log(MakeMessage(0)), IsOk());
+    sorted_filename = sorted_writer.filename();
+    LogWriter merged_writer(dir, absl::StrCat(prefix, "_merge_sorted"), IdxFn);
+    ASSERT_THAT(merged_writer.Log(MakeMessage(0)), IsOk());
+    merged_filename = merged_writer.filename();
+  }
+  Manifest manifest(dir, prefix, IdxFn);
+  EXPECT_FALSE(std::filesystem::exists(sorted_filename));
+  EXPECT_FALSE(std::filesystem::exists(merged_filename));
+  EXPECT_THAT(manifest.segments(), IsEmpty());
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, Compaction) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  const int64_t max_edits = absl::GetFlag(FLAGS_log_manifest_max_edits);
+  absl::SetFlag(&FLAGS_log_manifest_max_edits, 4);
+  {
+    Manifest manifest(dir, prefix, IdxFn);
+    for (int i = 0; i < 3; ++i) {
+      const std::string filename =
+          absl::StrCat(dir, "/", prefix, ".", 1000 + i);
+      manifest.RecordCreate(filename, 1000 + i);
+      manifest.RecordSeal(filename, i * 10, i * 10 + 9);
+    }
+    // 6 edits with a max of 4, so a snapshot was taken along the way.
+    EXPECT_LT(manifest.edits_since_snapshot(), 4);
+    manifest.RecordDelete(absl::StrCat(dir, "/", prefix, ".", 1000));
+  }
+  absl::SetFlag(&FLAGS_log_manifest_max_edits, max_edits);
+  // The deleted segment must not resurface from the older snapshot.
+  Manifest manifest(dir, prefix, IdxFn);
+  EXPECT_THAT(manifest.segments(), SizeIs(2));
+  test::Cleanup(dir, prefix);
+}
+
+TEST(ManifestTest, TruncatorRecordsTruncation) {
+  const std::string dir = absl::GetFlag(FLAGS_tests_test_util_temp_dir);
+  const std::string prefix = test::GetTempPrefix("manifest_");
+  std::string first_file;
+  std::string second_file;
+  auto manifest = std::make_shared<Manifest>(dir, prefix, IdxFn);
+  for (uint64_t start : {0, 10}) {
+    LogWriter log_writer(dir, prefix, IdxFn);
+    log_writer.RegisterCreateCallback(manifest->GetCreateCallbackFn());
+    log_writer.RegisterSealCallback(manifest->GetSealCallbackFn());
+    for (uint64_t i = start; i < start + 5; i++) {
+      ASSERT_THAT(log_writer.Log(MakeMessage(i)), IsOk());
+    }
+    (start == 0 ? first_file : second_file) = log_writer.filename();
+  }
+  {
+    LogsTruncator logs_truncator(dir, prefix, IdxFn, manifest);
+    EXPECT_THAT(logs_truncator.filename_max_idx(), SizeIs(2));
+    logs_truncator.Truncate(12);
+    absl::SleepFor(absl::Seconds(4));
+  }
+  EXPECT_FALSE(std::filesystem::exists(std::filesystem::path(first_file)));
+  manifest.reset();
+
+  Manifest reopened(dir, prefix, IdxFn);
+  std::vector<Manifest::Segment> segments = reopened.segments();
+  ASSERT_THAT(segments, SizeIs(1));
+  EXPECT_EQ(segments[0].filename, second_file);
+  EXPECT_EQ(segments[0].min_idx, 12);
+  EXPECT_EQ(segments[0].max_idx, 14);
+
+  std::vector<uint64_t> indexes;
+  SortingLogsLoader loader(reopened,
+                           [](const Log::Message& a, const Log::Message& b) {
+                             return a.paxos().idx() < b.paxos().idx();
+                           });
+  for (const Log::Message& msg : loader) {
+    indexes.push_back(msg.paxos().idx());
+  }
+  EXPECT_THAT(indexes, ElementsAre(12, 13, 14));
+  test::Cleanup(dir, prefix);
+}
+
+}  // namespace witnesskvs::log
@@ -1,22 +1,68 @@
 #include "acceptor.h"
 #include "replicated_log.h"
+#include "util/node.h"
+#include "value_hash.h"
 
 #include <grpcpp/grpcpp.h>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/declare.h"
+#include "absl/flags/flag.h"
+#include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "paxos.grpc.pb.h"
 
+ABSL_FLAG(uint64_t, paxos_replication_stream_workers, 16,
+          "Number of requests from a peer's replication stream handled at "
+          "once");
+ABSL_FLAG(absl::Duration, paxos_leader_lease_duration, absl::Seconds(2),
+          "How long an acceptor refuses to prepare proposals from other nodes "
+          "after granting the leader a lease, 0 disables leases. Must be the "
+          "same on every node and longer than --paxos_node_heartbeat_interval "
+          "for the leader to keep its lease");
+
+ABSL_DECLARE_FLAG(std::string, paxos_snapshot_directory);
+
 using grpc::ServerContext;
+using grpc::ServerReader;
+using grpc::ServerReaderWriter;
 using grpc::Status;
 
 using paxos_rpc::Acceptor;
 using paxos_rpc::AcceptRequest;
+using paxos_rpc::AcceptBatchRequest;
+using paxos_rpc::AcceptBatchResponse;
 using paxos_rpc::AcceptResponse;
+using paxos_rpc::CommitBatchRequest;
+using paxos_rpc::CommitBatchResponse;
 using paxos_rpc::CommitRequest;
 using paxos_rpc::CommitResponse;
+using paxos_rpc::FetchValueRequest;
+using paxos_rpc::FetchValueResponse;
+using paxos_rpc::InstallSnapshotRequest;
+using paxos_rpc::InstallSnapshotResponse;
 using paxos_rpc::PingRequest;
 using paxos_rpc::PingResponse;
+using paxos_rpc::PrepareRangeRequest;
+using paxos_rpc::PrepareRangeResponse;
 using paxos_rpc::PrepareRequest;
 using paxos_rpc::PrepareResponse;
+using paxos_rpc::ReadIndexRequest;
+using paxos_rpc::ReadIndexResponse;
+using paxos_rpc::ReplicationRequest;
+using paxos_rpc::ReplicationResponse;
 using paxos_rpc::TruncateProposeRequest;
 using paxos_rpc::TruncateProposeResponse;
 using paxos_rpc::TruncateRequest;
@@ -26,22 +72,62 @@ namespace witnesskvs::paxos {
 
 class AcceptorImpl final : public Acceptor::Service {
  private:
+  using Clock = std::chrono::steady_clock;
+
   uint8_t node_id_;
   std::shared_ptr<ReplicatedLog> replicated_log_;
+  const std::function<bool()> has_leader_lease_;
+
+  // The leader lease granted last. Prepares hold lease_lock_ throughout, so
+  // that a lease is never granted while a Prepare from another node is under
+  // way.
+  absl::Mutex lease_lock_;
+  uint8_t lease_holder_ ABSL_GUARDED_BY(lease_lock_);
+  Clock::time_point lease_expiry_ ABSL_GUARDED_BY(lease_lock_);
+
+  // Held while a snapshot is received and installed, they share a directory.
+  absl::Mutex snapshot_lock_;
+
+  // Grants node_id the lease if it's the node our range promise was made to,
+  // with a proposal at least as high, and no other node holds it.
+  bool GrantLeaseLocked(uint8_t node_id, uint64_t proposal_number)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lease_lock_);
+  // Returns an error unless the node that generated proposal_number may
+  // prepare it, i.e. no other node holds the lease.
+  Status CheckLeaseLocked(uint64_t proposal_number)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lease_lock_);
 
  public:
-  AcceptorImpl(uint8_t node_id, std::shared_ptr<ReplicatedLog> rlog)
-      : node_id_{node_id}, replicated_log_{rlog} {};
+  AcceptorImpl(uint8_t node_id, std::shared_ptr<ReplicatedLog> rlog,
+               std::function<bool()> has_leader_lease);
   ~AcceptorImpl() = default;
 
   Status Prepare(ServerContext* context, const PrepareRequest* request,
                  PrepareResponse* response) override;
+  Status PrepareRange(ServerContext* context,
+                      const PrepareRangeRequest* request,
+                      PrepareRangeResponse* response) override;
   Status Accept(ServerContext* context, const AcceptRequest* request,
                 AcceptResponse* response) override;
+  Status AcceptBatch(ServerContext* context, const AcceptBatchRequest* request,
+                     AcceptBatchResponse* response) override;
   Status Ping(ServerContext* context, const PingRequest* request,
               PingResponse* response) override;
   Status Commit(ServerContext* context, const CommitRequest* request,
                 CommitResponse* response) override;
+  Status CommitBatch(ServerContext* context, const CommitBatchRequest* request,
+                     CommitBatchResponse* response) override;
+  Status FetchValue(ServerContext* context, const FetchValueRequest* request,
+                    FetchValueResponse* response) override;
+  Status ReadIndex(ServerContext* context, const ReadIndexRequest* request,
+                   ReadIndexResponse* response) override;
+  Status InstallSnapshot(ServerContext* context,
+                         ServerReader<InstallSnapshotRequest>* reader,
+                         InstallSnapshotResponse* response) override;
+  Status Replicate(
+      ServerContext* context,
+      ServerReaderWriter<ReplicationResponse, ReplicationRequest>* stream)
+      override;
   Status TruncatePropose(ServerContext* context,
                          const TruncateProposeRequest* request,
                          TruncateProposeResponse* response) override;
@@ -49,37 +135,131 @@ class AcceptorImpl final : public Acceptor::Service {
                   TruncateResponse* response) override;
 };
 
+AcceptorImpl::AcceptorImpl(uint8_t node_id,
+                           std::shared_ptr<ReplicatedLog> rlog,
+                           std::function<bool()> has_leader_lease)
+    : node_id_{node_id},
+      replicated_log_{rlog},
+      has_leader_lease_{std::move(has_leader_lease)},
+      lease_holder_{INVALID_NODE_ID},
+      lease_expiry_{} {
+  // Leases aren't persisted, so one granted before a restart may still be
+  // running. Only a leader we made a range promise to can have held it.
+  const uint64_t promised = replicated_log_->GetRangeMinProposal();
+  if (promised != 0) {
+    lease_holder_ = ReplicatedLog::GetProposalNodeId(promised);
+    lease_expiry_ = Clock::now() + absl::ToChronoNanoseconds(absl::GetFlag(
+                                       FLAGS_paxos_leader_lease_duration));
+  }
+}
+
+bool AcceptorImpl::GrantLeaseLocked(uint8_t node_id,
+                                    uint64_t proposal_number) {
+  // The range promise is durable and a leader only asks once caught up,
+  // i.e. once it range prepared a quorum. If another node has range prepared
+  // since, it may be leader already.
+  const uint64_t promised = replicated_log_->GetRangeMinProposal();
+  if (promised == 0 || ReplicatedLog::GetProposalNodeId(promised) != node_id ||
+      proposal_number < promised) {
+    return false;
+  }
+  const Clock::time_point now = Clock::now();
+  if (lease_holder_ != node_id && now < lease_expiry_) {
+    return false;
+  }
+  lease_holder_ = node_id;
+  lease_expiry_ = std::max(
+      lease_expiry_,
+      now + absl::ToChronoNanoseconds(
+                absl::GetFlag(FLAGS_paxos_leader_lease_duration)));
+  return true;
+}
+
+Status AcceptorImpl::CheckLeaseLocked(uint64_t proposal_number) {
+  const uint8_t node_id = ReplicatedLog::GetProposalNodeId(proposal_number);
+  if (lease_holder_ == node_id || Clock::now() >= lease_expiry_) {
+    return Status::OK;
+  }
+  return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                "Node " + std::to_string(lease_holder_) +
+                    " holds the leader lease");
+}
+
 Status AcceptorImpl::Prepare(ServerContext* context,
                              const PrepareRequest* request,
                              PrepareResponse* response) {
+  absl::MutexLock l(&lease_lock_);
+  if (Status status = CheckLeaseLocked(request->proposal_number());
+      !status.ok()) {
+    return status;
+  }
+  if (request->index() < this->replicated_log_->GetTruncatedIdx() ||
+      this->replicated_log_->IsTooFarAhead(request->index())) {
+    return Status(grpc::StatusCode::OUT_OF_RANGE,
+                  "Index " + std::to_string(request->index()) +
+                      " is outside of the log");
+  }
   uint64_t log_min_proposal =
       this->replicated_log_->GetMinProposalForIdx(request->index());
 
-  bool hasValue = (log_min_proposal != 0);
-
   if (request->proposal_number() > log_min_proposal) {
     this->replicated_log_->UpdateMinProposalForIdx(request->index(),
                                                    request->proposal_number());
   }
+  // A promise, the proposer retries with a higher proposal if it's above its
+  // own. It's never reported as an accepted proposal.
+  response->set_min_proposal(
+      std::max(log_min_proposal, request->proposal_number()));
 
   auto entry = this->replicated_log_->GetLogEntryAtIdx(request->index());
 
-  response->set_accepted_proposal(entry.min_proposal_);
-
-  if (hasValue) {
-    response->set_accepted_proposal(entry.accepted_proposal_);
+  // Only an entry that accepted a value has one to report, whatever promises
+  // (e.g. a range Prepare's) cover it.
+  if (entry.accepted_proposal_ != 0 || entry.is_chosen_) {
+    // As with PrepareRange, a chosen value wins over any accepted one.
+    response->set_accepted_proposal(entry.is_chosen_
+                                        ? std::numeric_limits<uint64_t>::max()
+                                        : entry.accepted_proposal_);
     response->set_accepted_value(entry.accepted_value_);
+    response->set_accepted_value_hash(entry.value_hash_);
     response->set_has_accepted_value(true);
   }
-  response->set_max_idx_in_log(this->replicated_log_->GetLogEntries().rbegin()->first);
+  response->set_max_idx_in_log(this->replicated_log_->GetMaxIdx());
+
+  return Status::OK;
+}
 
+Status AcceptorImpl::PrepareRange(ServerContext* context,
+                                  const PrepareRangeRequest* request,
+                                  PrepareRangeResponse* response) {
+  absl::MutexLock l(&lease_lock_);
+  if (Status status = CheckLeaseLocked(request->proposal_number());
+      !status.ok()) {
+    return status;
+  }
+  std::vector<ReplicatedLogEntry> accepted;
+  response->set_min_proposal(this->replicated_log_->PrepareRange(
+      request->index(), request->proposal_number(), &accepted));
+  for (const ReplicatedLogEntry& entry : accepted) {
+    paxos_rpc::AcceptedEntry* accepted_entry = response->add_accepted();
+    accepted_entry->set_index(entry.idx_);
+    accepted_entry->set_accepted_proposal(entry.accepted_proposal_);
+    accepted_entry->set_value(entry.accepted_value_);
+    accepted_entry->set_value_hash(entry.value_hash_);
+    accepted_entry->set_is_chosen(entry.is_chosen_);
+  }
   return Status::OK;
 }
 
 Status AcceptorImpl::Accept(ServerContext* context,
                             const AcceptRequest* request,
                             AcceptResponse* response) {
-  if (!request->value().empty()) {
+  if (this->replicated_log_->IsTooFarAhead(request->index())) {
+    return Status(grpc::StatusCode::OUT_OF_RANGE,
+                  "Index " + std::to_string(request->index()) +
+                      " is too far ahead of the log");
+  }
+  if (!request->value().empty() || request->no_op()) {
     ReplicatedLogEntry entry = {};
     entry.idx_ = request->index();
     entry.min_proposal_ = request->proposal_number();
@@ -89,23 +269,271 @@ Status AcceptorImpl::Accept(ServerContext* context,
 
     response->set_min_proposal(this->replicated_log_->UpdateLogEntry(entry));
   }
+  if (response->min_proposal() <= request->proposal_number()) {
+    this->replicated_log_->MarkChosenUpTo(request->first_unchosen_index(),
+                                          request->proposal_number());
+  }
   response->set_first_unchosen_index(
       this->replicated_log_->GetFirstUnchosenIdx());
   return Status::OK;
 }
 
+Status AcceptorImpl::AcceptBatch(ServerContext* context,
+                                 const AcceptBatchRequest* request,
+                                 AcceptBatchResponse* response) {
+  // Same as Accept for each of them, but all stored at once.
+  std::vector<ReplicatedLogEntry> entries;
+  std::vector<int> stored;
+  for (int i = 0; i < request->accepts_size(); ++i) {
+    const AcceptRequest& accept = request->accepts(i);
+    if (this->replicated_log_->IsTooFarAhead(accept.index())) {
+      response->Clear();
+      return Status(grpc::StatusCode::OUT_OF_RANGE,
+                    "Index " + std::to_string(accept.index()) +
+                        " is too far ahead of the log");
+    }
+    response->add_accepts();
+    if (accept.value().empty() && !accept.no_op()) {
+      continue;
+    }
+    ReplicatedLogEntry entry = {};
+    entry.idx_ = accept.index();
+    entry.min_proposal_ = accept.proposal_number();
+    entry.accepted_proposal_ = accept.proposal_number();
+    entry.accepted_value_ = accept.value();
+    entry.is_chosen_ = false;
+    entries.push_back(std::move(entry));
+    stored.push_back(i);
+  }
+  const std::vector<uint64_t> min_proposals =
+      this->replicated_log_->UpdateLogEntries(entries);
+  for (size_t k = 0; k < stored.size(); ++k) {
+    response->mutable_accepts(stored[k])->set_min_proposal(min_proposals[k]);
+  }
+  // They normally all come from the same leader with the same index.
+  uint64_t marked_idx = 0;
+  uint64_t marked_proposal = 0;
+  for (int i = 0; i < request->accepts_size(); ++i) {
+    const AcceptRequest& accept = request->accepts(i);
+    if (response->accepts(i).min_proposal() <= accept.proposal_number() &&
+        (accept.first_unchosen_index() != marked_idx ||
+         accept.proposal_number() != marked_proposal)) {
+      marked_idx = accept.first_unchosen_index();
+      marked_proposal = accept.proposal_number();
+      this->replicated_log_->MarkChosenUpTo(marked_idx, marked_proposal);
+    }
+  }
+  const uint64_t first_unchosen = this->replicated_log_->GetFirstUnchosenIdx();
+  for (AcceptResponse& accept_response : *response->mutable_accepts()) {
+    accept_response.set_first_unchosen_index(first_unchosen);
+  }
+  return Status::OK;
+}
+
 Status AcceptorImpl::Ping(ServerContext* context, const PingRequest* request,
                           PingResponse* response) {
+  this->replicated_log_->MarkChosenUpTo(request->first_unchosen_index(),
+                                        request->proposal_number());
   response->set_node_id(node_id_);
+  response->set_first_unchosen_index(
+      this->replicated_log_->GetFirstUnchosenIdx());
+  if (request->request_lease() &&
+      absl::GetFlag(FLAGS_paxos_leader_lease_duration) > absl::ZeroDuration()) {
+    absl::MutexLock l(&lease_lock_);
+    response->set_lease_granted(
+        GrantLeaseLocked(request->node_id(), request->proposal_number()));
+  }
+  return Status::OK;
+}
+
+Status AcceptorImpl::FetchValue(ServerContext* context,
+                                const FetchValueRequest* request,
+                                FetchValueResponse* response) {
+  std::optional<ReplicatedLogEntry> entry =
+      this->replicated_log_->FindLogEntryAtIdx(request->index());
+  // A witness only has the hash, and the value we hold may not be the one
+  // asked for if another proposal overwrote it.
+  if (entry.has_value() && entry->value_hash_.empty() &&
+      HashValue(entry->accepted_value_) == request->value_hash()) {
+    response->set_found(true);
+    response->set_value(entry->accepted_value_);
+  }
+  return Status::OK;
+}
+
+Status AcceptorImpl::ReadIndex(ServerContext* context,
+                               const ReadIndexRequest* request,
+                               ReadIndexResponse* response) {
+  // Only with the lease do we know that nothing got chosen past our first
+  // unchosen index without us. Writes are only acked once every index up to
+  // theirs is chosen, so every write acked so far is below it.
+  if (!has_leader_lease_()) {
+    return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                  "Not the leader or no leader lease");
+  }
+  response->set_index(this->replicated_log_->GetFirstUnchosenIdx());
+  return Status::OK;
+}
+
+Status AcceptorImpl::InstallSnapshot(
+    ServerContext* context, ServerReader<InstallSnapshotRequest>* reader,
+    InstallSnapshotResponse* response) {
+  absl::MutexLock l(&snapshot_lock_);
+  const std::filesystem::path dir =
+      std::filesystem::path(absl::GetFlag(FLAGS_paxos_snapshot_directory)) /
+      absl::StrCat("incoming_snapshot", node_id_);
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+
+  InstallSnapshotRequest chunk;
+  std::ofstream file;
+  std::string file_name;
+  uint64_t written = 0;
+  bool done = false;
+  Status status = Status::OK;
+  while (status.ok() && reader->Read(&chunk)) {
+    if (chunk.done()) {
+      done = true;
+      break;
+    }
+    // Only ever files of their own in the directory.
+    if (chunk.file_name().empty() ||
+        std::filesystem::path(chunk.file_name()).filename() !=
+            chunk.file_name() ||
+        chunk.file_name() == "." || chunk.file_name() == "..") {
+      status = Status(grpc::StatusCode::INVALID_ARGUMENT,
+                      "Invalid snapshot file name");
+      break;
+    }
+    if (chunk.file_name() != file_name) {
+      file.close();
+      file.open(dir / chunk.file_name(), std::ios::binary | std::ios::trunc);
+      file_name = chunk.file_name();
+      written = 0;
+    }
+    if (chunk.offset() != written) {
+      status = Status(grpc::StatusCode::DATA_LOSS,
+                      "Snapshot chunk out of order");
+      break;
+    }
+    file.write(chunk.data().data(), chunk.data().size());
+    written += chunk.data().size();
+    if (!file) {
+      status = Status(grpc::StatusCode::INTERNAL,
+                      "Failed to write snapshot file");
+    }
+  }
+  file.close();
+  if (status.ok() && !done) {
+    status = Status(grpc::StatusCode::ABORTED, "Snapshot transfer cut short");
+  }
+
+  if (status.ok() && !this->replicated_log_->InstallSnapshot(chunk.index(),
+                                                             dir.string())) {
+    LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+              << "] Snapshot as of idx: " << chunk.index()
+              << " not installed, first unchosen idx: "
+              << this->replicated_log_->GetFirstUnchosenIdx();
+  }
+  std::filesystem::remove_all(dir);
+  response->set_first_unchosen_index(
+      this->replicated_log_->GetFirstUnchosenIdx());
+  return status;
+}
+
+Status AcceptorImpl::Replicate(
+    ServerContext* context,
+    ServerReaderWriter<ReplicationResponse, ReplicationRequest>* stream) {
+  // Requests are handled concurrently like separate RPCs would be, so that
+  // the Accepts of a pipelining leader share log writes.
+  absl::Mutex lock;
+  std::deque<ReplicationRequest> queue;
+  bool closed = false;
+  absl::Mutex write_lock;
+  auto worker = [&]() {
+    while (true) {
+      ReplicationRequest request;
+      {
+        absl::MutexLock l(&lock);
+        auto ready = [&]() { return closed || !queue.empty(); };
+        lock.Await(absl::Condition(&ready));
+        if (queue.empty()) {
+          return;
+        }
+        request = std::move(queue.front());
+        queue.pop_front();
+      }
+
+      ReplicationResponse response;
+      response.set_seq(request.seq());
+      Status status;
+      switch (request.request_case()) {
+        case ReplicationRequest::kAccept:
+          status =
+              Accept(context, &request.accept(), response.mutable_accept());
+          break;
+        case ReplicationRequest::kCommit:
+          status =
+              Commit(context, &request.commit(), response.mutable_commit());
+          break;
+        case ReplicationRequest::kAcceptBatch:
+          status = AcceptBatch(context, &request.accept_batch(),
+                               response.mutable_accept_batch());
+          break;
+        case ReplicationRequest::kCommitBatch:
+          status = CommitBatch(context, &request.commit_batch(),
+                               response.mutable_commit_batch());
+          break;
+        default:
+          LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                       << "] Ignoring empty replication request: "
+                       << request.seq();
+          continue;
+      }
+      if (!status.ok()) {
+        // Only this request failed, the stream goes on.
+        response.clear_response();
+        response.set_error_code(status.error_code());
+        response.set_error_message(status.error_message());
+      }
+      absl::MutexLock l(&write_lock);
+      stream->Write(response);
+    }
+  };
+  std::vector<std::jthread> workers;
+  const uint64_t num_workers =
+      std::max<uint64_t>(absl::GetFlag(FLAGS_paxos_replication_stream_workers), 1);
+  for (uint64_t i = 0; i < num_workers; ++i) {
+    workers.emplace_back(worker);
+  }
+
+  ReplicationRequest request;
+  while (stream->Read(&request)) {
+    absl::MutexLock l(&lock);
+    queue.push_back(std::move(request));
+    request.Clear();
+  }
+  {
+    absl::MutexLock l(&lock);
+    closed = true;
+  }
   return Status::OK;
 }
 
 Status AcceptorImpl::TruncatePropose(ServerContext* context,
                                      const TruncateProposeRequest* request,
                                      TruncateProposeResponse* response) {
+  // Entries can only be truncated once they've been applied, which trails the
+  // first unchosen index.
+  const uint64_t applied_idx = this->replicated_log_->GetAppliedIdx();
   LOG(INFO) << "Responding to truncation request with First UnchosenIdx: "
-            << this->replicated_log_->GetFirstUnchosenIdx();
-  response->set_index(this->replicated_log_->GetFirstUnchosenIdx() - 1);
+            << this->replicated_log_->GetFirstUnchosenIdx()
+            << " applied idx: " << applied_idx;
+  if (applied_idx == 0) {
+    return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                  "Nothing has been applied yet.");
+  }
+  response->set_index(applied_idx - 1);
   return Status::OK;
 }
 
@@ -121,7 +549,42 @@ Status AcceptorImpl::Truncate(ServerContext* context,
 Status AcceptorImpl::Commit(ServerContext* context,
                             const CommitRequest* request,
                             CommitResponse* response) {
-  this->replicated_log_->SetLogEntryAtIdx(request->index(), request->value());
+  if (request->accepted_proposal() != 0) {
+    response->set_value_needed(
+        !this->replicated_log_
+             ->MarkLogEntriesChosen(
+                 {{request->index(), request->accepted_proposal()}})
+             .empty());
+  } else {
+    this->replicated_log_->SetLogEntryAtIdx(request->index(),
+                                            request->value());
+  }
+  response->set_first_unchosen_index(
+      this->replicated_log_->GetFirstUnchosenIdx());
+  return Status::OK;
+}
+
+Status AcceptorImpl::CommitBatch(ServerContext* context,
+                                 const CommitBatchRequest* request,
+                                 CommitBatchResponse* response) {
+  std::vector<std::pair<uint64_t, absl::Cord>> entries;
+  std::vector<std::pair<uint64_t, uint64_t>> value_free;
+  for (const CommitRequest& commit : request->commits()) {
+    if (commit.accepted_proposal() != 0) {
+      value_free.emplace_back(commit.index(), commit.accepted_proposal());
+    } else {
+      entries.emplace_back(commit.index(), commit.value());
+    }
+  }
+  if (!entries.empty()) {
+    this->replicated_log_->SetLogEntriesAtIdx(std::move(entries));
+  }
+  if (!value_free.empty()) {
+    for (uint64_t index :
+         this->replicated_log_->MarkLogEntriesChosen(value_free)) {
+      response->add_value_needed(index);
+    }
+  }
   response->set_first_unchosen_index(
       this->replicated_log_->GetFirstUnchosenIdx());
   return Status::OK;
@@ -129,10 +592,11 @@ Status AcceptorImpl::Commit(ServerContext* context,
 
 void RunServer(const std::string& address, uint8_t node_id,
                std::shared_ptr<ReplicatedLog> rlog,
+               std::function<bool()> has_leader_lease,
                const std::stop_source& stop_source) {
   using namespace std::chrono_literals;
 
-  AcceptorImpl service{node_id, rlog};
+  AcceptorImpl service{node_id, rlog, std::move(has_leader_lease)};
 
   grpc::ServerBuilder builder;
   builder.AddListeningPort(address, grpc::InsecureServerCredentials());
@@ -144,15 +608,19 @@ void RunServer(const std::string& address, uint8_t node_id,
   while (!stoken.stop_requested()) {
     std::this_thread::sleep_for(300ms);
   }
+  // Peers' replication streams never end on their own, cancel them rather
+  // than wait.
+  server->Shutdown(std::chrono::system_clock::now());
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id)
             << "] Shutting down acceptor service";
 }
 
 AcceptorService::AcceptorService(const std::string& address, uint8_t node_id,
-                                 std::shared_ptr<ReplicatedLog> rlog)
+                                 std::shared_ptr<ReplicatedLog> rlog,
+                                 std::function<bool()> has_leader_lease)
     : node_id_{node_id} {
-  service_thread_ =
-      std::jthread(RunServer, address, node_id, rlog, stop_source_);
+  service_thread_ = std::jthread(RunServer, address, node_id, rlog,
+                                 std::move(has_leader_lease), stop_source_);
 }
 
 AcceptorService::~AcceptorService() {
@@ -1,6 +1,8 @@
 #ifndef PAXOS_ACCEPTOR_H_
 #define PAXOS_ACCEPTOR_H_
 
+#include <functional>
+
 #include "replicated_log.h"
 
 namespace witnesskvs::paxos {
@@ -12,8 +14,11 @@ class AcceptorService {
   uint8_t node_id_;
 
  public:
+  // has_leader_lease tells whether this node is the leader and holds the
+  // lease, which it takes to answer ReadIndex requests.
   AcceptorService(const std::string& address, uint8_t node_id,
-                  std::shared_ptr<ReplicatedLog> rlog);
+                  std::shared_ptr<ReplicatedLog> rlog,
+                  std::function<bool()> has_leader_lease);
   ~AcceptorService();
 };
 }  // namespace witnesskvs::paxos
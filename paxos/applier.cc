@@ -0,0 +1,206 @@
+#include "applier.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/strings/cord.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+ABSL_FLAG(uint64_t, paxos_apply_max_batch_size, 512,
+          "Maximum number of chosen entries handed to the application in a "
+          "single callback.");
+
+namespace witnesskvs::paxos {
+
+Applier::Applier(uint64_t first_idx)
+    : enqueued_idx_(first_idx),
+      snapshot_idx_(0),
+      applied_idx_(first_idx),
+      app_applied_idx_(0) {
+  worker_ = std::jthread(std::bind_front(&Applier::Run, this));
+}
+
+Applier::~Applier() {
+  {
+    absl::MutexLock l(&lock_);
+    worker_.get_stop_source().request_stop();
+  }
+  worker_.join();
+}
+
+void Applier::RegisterCallback(AppCallback callback) {
+  absl::MutexLock l(&callback_lock_);
+  callback_ = [callback = std::move(callback)](
+                  const std::vector<absl::Cord>& values,
+                  uint64_t applied_idx) { callback(values); };
+}
+
+void Applier::RegisterCallback(IndexedAppCallback callback,
+                               uint64_t applied_idx, ReadValueFn read) {
+  absl::MutexLock cl(&callback_lock_);
+  callback_ = std::move(callback);
+  app_applied_idx_ = applied_idx;
+  // Nothing gets applied meanwhile, so this is where the queue starts.
+  const uint64_t end = applied_idx_.load(std::memory_order_acquire);
+  if (applied_idx >= end) {
+    return;
+  }
+  LOG(INFO) << "Applier: applying entries from idx: " << applied_idx
+            << " up to idx: " << end << " again";
+  const uint64_t max_batch_size =
+      std::max<uint64_t>(1, absl::GetFlag(FLAGS_paxos_apply_max_batch_size));
+  uint64_t idx = applied_idx;
+  while (idx < end) {
+    std::vector<absl::Cord> batch;
+    for (; idx < end && batch.size() < max_batch_size; ++idx) {
+      std::optional<absl::Cord> value = read(idx);
+      if (!value.has_value()) {
+        break;
+      }
+      batch.push_back(*std::move(value));
+    }
+    if (!batch.empty()) {
+      callback_(batch, idx);
+    }
+    if (idx < end && batch.size() < max_batch_size) {
+      // Carrying on would apply later entries without it.
+      LOG(FATAL) << "Applier: entry at idx: " << idx
+                 << " is gone from the log, the application is missing "
+                    "entries up to idx: "
+                 << end;
+    }
+  }
+  app_applied_idx_ = idx;
+}
+
+void Applier::RegisterSnapshotCallbacks(SnapshotCallback snapshot,
+                                        InstallSnapshotCallback install) {
+  absl::MutexLock l(&callback_lock_);
+  snapshot_callback_ = std::move(snapshot);
+  install_callback_ = std::move(install);
+}
+
+std::optional<uint64_t> Applier::Snapshot(const std::string& dir) {
+  absl::MutexLock cl(&callback_lock_);
+  if (!snapshot_callback_) {
+    return std::nullopt;
+  }
+  // The application may be ahead of the log, see RegisterCallback().
+  const uint64_t idx = std::max(applied_idx(), app_applied_idx_);
+  if (!snapshot_callback_(dir)) {
+    LOG(WARNING) << "Applier: snapshot as of idx: " << idx << " failed";
+    return std::nullopt;
+  }
+  return idx;
+}
+
+bool Applier::Install(uint64_t idx, const std::string& dir) {
+  absl::MutexLock cl(&callback_lock_);
+  if (applied_idx() >= idx) {
+    return false;
+  }
+  if (install_callback_ && !install_callback_(dir)) {
+    LOG(WARNING) << "Applier: installing snapshot as of idx: " << idx
+                 << " failed";
+    return false;
+  }
+
+  app_applied_idx_ = idx;
+
+  absl::MutexLock l(&lock_);
+  // What's below idx in the queue is in the snapshot.
+  const uint64_t queue_start = enqueued_idx_ - queue_.size();
+  if (idx > queue_start) {
+    queue_.erase(queue_.begin(),
+                 queue_.begin() + std::min<uint64_t>(idx - queue_start,
+                                                     queue_.size()));
+  }
+  enqueued_idx_ = std::max(enqueued_idx_, idx);
+  snapshot_idx_ = idx;
+  applied_idx_.store(idx, std::memory_order_release);
+  LOG(INFO) << "Applier: installed snapshot as of idx: " << idx;
+  return true;
+}
+
+void Applier::Enqueue(uint64_t idx, absl::Cord value) {
+  absl::MutexLock l(&lock_);
+  if (idx < snapshot_idx_) {
+    // Already part of the installed snapshot.
+    return;
+  }
+  CHECK_EQ(idx, enqueued_idx_) << "Entries must be applied in log order.";
+  queue_.push_back(std::move(value));
+  ++enqueued_idx_;
+}
+
+bool Applier::WaitUntilApplied(uint64_t idx, absl::Duration timeout) {
+  absl::MutexLock l(&lock_);
+  auto applied = [this, idx] {
+    lock_.AssertReaderHeld();
+    return applied_idx_ >= idx;
+  };
+  return lock_.AwaitWithTimeout(absl::Condition(&applied), timeout);
+}
+
+void Applier::Run(std::stop_token stop_token) {
+  const uint64_t max_batch_size =
+      std::max<uint64_t>(1, absl::GetFlag(FLAGS_paxos_apply_max_batch_size));
+  while (true) {
+    std::vector<absl::Cord> batch;
+    uint64_t batch_start;
+    uint64_t batch_end;
+    {
+      absl::MutexLock l(&lock_);
+      auto has_work = [this, &stop_token] {
+        lock_.AssertReaderHeld();
+        return !queue_.empty() || stop_token.stop_requested();
+      };
+      lock_.Await(absl::Condition(&has_work));
+      if (queue_.empty()) {
+        // Only once everything enqueued has been applied.
+        CHECK(stop_token.stop_requested());
+        break;
+      }
+      const size_t size = std::min<size_t>(queue_.size(), max_batch_size);
+      batch.reserve(size);
+      for (size_t i = 0; i < size; ++i) {
+        batch.push_back(std::move(queue_.front()));
+        queue_.pop_front();
+      }
+      batch_start = applied_idx_.load(std::memory_order_relaxed);
+      batch_end = batch_start + size;
+    }
+
+    absl::MutexLock cl(&callback_lock_);
+    // A snapshot installed since covers the start of the batch, or all of it.
+    const uint64_t applied = applied_idx();
+    if (applied >= batch_end) {
+      continue;
+    }
+    // So may what the application applied before a restart.
+    const uint64_t begin =
+        std::min(batch_end, std::max(applied, app_applied_idx_));
+    batch.erase(batch.begin(), batch.begin() + (begin - batch_start));
+    if (callback_ && !batch.empty()) {
+      VLOG(1) << "Applier: applying " << batch.size()
+              << " entries up to idx: " << batch_end;
+      callback_(batch, batch_end);
+    }
+
+    absl::MutexLock l(&lock_);
+    applied_idx_.store(batch_end, std::memory_order_release);
+  }
+}
+
+}  // namespace witnesskvs::paxos
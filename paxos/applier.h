@@ -0,0 +1,139 @@
+#ifndef PAXOS_APPLIER_H_
+#define PAXOS_APPLIER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <stop_token>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/cord.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace witnesskvs::paxos {
+
+// Called with a batch of chosen values, in log order.
+using AppCallback = std::function<void(const std::vector<absl::Cord>&)>;
+// Like AppCallback, also passed the index below which every entry is applied
+// once the batch is, for applications that store it along with the values.
+using IndexedAppCallback =
+    std::function<void(const std::vector<absl::Cord>&, uint64_t applied_idx)>;
+// Reads the value chosen at idx back from the log, nullopt if it's gone.
+using ReadValueFn = std::function<std::optional<absl::Cord>(uint64_t idx)>;
+// Writes a snapshot of the application state into dir, which doesn't exist
+// yet, returning whether it did. No batch is applied meanwhile, the snapshot
+// has to reflect exactly the batches applied so far.
+using SnapshotCallback = std::function<bool(const std::string& dir)>;
+// Replaces the application state with the snapshot in dir, written by a
+// SnapshotCallback on another node, returning whether it did.
+using InstallSnapshotCallback = std::function<bool(const std::string& dir)>;
+
+/**
+ * Applies chosen log entries to the application state machine on a dedicated
+ * thread, so that a slow application (e.g. RocksDB writes) doesn't hold up
+ * consensus.
+ *
+ * Values are handed over in log order with Enqueue() and passed to the
+ * registered AppCallback in batches of up to --paxos_apply_max_batch_size.
+ * applied_idx() is the watermark below which every entry has been applied,
+ * readers that need to observe the effects of chosen entries can wait on it
+ * with WaitUntilApplied().
+ *
+ * Entries enqueued before a callback is registered are dropped, but still
+ * advance the watermark. An application that stores the watermark durably
+ * along with the values registers with the one it stored instead, see
+ * RegisterCallback(), so that entries chosen before a crash but not applied
+ * yet are applied after it.
+ *
+ * A node that's too far behind to replay the log is caught up with a snapshot
+ * of the application state instead, see Snapshot() and Install().
+ */
+class Applier {
+ public:
+  // Entries below first_idx are considered already applied.
+  explicit Applier(uint64_t first_idx);
+  ~Applier();
+
+  // Disable copy (and move) semantics.
+  Applier(const Applier&) = delete;
+  Applier& operator=(const Applier&) = delete;
+
+  void RegisterCallback(AppCallback callback)
+      ABSL_LOCKS_EXCLUDED(callback_lock_);
+  // Registers the callback of an application that stores the applied_idx it
+  // is passed durably with each batch, and had applied_idx stored last.
+  // Entries from applied_idx on that count as applied here already, i.e. were
+  // chosen before this applier was created, are read back with read and
+  // applied again first, it's fatal if one of them can't be. Entries below
+  // applied_idx that are chosen again are skipped.
+  void RegisterCallback(IndexedAppCallback callback, uint64_t applied_idx,
+                        ReadValueFn read)
+      ABSL_LOCKS_EXCLUDED(callback_lock_, lock_);
+  void RegisterSnapshotCallbacks(SnapshotCallback snapshot,
+                                 InstallSnapshotCallback install)
+      ABSL_LOCKS_EXCLUDED(callback_lock_);
+
+  // Writes a snapshot of the application state into dir with the registered
+  // SnapshotCallback. Returns the index below which it reflects every entry,
+  // or nullopt if there's no callback or it failed.
+  std::optional<uint64_t> Snapshot(const std::string& dir)
+      ABSL_LOCKS_EXCLUDED(callback_lock_, lock_);
+  // Installs the snapshot in dir, taken with every entry below idx applied,
+  // with the registered InstallSnapshotCallback, or none if there is none
+  // (e.g. on witnesses). Entries below idx enqueued or yet to be are dropped,
+  // later ones are applied on top. Returns false, without installing, if
+  // entries from idx on were applied already or the callback failed.
+  bool Install(uint64_t idx, const std::string& dir)
+      ABSL_LOCKS_EXCLUDED(callback_lock_, lock_);
+
+  // Hands over the value chosen at idx. Must be called in log order, without
+  // gaps.
+  void Enqueue(uint64_t idx, absl::Cord value) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the index below which all entries have been applied. Doesn't take
+  // lock_.
+  uint64_t applied_idx() const {
+    return applied_idx_.load(std::memory_order_acquire);
+  }
+
+  // Blocks until all entries below idx have been applied, or timeout expires.
+  // Returns whether they were applied.
+  bool WaitUntilApplied(uint64_t idx,
+                        absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  void Run(std::stop_token stop_token) ABSL_LOCKS_EXCLUDED(lock_);
+
+  mutable absl::Mutex lock_;
+  std::deque<absl::Cord> queue_ ABSL_GUARDED_BY(lock_);
+  uint64_t enqueued_idx_ ABSL_GUARDED_BY(lock_);  // Next idx expected.
+  // Entries below the last snapshot installed, enqueued late, are dropped.
+  uint64_t snapshot_idx_ ABSL_GUARDED_BY(lock_);
+  // Only written with lock_ held, so that waiters are woken up, but read
+  // without it.
+  std::atomic<uint64_t> applied_idx_;
+
+  // Held while a callback runs, so RegisterCallback() doesn't race with it
+  // and snapshots see the application state as of applied_idx_, which only
+  // moves with it held. Taken before lock_.
+  absl::Mutex callback_lock_ ABSL_ACQUIRED_BEFORE(lock_);
+  IndexedAppCallback callback_ ABSL_GUARDED_BY(callback_lock_);
+  // What the application reported to have applied, entries below it are
+  // skipped.
+  uint64_t app_applied_idx_ ABSL_GUARDED_BY(callback_lock_);
+  SnapshotCallback snapshot_callback_ ABSL_GUARDED_BY(callback_lock_);
+  InstallSnapshotCallback install_callback_ ABSL_GUARDED_BY(callback_lock_);
+
+  std::jthread worker_;
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_APPLIER_H_
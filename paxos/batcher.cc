@@ -0,0 +1,148 @@
+#include "batcher.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/log/log.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+ABSL_FLAG(uint64_t, paxos_batch_max_values, 256,
+          "Maximum number of proposed values packed into one log entry, 1 "
+          "disables batching.");
+ABSL_FLAG(uint64_t, paxos_batch_max_bytes, 1 << 20,
+          "Size in bytes at which a batch of proposed values stops growing.");
+ABSL_FLAG(absl::Duration, paxos_batch_max_delay, absl::Milliseconds(2),
+          "Longest a batch waits for more values while others are being "
+          "proposed.");
+
+namespace witnesskvs::paxos {
+namespace {
+
+// A batch starts with a marker and a format version, then each value framed
+// by its size as a varint. No serialized protobuf starts with a 0 byte (field
+// number 0 is invalid), which tells batches apart from the single unframed
+// values logged before batching.
+constexpr absl::string_view kValueBatchHeader("\x00\x01", 2);
+constexpr size_t kMaxVarintBytes = 10;
+
+void AppendVarint(uint64_t v, std::string* out) {
+  while (v >= 0x80) {
+    out->push_back(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  out->push_back(static_cast<char>(v));
+}
+
+// Parses a varint at the start of bytes, returning the number of bytes it
+// took or 0 if there's none.
+size_t ParseVarint(absl::string_view bytes, uint64_t* v) {
+  *v = 0;
+  for (size_t i = 0; i < bytes.size() && i < kMaxVarintBytes; ++i) {
+    const uint8_t byte = static_cast<uint8_t>(bytes[i]);
+    *v |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+absl::Cord EncodeValueBatch(const std::vector<absl::Cord>& values) {
+  absl::Cord batch(kValueBatchHeader);
+  std::string size;
+  for (const absl::Cord& value : values) {
+    size.clear();
+    AppendVarint(value.size(), &size);
+    batch.Append(size);
+    batch.Append(value);
+  }
+  return batch;
+}
+
+bool DecodeValueBatch(const absl::Cord& batch,
+                      std::vector<absl::Cord>* values) {
+  if (batch.empty()) {
+    return true;
+  }
+  if (!batch.StartsWith(kValueBatchHeader)) {
+    // Logged before values were batched, the value on its own.
+    values->push_back(batch);
+    return true;
+  }
+  size_t pos = kValueBatchHeader.size();
+  while (pos < batch.size()) {
+    const std::string prefix(batch.Subcord(pos, kMaxVarintBytes));
+    uint64_t size;
+    const size_t prefix_size = ParseVarint(prefix, &size);
+    if (prefix_size == 0 || size > batch.size() - pos - prefix_size) {
+      return false;
+    }
+    pos += prefix_size;
+    values->push_back(batch.Subcord(pos, size));
+    pos += size;
+  }
+  return true;
+}
+
+Batcher::Batcher(ProposeFn propose)
+    : propose_{std::move(propose)}, proposing_{0} {}
+
+void Batcher::SealLocked(Batch& batch) {
+  batch.sealed = true;
+  if (open_.get() == &batch) {
+    open_ = nullptr;
+  }
+}
+
+bool Batcher::Add(absl::Cord value) {
+  std::shared_ptr<Batch> batch;
+  {
+    absl::MutexLock l(&lock_);
+    const bool opened = open_ == nullptr;
+    if (opened) {
+      open_ = std::make_shared<Batch>();
+    }
+    batch = open_;
+    batch->bytes += value.size();
+    batch->values.push_back(std::move(value));
+    if (batch->values.size() >= absl::GetFlag(FLAGS_paxos_batch_max_values) ||
+        batch->bytes >= absl::GetFlag(FLAGS_paxos_batch_max_bytes)) {
+      SealLocked(*batch);
+    }
+
+    if (!opened) {
+      auto done = [&batch]() { return batch->done; };
+      lock_.Await(absl::Condition(&done));
+      return batch->chosen;
+    }
+
+    auto ready = [this, &batch]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+      return batch->sealed || proposing_ == 0;
+    };
+    lock_.AwaitWithTimeout(absl::Condition(&ready),
+                           absl::GetFlag(FLAGS_paxos_batch_max_delay));
+    SealLocked(*batch);
+    ++proposing_;
+  }
+
+  VLOG(1) << "Proposing a batch of " << batch->values.size() << " values, "
+          << batch->bytes << " bytes";
+  // Sealed, so nobody touches values anymore.
+  const bool chosen = propose_(EncodeValueBatch(batch->values));
+
+  absl::MutexLock l(&lock_);
+  --proposing_;
+  batch->done = true;
+  batch->chosen = chosen;
+  return chosen;
+}
+
+}  // namespace witnesskvs::paxos
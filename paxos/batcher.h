@@ -0,0 +1,74 @@
+#ifndef PAXOS_BATCHER_H_
+#define PAXOS_BATCHER_H_
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/strings/cord.h"
+#include "absl/synchronization/mutex.h"
+
+namespace witnesskvs::paxos {
+
+// Packs values into the single value of one log entry, sharing their buffers.
+// The batch is marked with its format version.
+absl::Cord EncodeValueBatch(const std::vector<absl::Cord>& values);
+
+// Appends the values packed in batch to values. Returns false if batch is
+// malformed. The empty value of a NOP round holds no values, and a value
+// without the batch marker (logged before values were batched) is the only
+// one.
+bool DecodeValueBatch(const absl::Cord& batch, std::vector<absl::Cord>* values);
+
+/**
+ * Coalesces values proposed concurrently into batches that take a single
+ * log entry, so that they share an Accept round trip and a log write on each
+ * acceptor.
+ *
+ * The caller that opens a batch proposes it. If no other batch is being
+ * proposed it goes out right away, otherwise it collects values until it
+ * reaches --paxos_batch_max_values or --paxos_batch_max_bytes, the other
+ * batches are chosen, or --paxos_batch_max_delay passes.
+ */
+class Batcher {
+ public:
+  // Gets an encoded batch chosen, blocking until it is. Returns false if it
+  // gave up on it.
+  using ProposeFn = std::function<bool(const absl::Cord&)>;
+
+  explicit Batcher(ProposeFn propose);
+
+  // Disable copy (and move) semantics.
+  Batcher(const Batcher&) = delete;
+  Batcher& operator=(const Batcher&) = delete;
+
+  // Returns once the batch value was added to has been chosen, or proposing
+  // it was given up on. Returns whether it was chosen.
+  bool Add(absl::Cord value) ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  struct Batch {
+    std::vector<absl::Cord> values;
+    size_t bytes = 0;
+    bool sealed = false;
+    bool done = false;
+    bool chosen = false;
+  };
+
+  // Stops new values from joining batch.
+  void SealLocked(Batch& batch) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  const ProposeFn propose_;
+
+  absl::Mutex lock_;
+  // The batch new values join, if any. Batches are only modified with lock_
+  // held.
+  std::shared_ptr<Batch> open_ ABSL_GUARDED_BY(lock_);
+  size_t proposing_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_BATCHER_H_
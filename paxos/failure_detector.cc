@@ -0,0 +1,105 @@
+#include "failure_detector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "absl/flags/flag.h"
+
+ABSL_FLAG(double, paxos_failure_detector_phi_threshold, 8.0,
+          "Suspicion level at which a peer that stopped answering pings is "
+          "considered down, lower detects failures sooner but is more prone "
+          "to false positives");
+ABSL_FLAG(uint64_t, paxos_failure_detector_window, 100,
+          "Number of recent heartbeats the failure detector learns a peer's "
+          "heartbeat spacing from");
+ABSL_FLAG(absl::Duration, paxos_failure_detector_min_stddev,
+          absl::Milliseconds(100),
+          "Lower bound on the deviation in heartbeat spacing the failure "
+          "detector assumes, so that a peer that was perfectly regular so far "
+          "isn't suspected the moment a heartbeat is a bit late");
+
+namespace witnesskvs::paxos {
+
+FailureDetector::FailureDetector(absl::Duration expected_interval)
+    : expected_interval_{expected_interval},
+      last_heartbeat_{absl::InfinitePast()},
+      sum_{0},
+      sum_of_squares_{0},
+      srtt_{absl::ZeroDuration()},
+      rttvar_{absl::ZeroDuration()} {}
+
+void FailureDetector::AddIntervalLocked(double interval) {
+  const size_t window = std::max<uint64_t>(
+      absl::GetFlag(FLAGS_paxos_failure_detector_window), 1);
+  while (intervals_.size() >= window) {
+    sum_ -= intervals_.front();
+    sum_of_squares_ -= intervals_.front() * intervals_.front();
+    intervals_.pop_front();
+  }
+  intervals_.push_back(interval);
+  sum_ += interval;
+  sum_of_squares_ += interval * interval;
+}
+
+void FailureDetector::Heartbeat(absl::Time now, absl::Duration rtt) {
+  absl::MutexLock l(&lock_);
+  AddIntervalLocked(last_heartbeat_ == absl::InfinitePast()
+                        ? absl::ToDoubleSeconds(expected_interval_)
+                        : absl::ToDoubleSeconds(now - last_heartbeat_));
+  last_heartbeat_ = std::max(last_heartbeat_, now);
+
+  // As in RFC 6298.
+  if (srtt_ == absl::ZeroDuration()) {
+    srtt_ = rtt;
+    rttvar_ = rtt / 2;
+  } else {
+    rttvar_ = (3 * rttvar_ + absl::AbsDuration(srtt_ - rtt)) / 4;
+    srtt_ = (7 * srtt_ + rtt) / 8;
+  }
+}
+
+void FailureDetector::Reset() {
+  absl::MutexLock l(&lock_);
+  last_heartbeat_ = absl::InfinitePast();
+  intervals_.clear();
+  sum_ = 0;
+  sum_of_squares_ = 0;
+}
+
+double FailureDetector::Phi(absl::Time now) const {
+  absl::MutexLock l(&lock_);
+  if (intervals_.empty()) {
+    return 0;
+  }
+  const double n = intervals_.size();
+  const double mean = sum_ / n;
+  const double variance = std::max(sum_of_squares_ / n - mean * mean, 0.0);
+  const double stddev = std::max(
+      std::sqrt(variance),
+      absl::ToDoubleSeconds(
+          absl::GetFlag(FLAGS_paxos_failure_detector_min_stddev)));
+  const double elapsed = absl::ToDoubleSeconds(now - last_heartbeat_);
+
+  // The normal distribution's tail, by its logistic approximation.
+  const double y = (elapsed - mean) / stddev;
+  const double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+  return elapsed > mean ? -std::log10(e / (1.0 + e))
+                        : -std::log10(1.0 - 1.0 / (1.0 + e));
+}
+
+bool FailureDetector::IsAvailable(absl::Time now) const {
+  return Phi(now) < absl::GetFlag(FLAGS_paxos_failure_detector_phi_threshold);
+}
+
+absl::Duration FailureDetector::Rtt() const {
+  absl::MutexLock l(&lock_);
+  return srtt_;
+}
+
+absl::Duration FailureDetector::RttTimeout() const {
+  absl::MutexLock l(&lock_);
+  return srtt_ + 4 * rttvar_;
+}
+
+}  // namespace witnesskvs::paxos
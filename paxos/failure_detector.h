@@ -0,0 +1,76 @@
+#ifndef PAXOS_FAILURE_DETECTOR_H_
+#define PAXOS_FAILURE_DETECTOR_H_
+
+#include <cstddef>
+#include <deque>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace witnesskvs::paxos {
+
+/**
+ * Phi accrual failure detector for one peer, fed with the pings it answers.
+ *
+ * Rather than a yes/no verdict after a fixed timeout, it reports phi, how
+ * unlikely it is that a heartbeat is merely late given the spacing of the
+ * last --paxos_failure_detector_window ones: phi = -log10(P(later)). A peer
+ * whose pings time out on a loaded network keeps its low phi for as long as
+ * such delays are usual for it, one that stops answering altogether crosses
+ * --paxos_failure_detector_phi_threshold soon after its next heartbeat was
+ * due.
+ *
+ * Also keeps a smoothed estimate of the round-trip time to the peer, the way
+ * TCP does for its retransmission timeout.
+ */
+class FailureDetector {
+ public:
+  // expected_interval is how far apart heartbeats are meant to be, taken as
+  // the spacing of the first one until there are actual ones to go by.
+  explicit FailureDetector(absl::Duration expected_interval);
+
+  // Disable copy (and move) semantics.
+  FailureDetector(const FailureDetector&) = delete;
+  FailureDetector& operator=(const FailureDetector&) = delete;
+
+  // Records a ping answered at now, rtt after it was sent.
+  void Heartbeat(absl::Time now, absl::Duration rtt) ABSL_LOCKS_EXCLUDED(lock_);
+  // Forgets the heartbeats so far, e.g. once the peer is considered down, so
+  // that the time it was gone for doesn't skew the spacing when it's back.
+  // The round-trip time estimate is kept.
+  void Reset() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Suspicion that the peer has failed as of now, 0 before its first
+  // heartbeat.
+  double Phi(absl::Time now) const ABSL_LOCKS_EXCLUDED(lock_);
+  // Whether Phi(now) is below --paxos_failure_detector_phi_threshold.
+  bool IsAvailable(absl::Time now) const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Smoothed round-trip time, zero until the first heartbeat.
+  absl::Duration Rtt() const ABSL_LOCKS_EXCLUDED(lock_);
+  // Smoothed round-trip time plus four times its mean deviation, a bound a
+  // reply is very unlikely to take longer than. Zero until the first
+  // heartbeat.
+  absl::Duration RttTimeout() const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  const absl::Duration expected_interval_;
+
+  mutable absl::Mutex lock_;
+  absl::Time last_heartbeat_ ABSL_GUARDED_BY(lock_);
+  // The spacing of the last heartbeats in seconds, with their sum and sum of
+  // squares.
+  std::deque<double> intervals_ ABSL_GUARDED_BY(lock_);
+  double sum_ ABSL_GUARDED_BY(lock_);
+  double sum_of_squares_ ABSL_GUARDED_BY(lock_);
+
+  absl::Duration srtt_ ABSL_GUARDED_BY(lock_);
+  absl::Duration rttvar_ ABSL_GUARDED_BY(lock_);
+
+  void AddIntervalLocked(double interval) ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_FAILURE_DETECTOR_H_
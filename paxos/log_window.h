@@ -0,0 +1,164 @@
+#ifndef PAXOS_LOG_WINDOW_H_
+#define PAXOS_LOG_WINDOW_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace witnesskvs::paxos {
+
+/**
+ * A window of log entries stored contiguously in a ring buffer and indexed by
+ * idx - base, where base is the lowest idx still held.
+ *
+ * Lookups and insertions are O(1), dropping a prefix (truncation) advances the
+ * base, and entries for neighbouring indexes sit next to each other in
+ * memory. Indexes in the window that were never set are holes: find() returns
+ * nullptr for them and they're skipped when iterating.
+ *
+ * The window spans from the lowest to the highest idx set, so a single far
+ * away idx makes it allocate for everything in between. Paxos indexes are
+ * dense apart from short-lived holes, and ReplicatedLog refuses indexes far
+ * ahead of its first unchosen one, so this is not a concern in practice.
+ *
+ * Not thread safe, callers are expected to synchronize.
+ */
+template <typename T>
+class LogWindow {
+ public:
+  using Index = uint64_t;
+
+  LogWindow() : head_(0), base_(0), span_(0), size_(0) {}
+
+  // Returns the entry at idx, default constructing it if it was not set.
+  T& operator[](Index idx) {
+    if (span_ == 0) {
+      base_ = idx;
+      head_ = 0;
+      Reserve(1);
+      span_ = 1;
+    } else if (idx < base_) {
+      // Grow at the front, e.g. a hole below the lowest entry held.
+      const size_t grow = base_ - idx;
+      Reserve(span_ + grow);
+      head_ = (head_ + slots_.size() - grow) & (slots_.size() - 1);
+      base_ = idx;
+      span_ += grow;
+    } else if (idx - base_ >= span_) {
+      Reserve(idx - base_ + 1);
+      span_ = idx - base_ + 1;
+    }
+    Slot& slot = SlotAt(idx);
+    if (!slot.present) {
+      slot.present = true;
+      ++size_;
+    }
+    return slot.value;
+  }
+
+  // Returns nullptr if there's no entry at idx.
+  T* find(Index idx) {
+    if (!InWindow(idx)) {
+      return nullptr;
+    }
+    Slot& slot = SlotAt(idx);
+    return slot.present ? &slot.value : nullptr;
+  }
+  const T* find(Index idx) const {
+    return const_cast<LogWindow*>(this)->find(idx);
+  }
+
+  bool contains(Index idx) const { return find(idx) != nullptr; }
+
+  // Drops every entry below idx.
+  void TruncatePrefix(Index idx) {
+    if (span_ == 0 || idx <= base_) {
+      return;
+    }
+    const size_t drop = std::min<uint64_t>(idx - base_, span_);
+    for (size_t i = 0; i < drop; ++i) {
+      Slot& slot = slots_[(head_ + i) & (slots_.size() - 1)];
+      if (slot.present) {
+        --size_;
+      }
+      // Release what the entry holds (e.g. its value) right away.
+      slot = Slot();
+    }
+    head_ = (head_ + drop) & (slots_.size() - 1);
+    base_ += drop;
+    span_ -= drop;
+  }
+
+  void clear() {
+    slots_.clear();
+    head_ = 0;
+    base_ = 0;
+    span_ = 0;
+    size_ = 0;
+  }
+
+  // Number of entries set.
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // Lowest and highest idx of the window, only valid if !empty(). Note these
+  // may be holes if the entry was never set.
+  Index first_index() const { return base_; }
+  Index last_index() const { return base_ + span_ - 1; }
+
+  // Calls fn(idx, entry) for every entry set, in idx order.
+  template <typename Fn>
+  void ForEach(Fn&& fn) const {
+    for (size_t i = 0; i < span_; ++i) {
+      const Slot& slot = slots_[(head_ + i) & (slots_.size() - 1)];
+      if (slot.present) {
+        fn(base_ + i, slot.value);
+      }
+    }
+  }
+
+ private:
+  struct Slot {
+    bool present = false;
+    T value{};
+  };
+
+  bool InWindow(Index idx) const {
+    return span_ > 0 && idx >= base_ && idx - base_ < span_;
+  }
+
+  Slot& SlotAt(Index idx) {
+    return slots_[(head_ + (idx - base_)) & (slots_.size() - 1)];
+  }
+
+  // Makes room for at least n slots, keeping the capacity a power of two so
+  // wrapping around is a mask.
+  void Reserve(size_t n) {
+    if (n <= slots_.size()) {
+      return;
+    }
+    const size_t capacity = std::bit_ceil(std::max<size_t>(n, kMinCapacity));
+    std::vector<Slot> slots(capacity);
+    for (size_t i = 0; i < span_; ++i) {
+      slots[i] = std::move(slots_[(head_ + i) & (slots_.size() - 1)]);
+    }
+    slots_ = std::move(slots);
+    head_ = 0;
+  }
+
+  static constexpr size_t kMinCapacity = 64;
+
+  // Slots outside of [head_, head_ + span_) are always empty.
+  std::vector<Slot> slots_;
+  size_t head_;  // Position in slots_ of base_.
+  Index base_;
+  size_t span_;  // Number of slots from base_ to the highest idx set.
+  size_t size_;  // Number of slots present.
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_LOG_WINDOW_H_
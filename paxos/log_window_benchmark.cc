@@ -0,0 +1,112 @@
+// Compares LogWindow against the std::map it replaced in ReplicatedLog for
+// the access patterns paxos uses: appending new indexes, point lookups of
+// recent indexes, scanning for the first unchosen index and truncating the
+// prefix.
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/initialize.h"
+#include "absl/strings/str_format.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "log_window.h"
+#include "replicated_log.h"
+
+ABSL_FLAG(uint64_t, num, 1 << 20, "Number of log entries.");
+ABSL_FLAG(uint64_t, truncate_every, 1 << 14,
+          "Truncate the log prefix every this many entries.");
+ABSL_FLAG(uint64_t, keep, 1 << 12,
+          "Number of most recent entries kept on each truncation.");
+ABSL_FLAG(uint64_t, value_size, 64, "Size of each entry's value.");
+
+namespace {
+
+using ::witnesskvs::paxos::LogWindow;
+using ::witnesskvs::paxos::ReplicatedLogEntry;
+
+// Minimal adapters so both containers run the exact same workload.
+struct MapLog {
+  std::map<uint64_t, ReplicatedLogEntry> entries;
+  ReplicatedLogEntry& Get(uint64_t idx) { return entries[idx]; }
+  const ReplicatedLogEntry* Find(uint64_t idx) const {
+    auto it = entries.find(idx);
+    return it == entries.end() ? nullptr : &it->second;
+  }
+  void Truncate(uint64_t idx) {
+    entries.erase(entries.begin(), entries.lower_bound(idx));
+  }
+};
+
+struct WindowLog {
+  LogWindow<ReplicatedLogEntry> entries;
+  ReplicatedLogEntry& Get(uint64_t idx) { return entries[idx]; }
+  const ReplicatedLogEntry* Find(uint64_t idx) const {
+    return entries.find(idx);
+  }
+  void Truncate(uint64_t idx) { entries.TruncatePrefix(idx); }
+};
+
+template <typename Log>
+absl::Duration Run(uint64_t* checksum) {
+  const uint64_t num = absl::GetFlag(FLAGS_num);
+  const uint64_t truncate_every = absl::GetFlag(FLAGS_truncate_every);
+  const uint64_t keep = absl::GetFlag(FLAGS_keep);
+  const std::string value(absl::GetFlag(FLAGS_value_size), 'x');
+
+  Log log;
+  uint64_t first_unchosen = 0;
+  const absl::Time start = absl::Now();
+  for (uint64_t idx = 0; idx < num; ++idx) {
+    // Prepare: read the min proposal, creating the entry.
+    ReplicatedLogEntry& entry = log.Get(idx);
+    entry.idx_ = idx;
+    entry.min_proposal_ = idx + 1;
+    // Accept.
+    log.Get(idx).accepted_proposal_ = idx + 1;
+    log.Get(idx).accepted_value_ = value;
+    // Commit, then advance the first unchosen index.
+    log.Get(idx).is_chosen_ = true;
+    while (true) {
+      const ReplicatedLogEntry* e = log.Find(first_unchosen);
+      if (e == nullptr || !e->is_chosen_) {
+        break;
+      }
+      *checksum += e->accepted_proposal_;
+      ++first_unchosen;
+    }
+    if (truncate_every > 0 && idx % truncate_every == 0 && idx > keep) {
+      log.Truncate(idx - keep);
+    }
+  }
+  return absl::Now() - start;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  absl::ParseCommandLine(argc, argv);
+  absl::InitializeLog();
+
+  uint64_t map_checksum = 0;
+  uint64_t window_checksum = 0;
+  const absl::Duration map_time = Run<MapLog>(&map_checksum);
+  const absl::Duration window_time = Run<WindowLog>(&window_checksum);
+  if (map_checksum != window_checksum) {
+    absl::PrintF("checksum mismatch: map: %d window: %d\n", map_checksum,
+                 window_checksum);
+    return 1;
+  }
+
+  const double num = static_cast<double>(absl::GetFlag(FLAGS_num));
+  absl::PrintF("entries: %d\n", absl::GetFlag(FLAGS_num));
+  absl::PrintF("std::map:  %s (%.1f ns/entry)\n", absl::FormatDuration(map_time),
+               absl::ToDoubleNanoseconds(map_time) / num);
+  absl::PrintF("LogWindow: %s (%.1f ns/entry)\n",
+               absl::FormatDuration(window_time),
+               absl::ToDoubleNanoseconds(window_time) / num);
+  absl::PrintF("speedup: %.2fx\n", absl::FDivDuration(map_time, window_time));
+  return 0;
+}
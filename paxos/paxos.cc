@@ -1,32 +1,70 @@
 #include "paxos.h"
 
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/time/time.h"
+
+ABSL_FLAG(bool, paxos_witness_metadata_only, true,
+          "Witnesses store the SHA-256 of the values they accept rather than "
+          "the values, which the leader fetches from a full replica if it "
+          "needs them");
+ABSL_FLAG(bool, paxos_follower_reads, true,
+          "Full replicas that aren't the leader serve reads too, once they "
+          "have applied everything the leader had chosen when the read "
+          "arrived, rather than redirecting them to the leader");
+ABSL_FLAG(absl::Duration, paxos_follower_read_timeout, absl::Seconds(1),
+          "How long a follower waits to catch up to the leader's read index "
+          "before redirecting a read to the leader instead");
+
 namespace witnesskvs::paxos {
 
 Paxos::Paxos(uint8_t node_id) : node_id_{node_id} {
   replicated_log_ = std::make_shared<ReplicatedLog>(node_id);
   paxos_node_ = std::make_shared<PaxosNode>(node_id, replicated_log_);
+  replicated_log_->SetMetadataOnly(
+      paxos_node_->IsWitness() &&
+      absl::GetFlag(FLAGS_paxos_witness_metadata_only));
 
   acceptor_ = std::make_unique<AcceptorService>(
-      paxos_node_->GetNodeAddress(node_id), node_id, replicated_log_);
+      paxos_node_->GetNodeAddress(node_id), node_id, replicated_log_,
+      [paxos_node = paxos_node_]() { return paxos_node->HasLeaderLease(); });
   CHECK_NE(acceptor_, nullptr);
 
   proposer_ = std::make_unique<Proposer>(paxos_node_->GetNumNodes(), node_id,
                                          replicated_log_, paxos_node_);
   CHECK_NE(proposer_, nullptr);
 
+  batcher_ = std::make_unique<Batcher>(
+      [this](const absl::Cord& batch) { return proposer_->Propose(batch); });
+
+  read_index_ = std::make_unique<ReadIndex>(
+      [paxos_node = paxos_node_]() { return paxos_node->FetchReadIndex(); });
+
   paxos_node_->MakeReady();
 }
 
 Paxos::~Paxos() {
   acceptor_.reset();
+  read_index_.reset();
+  batcher_.reset();
   proposer_.reset();
   replicated_log_.reset();
 }
 
-PaxosResult Paxos::Propose(const std::string& value, uint8_t* leader_node_id,
+PaxosResult Paxos::Propose(const absl::Cord& value, uint8_t* leader_node_id,
                            bool is_read) {
   CHECK_NE(this->proposer_, nullptr) << "Proposer should not be NULL.";
 
+  if (is_read && paxos_node_->HasLeaderLease()) {
+    // No other node can get anything chosen while the lease lasts, and every
+    // write acked so far is below our first unchosen index.
+    replicated_log_->WaitUntilApplied(replicated_log_->GetFirstUnchosenIdx());
+    return PAXOS_OK;
+  }
+
   if (!paxos_node_->ClusterHasEnoughNodesUp()) {
     // TODO [V]: Fix this with a user specified timeout/deadline for request.
     LOG(WARNING)
@@ -35,6 +73,10 @@ PaxosResult Paxos::Propose(const std::string& value, uint8_t* leader_node_id,
   }
 
   if (!IsLeader()) {
+    if (is_read && !IsWitness() && absl::GetFlag(FLAGS_paxos_follower_reads) &&
+        ReadOnFollower()) {
+      return PAXOS_OK;
+    }
     if (!leader_node_id) {
       return PAXOS_ERROR_NOT_PERMITTED;
     }
@@ -52,18 +94,54 @@ PaxosResult Paxos::Propose(const std::string& value, uint8_t* leader_node_id,
 
   // If the new leader is in the process of catching up, do not service
   // reads/writes.
-  CHECK(IsLeader());
-  while (!this->paxos_node_->IsLeaderCaughtUp()) {
-    absl::SleepFor(absl::Milliseconds(900));
+  if (!this->paxos_node_->WaitUntilLeaderCaughtUp()) {
+    LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                 << "] Lost leadership while catching up.";
+    return PAXOS_ERROR_LEADER_NOT_READY;
   }
 
   if (!is_read) {
-    proposer_->Propose(value);
+    if (value.empty()) {
+      // NOP paxos round, it has nothing to batch.
+      proposer_->Propose(value);
+    } else if (!batcher_->Add(value)) {
+      LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                   << "] Gave up on getting the value chosen.";
+      return PAXOS_ERROR_NO_QUORUM;
+    }
+  } else {
+    // Being the leader isn't enough, another node may have taken over
+    // without us knowing yet.
+    if (!this->paxos_node_->WaitForLeaderLease()) {
+      LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                   << "] No leader lease to serve reads with.";
+      return PAXOS_ERROR_LEADER_NOT_READY;
+    }
+    // Reads are served from the application state, make sure everything
+    // below the first unchosen index, i.e. every write acked so far, has made
+    // it there.
+    replicated_log_->WaitUntilApplied(replicated_log_->GetFirstUnchosenIdx());
   }
 
   return PAXOS_OK;
 }
 
+bool Paxos::ReadOnFollower() {
+  // Every write the leader had acked when the read arrived is below the
+  // index, once it's applied here the read sees all of them.
+  std::optional<uint64_t> index = read_index_->Get();
+  if (!index.has_value()) {
+    return false;
+  }
+  if (!replicated_log_->WaitUntilApplied(
+          *index, absl::GetFlag(FLAGS_paxos_follower_read_timeout))) {
+    LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                 << "] Timed out catching up to read index " << *index;
+    return false;
+  }
+  return true;
+}
+
 std::ostream& operator<<(std::ostream& os, PaxosResult error) {
   switch (error) {
     case PaxosResult::PAXOS_OK:
@@ -84,13 +162,53 @@ std::ostream& operator<<(std::ostream& os, PaxosResult error) {
   return os;
 }
 
-PaxosResult Paxos::RegisterAppCallback(
-    std::function<void(std::string)> callback) {
+PaxosResult Paxos::RegisterAppCallback(AppCallback callback) {
+  if (this->IsWitness()) {
+    return PAXOS_ERROR_NOT_PERMITTED;
+  }
+
+  this->replicated_log_->RegisterAppCallback(
+      [callback = std::move(callback)](const std::vector<absl::Cord>& batches) {
+        std::vector<absl::Cord> values;
+        for (const absl::Cord& batch : batches) {
+          CHECK(DecodeValueBatch(batch, &values))
+              << "Malformed batch of values in the log: " << batch;
+        }
+        if (!values.empty()) {
+          callback(values);
+        }
+      });
+  return PAXOS_OK;
+}
+
+PaxosResult Paxos::RegisterAppCallback(IndexedAppCallback callback,
+                                       uint64_t applied_idx) {
+  if (this->IsWitness()) {
+    return PAXOS_ERROR_NOT_PERMITTED;
+  }
+
+  this->replicated_log_->RegisterAppCallback(
+      [callback = std::move(callback)](const std::vector<absl::Cord>& batches,
+                                       uint64_t applied_idx) {
+        std::vector<absl::Cord> values;
+        for (const absl::Cord& batch : batches) {
+          CHECK(DecodeValueBatch(batch, &values))
+              << "Malformed batch of values in the log: " << batch;
+        }
+        callback(values, applied_idx);
+      },
+      applied_idx);
+  return PAXOS_OK;
+}
+
+PaxosResult Paxos::RegisterSnapshotCallbacks(SnapshotCallback snapshot,
+                                             InstallSnapshotCallback install) {
   if (this->IsWitness()) {
     return PAXOS_ERROR_NOT_PERMITTED;
   }
 
-  this->replicated_log_->RegisterAppCallback(callback);
+  this->replicated_log_->RegisterSnapshotCallbacks(std::move(snapshot),
+                                                   std::move(install));
   return PAXOS_OK;
 }
 
@@ -1,9 +1,13 @@
 #ifndef PAXOS_PAXOS_H_
 #define PAXOS_PAXOS_H_
 
+#include "absl/strings/cord.h"
+#include "absl/strings/string_view.h"
 #include "acceptor.h"
+#include "batcher.h"
 #include "paxos_node.h"
 #include "proposer.h"
+#include "read_index.h"
 #include "replicated_log.h"
 
 namespace witnesskvs::paxos {
@@ -22,8 +26,15 @@ class Paxos {
   std::shared_ptr<PaxosNode> paxos_node_;
   std::unique_ptr<AcceptorService> acceptor_;
   std::unique_ptr<Proposer> proposer_;
+  std::unique_ptr<Batcher> batcher_;
+  std::unique_ptr<ReadIndex> read_index_;
   uint8_t node_id_;
 
+  // Makes the application state on this follower recent enough to serve a
+  // linearizable read from, with a read index from the leader. Returns
+  // whether it did before --paxos_follower_read_timeout.
+  bool ReadOnFollower();
+
  public:
   Paxos(uint8_t node_id);
   ~Paxos();
@@ -32,15 +43,50 @@ class Paxos {
   // Paxos nodes. If value is empty this will trigger a NOP paxos round as
   // described in section 3 in
   // https://lamport.azurewebsites.net/pubs/paxos-simple.pdf
-  PaxosResult Propose(const std::string& value,
+  //
+  // The value's buffer is shared, not copied, all the way to the log and the
+  // application callback. Values proposed concurrently are batched into a
+  // single log entry, see Batcher. Returns PAXOS_ERROR_NO_QUORUM if the value
+  // couldn't be chosen within --paxos_propose_timeout, it may still be later.
+  //
+  // With is_read nothing is proposed, it returns PAXOS_OK once the
+  // application state is recent enough to serve a linearizable read from.
+  // That takes the leader lease, see PaxosNode::HasLeaderLease(), and no
+  // round trip while the lease lasts. Full replicas that aren't the leader
+  // serve reads too with --paxos_follower_reads, asking the leader how far
+  // they have to catch up first, see ReadIndex.
+  PaxosResult Propose(const absl::Cord& value,
                       uint8_t* leader_node_id = nullptr, bool is_read = false);
+  PaxosResult Propose(absl::string_view value,
+                      uint8_t* leader_node_id = nullptr, bool is_read = false) {
+    return Propose(absl::Cord(value), leader_node_id, is_read);
+  }
+
+  // Registers the callback chosen values are applied with, in batches and in
+  // log order, on a dedicated thread. Values batched into one log entry are
+  // handed over one by one.
+  PaxosResult RegisterAppCallback(AppCallback callback);
+  // Like the above for an application that stores how far it applied the
+  // log, e.g. in the same write as the values. The callback is passed the
+  // index to store with each batch, even one without values, and applied_idx
+  // is the index it stored last. Values chosen before a restart that it
+  // hadn't applied yet are applied first.
+  PaxosResult RegisterAppCallback(IndexedAppCallback callback,
+                                  uint64_t applied_idx);
 
-  PaxosResult RegisterAppCallback(std::function<void(std::string)> callback);
+  // Registers how snapshots of the application state are taken and
+  // installed, which peers missing entries the log no longer has, or more
+  // than --paxos_snapshot_catch_up_lag of them, are caught up with. The
+  // state must be as of the batches handed to the AppCallback so far, both
+  // are called with none being applied.
+  PaxosResult RegisterSnapshotCallbacks(SnapshotCallback snapshot,
+                                        InstallSnapshotCallback install);
 
   // Helper functions for unit testing.
   std::shared_ptr<ReplicatedLog>& GetReplicatedLog() { return replicated_log_; }  
   bool IsLeader() { return paxos_node_->IsLeader(); }
   bool IsWitness() { return paxos_node_->IsWitness(); }
+  bool HasLeaderLease() { return paxos_node_->HasLeaderLease(); }
   void RunTruncationOnce() { paxos_node_->RunTruncationOnce(); }
 };
 }  // namespace witnesskvs::paxos
@@ -1,8 +1,16 @@
 #include "paxos_node.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <filesystem>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <limits>
+#include <numeric>
+#include <optional>
+#include <utility>
 
 #include "proposer.h"
 
@@ -11,12 +19,22 @@
 #include <grpcpp/create_channel.h>
 
 #include "absl/base/optimization.h"
+#include "absl/flags/declare.h"
 #include "absl/flags/flag.h"
 #include "absl/log/log.h"
+#include "absl/strings/str_cat.h"
 #include "absl/synchronization/mutex.h"
-
-ABSL_FLAG(absl::Duration, paxos_node_heartbeat_interval, absl::Seconds(3),
-          "Heartbeat interval for paxos node");
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+ABSL_FLAG(absl::Duration, paxos_node_heartbeat_interval,
+          absl::Milliseconds(500),
+          "Heartbeat interval for paxos node, sub-second intervals detect "
+          "failures sooner");
+ABSL_FLAG(absl::Duration, paxos_node_ping_deadline, absl::Milliseconds(500),
+          "Deadline for each heartbeat ping, a peer that doesn't answer in "
+          "time misses the heartbeat");
 
 // Note: for demo purposes this should be set to be small.
 ABSL_FLAG(absl::Duration, paxos_node_truncation_interval, absl::Seconds(60),
@@ -25,11 +43,32 @@ ABSL_FLAG(absl::Duration, paxos_node_truncation_interval, absl::Seconds(60),
 ABSL_FLAG(bool, paxos_node_truncation_enabled, true,
           "Should we truncate or not.");
 
+ABSL_FLAG(absl::Duration, paxos_node_rpc_deadline, absl::Seconds(1),
+          "Deadline for each Prepare and Accept sent to an acceptor");
+
 ABSL_FLAG(std::string, paxos_node_config_file, "paxos/nodes_config.txt",
           "Paxos config file for nodes ip addresses and ports");
 ABSL_FLAG(std::vector<std::string>, paxos_node_list, {},
           "Comma separated list of ip addresses and ports");
 
+ABSL_FLAG(bool, paxos_replication_stream, true,
+          "Send Accepts and Commits over a long-lived stream per peer rather "
+          "than an RPC each");
+
+ABSL_DECLARE_FLAG(absl::Duration, paxos_leader_lease_duration);
+ABSL_FLAG(double, paxos_leader_lease_clock_drift, 0.05,
+          "Bound on how much faster than the leader's clock an acceptor's may "
+          "run, as a fraction. The leader considers its lease to end this "
+          "much earlier than acceptors do");
+
+ABSL_FLAG(std::string, paxos_snapshot_directory, "/var/tmp",
+          "Directory snapshots of the application state are written to and "
+          "received in, when catching up peers with them");
+ABSL_FLAG(uint64_t, paxos_snapshot_chunk_bytes, 1 << 20,
+          "Size of the chunks snapshot files are sent to peers in");
+ABSL_FLAG(absl::Duration, paxos_snapshot_deadline, absl::Minutes(10),
+          "How long sending and installing a snapshot on a peer may take");
+
 ABSL_FLAG(bool, witness_support, true, "Enable witness support");
 ABSL_FLAG(bool, lower_node_witness, false, "Lower nodes are witnesses");
 
@@ -38,7 +77,9 @@ namespace witnesskvs::paxos {
 PaxosNode::PaxosNode(uint8_t node_id, std::shared_ptr<ReplicatedLog> rlog)
     : num_active_acceptors_conns_{},
       replicated_log_{rlog},
-      leader_node_id_{INVALID_NODE_ID} {
+      leader_node_id_{INVALID_NODE_ID},
+      leader_proposal_{0},
+      lease_expiry_{0} {
   // TODO: shouldn't this be passed in from kvs_server?
   if (!absl::GetFlag(FLAGS_paxos_node_list).empty()) {
     nodes_ = ParseNodesList(absl::GetFlag(FLAGS_paxos_node_list));
@@ -75,12 +116,43 @@ PaxosNode::PaxosNode(uint8_t node_id, std::shared_ptr<ReplicatedLog> rlog)
 
   acceptor_stubs_.resize(nodes_.size());
   acceptor_stubs_size_ = nodes_.size();
+
+  // They only connect once there is something to send.
+  for (const auto& node : nodes_) {
+    replication_streams_.push_back(
+        std::make_unique<ReplicationStream>(node->GetAddressPortStr()));
+    failure_detectors_.push_back(std::make_unique<FailureDetector>(
+        absl::GetFlag(FLAGS_paxos_node_heartbeat_interval)));
+  }
+  for (std::size_t i = 0; i < nodes_.size(); ++i) {
+    const uint8_t peer_node_id = static_cast<uint8_t>(i);
+    if (peer_node_id == node_id_) {
+      peer_replicators_.push_back(nullptr);
+      continue;
+    }
+    peer_replicators_.push_back(std::make_unique<PeerReplicator>(
+        node_id_, peer_node_id, replicated_log_,
+        [this, peer_node_id](paxos_rpc::CommitBatchRequest request,
+                             paxos_rpc::CommitBatchResponse* response) {
+          return CommitBatchGrpc(peer_node_id, std::move(request), response);
+        },
+        [this, peer_node_id]() { return InstallSnapshotOn(peer_node_id); }));
+  }
 }
 
 PaxosNode::~PaxosNode() {
-  absl::MutexLock l(&lock_);
-  heartbeat_thread_.get_stop_source().request_stop();
-  truncation_thread_.get_stop_source().request_stop();
+  {
+    absl::MutexLock l(&lock_);
+    heartbeat_thread_.get_stop_source().request_stop();
+    truncation_thread_.get_stop_source().request_stop();
+  }
+  // They send with lock_ and members declared after them, so they stop
+  // before those go.
+  for (auto& replicator : peer_replicators_) {
+    if (replicator != nullptr) {
+      replicator->Stop();
+    }
+  }
 }
 
 void PaxosNode::Truncate(const uint64_t min_index) {
@@ -194,50 +266,115 @@ void PaxosNode::HeartbeatThread(std::stop_token st) {
             << absl::GetFlag(FLAGS_paxos_node_heartbeat_interval);
 
   while (!st.stop_requested()) {
+    const absl::Time round_start = absl::Now();
     uint8_t highest_node_id = 0;
     bool cluster_has_valid_leader = false;
+    const bool is_leader = IsLeader();
+    const uint64_t first_unchosen_idx =
+        this->replicated_log_->GetFirstUnchosenIdx();
+    // Peers that are behind on entries they never accepted need them sent
+    // explicitly.
+    std::vector<uint64_t> commit_idxs(GetNumNodes(),
+                                      std::numeric_limits<uint64_t>::max());
+    const absl::Duration lease_duration =
+        absl::GetFlag(FLAGS_paxos_leader_lease_duration);
+    const auto lease_start = std::chrono::steady_clock::now();
+    auto request = std::make_shared<paxos_rpc::PingRequest>();
+    request->set_node_id(node_id_);
+    if (is_leader) {
+      request->set_first_unchosen_index(first_unchosen_idx);
+      request->set_proposal_number(
+          leader_proposal_.load(std::memory_order_relaxed));
+      // Only once caught up, i.e. once our range promise is in place.
+      request->set_request_lease(IsLeaderCaughtUp() &&
+                                 lease_duration > absl::ZeroDuration());
+    }
+
+    // Ping everyone at once so that a hung peer only holds up the round for
+    // the deadline. Stubs for nodes not connected yet are only kept if their
+    // ping succeeds.
+    std::vector<std::unique_ptr<paxos_rpc::Acceptor::Stub>> new_stubs(
+        acceptor_stubs_size_);
+    auto call = std::make_shared<QuorumCall<paxos_rpc::PingResponse>>(
+        acceptor_stubs_size_);
+    const auto deadline = absl::ToChronoTime(
+        round_start + absl::GetFlag(FLAGS_paxos_node_ping_deadline));
     for (std::size_t i = 0; i < acceptor_stubs_size_; i++) {
-      paxos_rpc::PingRequest request;
-      paxos_rpc::PingResponse response;
-      grpc::ClientContext context;
-      grpc::Status status;
-      std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(i);
-      if (stub != nullptr) {
-        // Don't need a lock around this call like the others do since we're the
-        // only one that will change the stub.
-        status = stub->Ping(&context, request, &response);
-        if (!status.ok()) {
-          LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
-                       << "] Connection lost with node: " << i;
-          absl::MutexLock l(&lock_);
-          acceptor_stubs_[i].reset();
-          CHECK(num_active_acceptors_conns_);
-          num_active_acceptors_conns_--;
-        }
-      } else {
-        auto channel = grpc::CreateChannel(nodes_[i]->GetAddressPortStr(),
-                                           grpc::InsecureChannelCredentials());
-        auto new_stub = paxos_rpc::Acceptor::NewStub(channel);
-        status = new_stub->Ping(&context, request, &response);
+      // Don't need a lock around the stub like the others do since we're the
+      // only one that will change it.
+      paxos_rpc::Acceptor::Stub* stub = GetAcceptorStub(i).get();
+      if (stub == nullptr) {
+        new_stubs[i] = paxos_rpc::Acceptor::NewStub(
+            grpc::CreateChannel(nodes_[i]->GetAddressPortStr(),
+                                grpc::InsecureChannelCredentials()));
+        stub = new_stubs[i].get();
+      }
+      auto context = std::make_shared<grpc::ClientContext>();
+      context->set_deadline(deadline);
+      auto response = std::make_shared<paxos_rpc::PingResponse>();
+      const absl::Time sent = absl::Now();
+      stub->async()->Ping(
+          context.get(), request.get(), response.get(),
+          [this, call, context, request, response, i,
+           sent](grpc::Status status) {
+            if (status.ok()) {
+              const absl::Time now = absl::Now();
+              failure_detectors_[i]->Heartbeat(now, now - sent);
+            }
+            call->Add(i, std::move(status), std::move(*response));
+          });
+    }
+
+    const auto replies = call->WaitAll();
+    const absl::Time now = absl::Now();
+    std::size_t lease_grants = 0;
+    for (const auto& reply : replies) {
+      const uint8_t i = reply.node_id;
+      const grpc::Status& status = reply.status;
+      if (new_stubs[i] != nullptr) {
         if (status.ok()) {
           LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
                     << "] [Witness: " << nodes_[node_id_]->IsWitness()
-                    << "] Connection established with node: " << i;
+                    << "] Connection established with node: "
+                    << static_cast<uint32_t>(i);
           absl::MutexLock l(&lock_);
-          stub = std::move(new_stub);
+          acceptor_stubs_[i] = std::move(new_stubs[i]);
           num_active_acceptors_conns_++;
         }
+      } else if (!status.ok() &&
+                 (status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED ||
+                  !failure_detectors_[i]->IsAvailable(now))) {
+        // Refused connections are certain, a ping that merely timed out is
+        // left to the failure detector to judge.
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] Connection lost with node: "
+                     << static_cast<uint32_t>(i) << " ("
+                     << status.error_message()
+                     << ", phi: " << failure_detectors_[i]->Phi(now) << ")";
+        failure_detectors_[i]->Reset();
+        absl::MutexLock l(&lock_);
+        acceptor_stubs_[i].reset();
+        CHECK(num_active_acceptors_conns_);
+        num_active_acceptors_conns_--;
       }
 
-      if (status.ok()) {
-        if (!nodes_[response.node_id()]->IsWitness()) {
-          // If there is atleast one non-witness node, we have a valid leader
-          // node.
-          cluster_has_valid_leader = true;
-          highest_node_id = std::max(highest_node_id,
-                                     static_cast<uint8_t>(response.node_id()));
-        }
+      if (status.ok() && is_leader &&
+          reply.response.first_unchosen_index() < first_unchosen_idx) {
+        commit_idxs[i] = reply.response.first_unchosen_index();
       }
+      if (status.ok() && reply.response.lease_granted()) {
+        ++lease_grants;
+      }
+      if (GetAcceptorStub(i) != nullptr && !nodes_[i]->IsWitness()) {
+        // If there is atleast one non-witness node, we have a valid leader
+        // node.
+        cluster_has_valid_leader = true;
+        highest_node_id = std::max(highest_node_id, i);
+      }
+      VLOG(2) << "NODE: [" << static_cast<uint32_t>(node_id_)
+              << "] Node: " << static_cast<uint32_t>(i)
+              << " rtt: " << failure_detectors_[i]->Rtt()
+              << " phi: " << failure_detectors_[i]->Phi(now);
     }
 
     bool node_is_new_leader = false;
@@ -245,8 +382,23 @@ void PaxosNode::HeartbeatThread(std::stop_token st) {
       // TODO(vishnu/ritesh): the purpose behind this logic should be explained
       // probably in a not-so-short comment here.
       absl::MutexLock l(&lock_);
+      if (request->request_lease() && lease_grants >= quorum_) {
+        // Acceptors time the lease from when they got the ping, which is
+        // after we sent it, but their clocks may run faster than ours.
+        const auto expiry =
+            lease_start +
+            std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                absl::ToChronoNanoseconds(
+                    lease_duration *
+                    (1 - absl::GetFlag(FLAGS_paxos_leader_lease_clock_drift))));
+        lease_expiry_.store(
+            std::max(lease_expiry_.load(std::memory_order_relaxed),
+                     expiry.time_since_epoch().count()),
+            std::memory_order_release);
+      }
       if (!(cluster_has_valid_leader && (num_active_acceptors_conns_ > 1))) {
         leader_node_id_ = INVALID_NODE_ID;
+        lease_expiry_.store(0, std::memory_order_release);
       } else if (leader_node_id_ != highest_node_id) {
         LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
                   << "] New leader elected with node id: "
@@ -256,71 +408,72 @@ void PaxosNode::HeartbeatThread(std::stop_token st) {
                       [](auto& e) { e->SetIsLeader(false); });
         nodes_[leader_node_id_]->SetIsLeader(true);
         leader_caught_up_ = false;
+        lease_expiry_.store(0, std::memory_order_release);
         node_is_new_leader = (node_id_ == leader_node_id_);
       }
     }
 
     if (node_is_new_leader) {
       PerformLeaderCatchUp();
+    } else if (is_leader && IsLeader()) {
+      CommitOnPeerNodes(commit_idxs);
     }
     absl::MutexLock l(&lock_);
     auto stopping = [&st]() { return st.stop_requested(); };
-    lock_.AwaitWithTimeout(absl::Condition(&stopping),
-                           absl::GetFlag(FLAGS_paxos_node_heartbeat_interval));
+    // Rounds start an interval apart however long the pings took, which is
+    // the spacing the failure detectors expect.
+    lock_.AwaitWithTimeout(
+        absl::Condition(&stopping),
+        round_start + absl::GetFlag(FLAGS_paxos_node_heartbeat_interval) -
+            absl::Now());
   }
 
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
             << "] Shutting down heartbeat thread";
 }
 
-void PaxosNode::ProposeNopAsync(void) {
+void PaxosNode::CatchUpAsync(void) {
+  const absl::Time start = absl::Now();
   auto proposer = std::make_unique<Proposer>(
       this->GetNumNodes(), node_id_, replicated_log_, shared_from_this());
-  proposer->Propose("");
+  proposer->CatchUp();
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
-            << "] Performed a Paxos No-op round";
+            << "] Leader caught up in " << absl::Now() - start;
+  absl::MutexLock l(&lock_);
   leader_caught_up_ = true;
 }
 
 void PaxosNode::PerformLeaderCatchUp(void) {
-  auto func = std::bind(&PaxosNode::ProposeNopAsync, this);
+  auto func = std::bind(&PaxosNode::CatchUpAsync, this);
   async_leader_catch_up_ = std::async(std::launch::async, func);
 }
 
-void PaxosNode::CommitAsync(uint8_t node_id, uint64_t idx) {
-  uint64_t commit_idx = idx;
-  while (commit_idx < this->replicated_log_->GetFirstUnchosenIdx()) {
-    paxos_rpc::CommitRequest commit_request;
-    commit_request.set_index(commit_idx);
-    commit_request.set_value(
-        this->replicated_log_->GetLogEntryAtIdx(commit_idx).accepted_value_);
-    paxos_rpc::CommitResponse commit_response;
-
-    grpc::Status status;
-    {
-      // Limit the scope of this shared_ptr within these braces.
-      std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub =
-          GetAcceptorStub(node_id);
-      grpc::ClientContext context;
-      absl::ReaderMutexLock rl(&lock_);
-      if (stub == nullptr) {
-        status = grpc::Status(grpc::StatusCode::UNAVAILABLE,
-                              "Acceptor not available right now.");
-      } else {
-        status = stub->Commit(&context, commit_request, &commit_response);
-      }
-    }
+bool PaxosNode::WaitUntilLeaderCaughtUp() {
+  absl::MutexLock l(&lock_);
+  auto done = [this]() { return !IsLeader() || leader_caught_up_; };
+  lock_.Await(absl::Condition(&done));
+  return IsLeaderCaughtUp();
+}
 
-    if (!status.ok()) {
-      break;
-    }
+bool PaxosNode::HasLeaderLease() const {
+  return IsLeaderCaughtUp() &&
+         std::chrono::steady_clock::now().time_since_epoch().count() <
+             lease_expiry_.load(std::memory_order_acquire);
+}
 
-    CHECK_LT(commit_idx, commit_response.first_unchosen_index())
-        << "NODE: [" << static_cast<uint32_t>(node_id_)
-        << "] This index was just committed, the response must return an "
-           "index beyond it";
-    commit_idx = commit_response.first_unchosen_index();
+bool PaxosNode::WaitForLeaderLease() {
+  if (absl::GetFlag(FLAGS_paxos_leader_lease_duration) <=
+      absl::ZeroDuration()) {
+    return true;
   }
+  absl::MutexLock l(&lock_);
+  // The lease is asked for with the first heartbeat once caught up.
+  auto done = [this]() { return !IsLeader() || HasLeaderLease(); };
+  lock_.AwaitWithTimeout(
+      absl::Condition(&done),
+      2 * absl::GetFlag(FLAGS_paxos_node_heartbeat_interval) +
+          absl::GetFlag(FLAGS_paxos_node_ping_deadline));
+  return HasLeaderLease();
 }
 
 void PaxosNode::MakeReady() {
@@ -328,18 +481,15 @@ void PaxosNode::MakeReady() {
       std::jthread(std::bind_front(&PaxosNode::HeartbeatThread, this));
   truncation_thread_ =
       std::jthread(std::bind_front(&PaxosNode::TruncationLoop, this));
-  commit_futures_.resize(GetNumNodes());
 }
 
 void PaxosNode::CommitOnPeerNodes(const std::vector<uint64_t>& commit_idxs) {
-  auto commit_async = std::bind(&PaxosNode::CommitAsync, this,
-                                std::placeholders::_1, std::placeholders::_2);
   for (std::size_t i = 0; i < GetNumNodes(); i++) {
     if (static_cast<uint8_t>(i) == node_id_) continue;
-
+    // Peers not heard from, or already caught up, have nothing to catch up
+    // on.
     if (commit_idxs[i] < this->replicated_log_->GetFirstUnchosenIdx()) {
-      commit_futures_[i] = std::async(std::launch::async, commit_async,
-                                      static_cast<uint8_t>(i), commit_idxs[i]);
+      peer_replicators_[i]->Notify(commit_idxs[i]);
     }
   }
 }
@@ -367,16 +517,6 @@ bool PaxosNode::ClusterHasEnoughNodesUp() {
     }                                                           \
   } while (0)
 
-grpc::Status PaxosNode::PrepareGrpc(uint8_t node_id,
-                                    paxos_rpc::PrepareRequest request,
-                                    paxos_rpc::PrepareResponse* response) {
-  std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
-  grpc::ClientContext context;
-  absl::ReaderMutexLock rl(&lock_);
-  RETURN_IF_NULLPTR(stub);
-  return stub->Prepare(&context, request, response);
-}
-
 std::unique_ptr<paxos_rpc::Acceptor::Stub>& PaxosNode::GetAcceptorStub(
     uint8_t node_id) {
   absl::ReaderMutexLock l(&lock_);
@@ -387,19 +527,214 @@ std::unique_ptr<paxos_rpc::Acceptor::Stub>& PaxosNode::GetAcceptorStub(
   return acceptor_stubs_[node_id];
 }
 
-grpc::Status PaxosNode::AcceptGrpc(uint8_t node_id,
-                                   paxos_rpc::AcceptRequest request,
-                                   paxos_rpc::AcceptResponse* response) {
-  std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
-  grpc::ClientContext context;
-  absl::ReaderMutexLock rl(&lock_);
-  RETURN_IF_NULLPTR(stub);
-  return stub->Accept(&context, request, response);
+template <typename Request, typename Response, typename Send>
+std::shared_ptr<QuorumCall<Response>> PaxosNode::SendTo(
+    const Request& request, const std::vector<uint8_t>& node_ids,
+    std::shared_ptr<QuorumCall<Response>> call, Send send) {
+  if (call == nullptr) {
+    call = std::make_shared<QuorumCall<Response>>(node_ids.size());
+  } else {
+    call->Expect(node_ids.size());
+  }
+  // The request and every RPC's context and response have to outlive the
+  // RPC, which may outlive this call.
+  auto shared_request = std::make_shared<const Request>(request);
+  const auto deadline = absl::ToChronoTime(
+      absl::Now() + absl::GetFlag(FLAGS_paxos_node_rpc_deadline));
+  for (const uint8_t node_id : node_ids) {
+    std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
+    absl::ReaderMutexLock rl(&lock_);
+    if (ABSL_PREDICT_FALSE(stub == nullptr)) {
+      call->Add(node_id,
+                grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                             "Acceptor not available right now."),
+                Response());
+      continue;
+    }
+    auto context = std::make_shared<grpc::ClientContext>();
+    context->set_deadline(deadline);
+    auto response = std::make_shared<Response>();
+    send(stub->async(), context.get(), shared_request.get(), response.get(),
+         [call, context, shared_request, response,
+          node_id](grpc::Status status) {
+           call->Add(node_id, std::move(status), std::move(*response));
+         });
+  }
+  return call;
+}
+
+template <typename Request, typename Response, typename Send>
+std::shared_ptr<QuorumCall<Response>> PaxosNode::SendToAll(
+    const Request& request, Send send) {
+  std::vector<uint8_t> node_ids(GetNumNodes());
+  std::iota(node_ids.begin(), node_ids.end(), 0);
+  return SendTo<Request, Response>(request, node_ids, nullptr,
+                                   std::move(send));
+}
+
+std::vector<uint8_t> PaxosNode::GetPreferredNodes() const {
+  std::vector<uint8_t> node_ids(GetNumNodes());
+  std::iota(node_ids.begin(), node_ids.end(), 0);
+  auto rank = [this](uint8_t node_id) {
+    if (node_id == node_id_) return 0;
+    return nodes_[node_id]->IsWitness() ? 2 : 1;
+  };
+  // The closest first among full replicas and among witnesses.
+  std::vector<absl::Duration> rtts(GetNumNodes());
+  for (std::size_t i = 0; i < rtts.size(); ++i) {
+    rtts[i] = GetRtt(i);
+  }
+  std::stable_sort(node_ids.begin(), node_ids.end(),
+                   [&rank, &rtts](uint8_t a, uint8_t b) {
+                     return std::make_pair(rank(a), rtts[a]) <
+                            std::make_pair(rank(b), rtts[b]);
+                   });
+  return node_ids;
+}
+
+std::shared_ptr<QuorumCall<paxos_rpc::PrepareResponse>> PaxosNode::PrepareAll(
+    const paxos_rpc::PrepareRequest& request) {
+  return SendToAll<paxos_rpc::PrepareRequest, paxos_rpc::PrepareResponse>(
+      request, [](auto* async, auto* context, auto* request, auto* response,
+                  auto done) {
+        async->Prepare(context, request, response, std::move(done));
+      });
+}
+
+std::shared_ptr<QuorumCall<paxos_rpc::PrepareRangeResponse>>
+PaxosNode::PrepareRangeAll(const paxos_rpc::PrepareRangeRequest& request) {
+  return SendToAll<paxos_rpc::PrepareRangeRequest,
+                   paxos_rpc::PrepareRangeResponse>(
+      request, [](auto* async, auto* context, auto* request, auto* response,
+                  auto done) {
+        async->PrepareRange(context, request, response, std::move(done));
+      });
+}
+
+namespace {
+
+auto SendAccept = [](auto* async, auto* context, auto* request, auto* response,
+                     auto done) {
+  async->Accept(context, request, response, std::move(done));
+};
+
+}  // namespace
+
+std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> PaxosNode::AcceptAll(
+    const paxos_rpc::AcceptRequest& request) {
+  std::vector<uint8_t> node_ids(GetNumNodes());
+  std::iota(node_ids.begin(), node_ids.end(), 0);
+  return AcceptOn(request, node_ids);
+}
+
+std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> PaxosNode::AcceptOn(
+    const paxos_rpc::AcceptRequest& request,
+    const std::vector<uint8_t>& node_ids,
+    std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> call) {
+  if (!absl::GetFlag(FLAGS_paxos_replication_stream)) {
+    return SendTo<paxos_rpc::AcceptRequest, paxos_rpc::AcceptResponse>(
+        request, node_ids, std::move(call), SendAccept);
+  }
+  paxos_rpc::ReplicationRequest replication_request;
+  *replication_request.mutable_accept() = request;
+  return StreamTo<paxos_rpc::AcceptResponse>(
+      replication_request, node_ids, std::move(call),
+      [](paxos_rpc::ReplicationResponse& response) {
+        return std::move(*response.mutable_accept());
+      });
+}
+
+std::shared_ptr<QuorumCall<paxos_rpc::AcceptBatchResponse>>
+PaxosNode::AcceptBatchAll(const paxos_rpc::AcceptBatchRequest& request) {
+  std::vector<uint8_t> node_ids(GetNumNodes());
+  std::iota(node_ids.begin(), node_ids.end(), 0);
+  if (!absl::GetFlag(FLAGS_paxos_replication_stream)) {
+    return SendTo<paxos_rpc::AcceptBatchRequest,
+                  paxos_rpc::AcceptBatchResponse>(
+        request, node_ids, nullptr,
+        [](auto* async, auto* context, auto* request, auto* response,
+           auto done) {
+          async->AcceptBatch(context, request, response, std::move(done));
+        });
+  }
+  paxos_rpc::ReplicationRequest replication_request;
+  *replication_request.mutable_accept_batch() = request;
+  return StreamTo<paxos_rpc::AcceptBatchResponse>(
+      replication_request, node_ids, nullptr,
+      [](paxos_rpc::ReplicationResponse& response) {
+        return std::move(*response.mutable_accept_batch());
+      });
+}
+
+template <typename Response, typename Extract>
+std::shared_ptr<QuorumCall<Response>> PaxosNode::StreamTo(
+    const paxos_rpc::ReplicationRequest& request,
+    const std::vector<uint8_t>& node_ids,
+    std::shared_ptr<QuorumCall<Response>> call, Extract extract) {
+  if (call == nullptr) {
+    call = std::make_shared<QuorumCall<Response>>(node_ids.size());
+  } else {
+    call->Expect(node_ids.size());
+  }
+  const absl::Time deadline =
+      absl::Now() + absl::GetFlag(FLAGS_paxos_node_rpc_deadline);
+  for (const uint8_t node_id : node_ids) {
+    replication_streams_[node_id]->Send(
+        request, deadline,
+        [call, node_id, extract](grpc::Status status,
+                                 paxos_rpc::ReplicationResponse response) {
+          call->Add(node_id, std::move(status), extract(response));
+        });
+  }
+  return call;
+}
+
+grpc::Status PaxosNode::StreamAndWait(uint8_t node_id,
+                                      paxos_rpc::ReplicationRequest request,
+                                      paxos_rpc::ReplicationResponse* response) {
+  absl::Notification done;
+  grpc::Status status;
+  replication_streams_[node_id]->Send(
+      std::move(request),
+      absl::Now() + absl::GetFlag(FLAGS_paxos_node_rpc_deadline),
+      [&done, &status, response](grpc::Status s,
+                                 paxos_rpc::ReplicationResponse r) {
+        status = std::move(s);
+        *response = std::move(r);
+        done.Notify();
+      });
+  done.WaitForNotification();
+  return status;
+}
+
+std::shared_ptr<QuorumCall<paxos_rpc::FetchValueResponse>>
+PaxosNode::FetchValueFromReplicas(const paxos_rpc::FetchValueRequest& request) {
+  std::vector<uint8_t> node_ids;
+  for (uint8_t node_id = 0; node_id < GetNumNodes(); ++node_id) {
+    if (!nodes_[node_id]->IsWitness()) {
+      node_ids.push_back(node_id);
+    }
+  }
+  return SendTo<paxos_rpc::FetchValueRequest, paxos_rpc::FetchValueResponse>(
+      request, node_ids, nullptr,
+      [](auto* async, auto* context, auto* request, auto* response,
+         auto done) {
+        async->FetchValue(context, request, response, std::move(done));
+      });
 }
 
 grpc::Status PaxosNode::CommitGrpc(uint8_t node_id,
                                    paxos_rpc::CommitRequest request,
                                    paxos_rpc::CommitResponse* response) {
+  if (absl::GetFlag(FLAGS_paxos_replication_stream)) {
+    paxos_rpc::ReplicationRequest replication_request;
+    *replication_request.mutable_commit() = std::move(request);
+    paxos_rpc::ReplicationResponse replication_response;
+    grpc::Status status = StreamAndWait(node_id, std::move(replication_request),
+                                        &replication_response);
+    *response = std::move(*replication_response.mutable_commit());
+    return status;
+  }
   std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
   grpc::ClientContext context;
   absl::ReaderMutexLock rl(&lock_);
@@ -407,6 +742,150 @@ grpc::Status PaxosNode::CommitGrpc(uint8_t node_id,
   return stub->Commit(&context, request, response);
 }
 
+grpc::Status PaxosNode::CommitBatchGrpc(uint8_t node_id,
+                                        paxos_rpc::CommitBatchRequest request,
+                                        paxos_rpc::CommitBatchResponse* response) {
+  if (absl::GetFlag(FLAGS_paxos_replication_stream)) {
+    paxos_rpc::ReplicationRequest replication_request;
+    *replication_request.mutable_commit_batch() = std::move(request);
+    paxos_rpc::ReplicationResponse replication_response;
+    grpc::Status status = StreamAndWait(node_id, std::move(replication_request),
+                                        &replication_response);
+    *response = std::move(*replication_response.mutable_commit_batch());
+    return status;
+  }
+  std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
+  grpc::ClientContext context;
+  absl::ReaderMutexLock rl(&lock_);
+  RETURN_IF_NULLPTR(stub);
+  return stub->CommitBatch(&context, request, response);
+}
+
+std::optional<uint64_t> PaxosNode::InstallSnapshotOn(uint8_t node_id) {
+  const std::filesystem::path dir =
+      std::filesystem::path(absl::GetFlag(FLAGS_paxos_snapshot_directory)) /
+      absl::StrCat("snapshot", node_id_, "_for", node_id);
+  std::filesystem::remove_all(dir);
+  uint64_t idx;
+  if (nodes_[node_id]->IsWitness()) {
+    // Witnesses have no application state, only their log has to move on.
+    idx = replicated_log_->GetAppliedIdx();
+  } else {
+    std::optional<uint64_t> snapshot_idx =
+        replicated_log_->CreateSnapshot(dir.string());
+    if (!snapshot_idx.has_value()) {
+      LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                   << "] No snapshot of the application state to catch up "
+                      "node "
+                   << static_cast<uint32_t>(node_id) << " with";
+      std::filesystem::remove_all(dir);
+      return std::nullopt;
+    }
+    idx = *snapshot_idx;
+  }
+
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] Sending snapshot as of idx: " << idx << " to node "
+            << static_cast<uint32_t>(node_id);
+  paxos_rpc::InstallSnapshotResponse response;
+  grpc::Status status = SendSnapshot(node_id, idx, dir, &response);
+  std::filesystem::remove_all(dir);
+  if (!status.ok()) {
+    LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                 << "] Sending snapshot to node "
+                 << static_cast<uint32_t>(node_id)
+                 << " failed: " << status.error_message();
+    return std::nullopt;
+  }
+  return response.first_unchosen_index();
+}
+
+grpc::Status PaxosNode::SendSnapshot(
+    uint8_t node_id, uint64_t idx, const std::filesystem::path& dir,
+    paxos_rpc::InstallSnapshotResponse* response) {
+  // A channel of its own, a transfer can take far longer than lock_ may be
+  // held for.
+  std::unique_ptr<paxos_rpc::Acceptor::Stub> stub =
+      paxos_rpc::Acceptor::NewStub(
+          grpc::CreateChannel(nodes_[node_id]->GetAddressPortStr(),
+                              grpc::InsecureChannelCredentials()));
+  grpc::ClientContext context;
+  context.set_deadline(absl::ToChronoTime(
+      absl::Now() + absl::GetFlag(FLAGS_paxos_snapshot_deadline)));
+  std::unique_ptr<grpc::ClientWriter<paxos_rpc::InstallSnapshotRequest>>
+      writer = stub->InstallSnapshot(&context, response);
+
+  const uint64_t chunk_bytes =
+      std::max<uint64_t>(absl::GetFlag(FLAGS_paxos_snapshot_chunk_bytes), 1);
+  std::string buffer(chunk_bytes, '\0');
+  paxos_rpc::InstallSnapshotRequest chunk;
+  chunk.set_index(idx);
+  std::error_code error;
+  for (const auto& file :
+       std::filesystem::directory_iterator(dir, error)) {
+    if (!file.is_regular_file()) {
+      continue;
+    }
+    std::ifstream in(file.path(), std::ios::binary);
+    uint64_t offset = 0;
+    // Empty files are sent as a single empty chunk.
+    do {
+      in.read(buffer.data(), buffer.size());
+      const std::streamsize read = in.gcount();
+      chunk.set_file_name(file.path().filename().string());
+      chunk.set_offset(offset);
+      chunk.set_data(buffer.data(), read);
+      offset += read;
+      // Blocks while the peer is behind on taking chunks.
+      if (!writer->Write(chunk)) {
+        return writer->Finish();
+      }
+    } while (in);
+    if (in.bad()) {
+      context.TryCancel();
+      writer->Finish();
+      return grpc::Status(grpc::StatusCode::INTERNAL,
+                          "Failed to read snapshot file");
+    }
+  }
+  chunk.clear_file_name();
+  chunk.clear_offset();
+  chunk.clear_data();
+  chunk.set_done(true);
+  writer->Write(chunk);
+  writer->WritesDone();
+  return writer->Finish();
+}
+
+grpc::Status PaxosNode::ReadIndexGrpc(uint8_t node_id,
+                                      paxos_rpc::ReadIndexResponse* response) {
+  std::unique_ptr<paxos_rpc::Acceptor::Stub>& stub = GetAcceptorStub(node_id);
+  grpc::ClientContext context;
+  context.set_deadline(
+      absl::ToChronoTime(absl::Now() +
+                         absl::GetFlag(FLAGS_paxos_node_rpc_deadline)));
+  absl::ReaderMutexLock rl(&lock_);
+  RETURN_IF_NULLPTR(stub);
+  return stub->ReadIndex(&context, paxos_rpc::ReadIndexRequest(), response);
+}
+
+std::optional<uint64_t> PaxosNode::FetchReadIndex() {
+  const uint8_t leader_node_id = GetLeaderNodeId();
+  if (!IsValidNodeId(leader_node_id) || leader_node_id == node_id_) {
+    return std::nullopt;
+  }
+  paxos_rpc::ReadIndexResponse response;
+  grpc::Status status = ReadIndexGrpc(leader_node_id, &response);
+  if (!status.ok()) {
+    LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                 << "] No read index from leader ["
+                 << static_cast<uint32_t>(leader_node_id)
+                 << "]: " << status.error_message();
+    return std::nullopt;
+  }
+  return response.index();
+}
+
 #undef RETURN_IF_NULLPTR
 
 }  // namespace witnesskvs::paxos
@@ -1,14 +1,22 @@
 #ifndef PAXOS_PAXOS_NODE_H_
 #define PAXOS_PAXOS_NODE_H_
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <filesystem>
 #include <memory>
+#include <optional>
 
 #include "absl/base/optimization.h"
 #include "acceptor.h"
+#include "failure_detector.h"
 #include "paxos.grpc.pb.h"
 #include "paxos.pb.h"
+#include "peer_replicator.h"
+#include "quorum_call.h"
 #include "replicated_log.h"
+#include "replication_stream.h"
 #include "util/node.h"
 
 namespace witnesskvs::paxos {
@@ -16,6 +24,16 @@ namespace witnesskvs::paxos {
 class PaxosNode : public std::enable_shared_from_this<PaxosNode> {
  private:
   std::vector<std::unique_ptr<Node>> nodes_;
+  // Accepts and Commits go over these, one per node, unless
+  // --paxos_replication_stream is off. Declared early so that they outlive
+  // the threads that use them.
+  std::vector<std::unique_ptr<ReplicationStream>> replication_streams_;
+  // One per node, fed by the heartbeat thread's pings. Declared early for the
+  // same reason.
+  std::vector<std::unique_ptr<FailureDetector>> failure_detectors_;
+  // One per peer, null for this node, catching peers up on chosen entries.
+  // Declared early for the same reason.
+  std::vector<std::unique_ptr<PeerReplicator>> peer_replicators_;
 
   std::shared_ptr<ReplicatedLog> replicated_log_;
 
@@ -32,32 +50,72 @@ class PaxosNode : public std::enable_shared_from_this<PaxosNode> {
   std::jthread heartbeat_thread_;
   std::jthread truncation_thread_;
 
-  // Sends heartbeat/ping messages to all other nodes in `acceptor_stubs_`.
-  // This thread then goes to sleep for `paxos_node_heartbeat_interval` number
-  // of seconds. If it detects failure/timeout, it removes that stub from the
-  // vector, and next time will attempt to establish a connection hoping the
-  // node is back. If it detects a successful re-connection, reinstate the new
-  // stub in the vector at the index corresponding to the node.
+  // Pings every node in `acceptor_stubs_` at once, each ping bounded by
+  // `paxos_node_ping_deadline`, once every `paxos_node_heartbeat_interval`.
+  // A node whose ping fails outright, or whose pings time out for long enough
+  // that its FailureDetector suspects it, gets its stub removed from the
+  // vector, and next time a connection is attempted hoping the node is back.
+  // If it detects a successful re-connection, reinstate the new stub in the
+  // vector at the index corresponding to the node.
   void HeartbeatThread(std::stop_token st);
   void TruncationLoop(std::stop_token st);
   void Truncate(uint64_t min_index);
-  void CommitAsync(uint8_t node_id, uint64_t idx);
-  std::vector<std::future<void>> commit_futures_;
-
-  // Upon a new leader election, the newly elected leader will perform a NOP
-  // paxos propose operation which will help fill up any holes/gaps in its log.
-  // Till the leader is caught up, it is not ready to serve client requests.
-  // The catchup operation happens in the background so that the leader can
-  // continue to send heartbeats till it is caught up.
-  void ProposeNopAsync(void);
+
+  // Upon a new leader election, the newly elected leader proposes again
+  // everything earlier leaders got accepted and fills the holes/gaps in
+  // between with no-ops, see Proposer::CatchUp(). Till the leader is caught
+  // up, it is not ready to serve client requests. The catchup operation
+  // happens in the background so that the leader can continue to send
+  // heartbeats till it is caught up.
+  void CatchUpAsync(void);
   void PerformLeaderCatchUp(void);
   std::future<void> async_leader_catch_up_;
+  // Only written with lock_ held, so that WaitUntilLeaderCaughtUp() wakes up.
   std::atomic<bool> leader_caught_up_;
+  // The proposal number this node last prepared a quorum with, sent along
+  // with heartbeats while it's the leader.
+  std::atomic<uint64_t> leader_proposal_;
+  // When the leader lease this node holds runs out, as a steady_clock time
+  // since its epoch. Only written with lock_ held, so that
+  // WaitForLeaderLease() wakes up.
+  std::atomic<std::chrono::steady_clock::rep> lease_expiry_;
 
   std::unique_ptr<paxos_rpc::Acceptor::Stub>& GetAcceptorStub(uint8_t node_id)
       ABSL_LOCKS_EXCLUDED(lock_);
+  // Catches node_id up with a snapshot of the application state, or of just
+  // the log's position if it's a witness. Returns its first unchosen index
+  // once installed, nullopt if there's no snapshot to send or it failed.
+  std::optional<uint64_t> InstallSnapshotOn(uint8_t node_id);
+  // Streams the files in dir to node_id in chunks of
+  // --paxos_snapshot_chunk_bytes, as the snapshot as of idx.
+  grpc::Status SendSnapshot(uint8_t node_id, uint64_t idx,
+                            const std::filesystem::path& dir,
+                            paxos_rpc::InstallSnapshotResponse* response);
+  grpc::Status ReadIndexGrpc(uint8_t node_id,
+                             paxos_rpc::ReadIndexResponse* response)
+      ABSL_LOCKS_EXCLUDED(lock_);
   std::size_t acceptor_stubs_size_;
 
+  template <typename Request, typename Response, typename Send>
+  std::shared_ptr<QuorumCall<Response>> SendTo(
+      const Request& request, const std::vector<uint8_t>& node_ids,
+      std::shared_ptr<QuorumCall<Response>> call, Send send)
+      ABSL_LOCKS_EXCLUDED(lock_);
+  // Like SendTo() but over the replication streams, extract takes the
+  // Response out of the stream's response.
+  template <typename Response, typename Extract>
+  std::shared_ptr<QuorumCall<Response>> StreamTo(
+      const paxos_rpc::ReplicationRequest& request,
+      const std::vector<uint8_t>& node_ids,
+      std::shared_ptr<QuorumCall<Response>> call, Extract extract);
+  grpc::Status StreamAndWait(uint8_t node_id,
+                             paxos_rpc::ReplicationRequest request,
+                             paxos_rpc::ReplicationResponse* response);
+  template <typename Request, typename Response, typename Send>
+  std::shared_ptr<QuorumCall<Response>> SendToAll(const Request& request,
+                                                  Send send)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
   // TODO(mmucklo): maybe use a template like this for the boilerplate in grpc
   // functions
   //
@@ -79,7 +137,13 @@ class PaxosNode : public std::enable_shared_from_this<PaxosNode> {
   PaxosNode(uint8_t node_id, std::shared_ptr<ReplicatedLog> rlog);
   ~PaxosNode();
   void MakeReady(void);
+  // Hands commit_idxs[i], node i's first unchosen index, to its
+  // PeerReplicator, which sends it the chosen entries it's missing in the
+  // background. Doesn't block on the peers.
   void CommitOnPeerNodes(const std::vector<uint64_t>& commit_idxs);
+  void SetLeaderProposal(uint64_t proposal_number) {
+    leader_proposal_.store(proposal_number, std::memory_order_relaxed);
+  }
 
   std::size_t GetNumNodes() const { return nodes_.size(); };
   std::string GetNodeAddress(uint8_t node_id) const;
@@ -88,6 +152,18 @@ class PaxosNode : public std::enable_shared_from_this<PaxosNode> {
   bool IsLeaderCaughtUp() const {
     return IsLeader() && this->leader_caught_up_;
   }
+  // Blocks until this node is the leader and caught up, or isn't the leader
+  // anymore. Returns whether it's caught up.
+  bool WaitUntilLeaderCaughtUp() ABSL_LOCKS_EXCLUDED(lock_);
+  // Whether this node is the caught up leader and a quorum of acceptors has
+  // promised, as of now, not to prepare any other node's proposals. Nothing
+  // can then get chosen without this node knowing, so reads can be served
+  // from local state. Doesn't take lock_.
+  bool HasLeaderLease() const;
+  // Blocks until HasLeaderLease(), until this node isn't the leader anymore or
+  // for a couple of heartbeats at most. Returns HasLeaderLease(), or true
+  // if leases are disabled.
+  bool WaitForLeaderLease() ABSL_LOCKS_EXCLUDED(lock_);
   uint8_t GetLeaderNodeId() {
     absl::MutexLock l(&lock_);
     return leader_node_id_;
@@ -96,12 +172,52 @@ class PaxosNode : public std::enable_shared_from_this<PaxosNode> {
   bool IsWitness() const;
   bool ClusterHasEnoughNodesUp();
 
-  grpc::Status PrepareGrpc(uint8_t node_id, paxos_rpc::PrepareRequest request,
-                           paxos_rpc::PrepareResponse* response);
-  grpc::Status AcceptGrpc(uint8_t node_id, paxos_rpc::AcceptRequest request,
-                          paxos_rpc::AcceptResponse* response);
+  // Send the request to every node at once, including this one, each RPC
+  // bounded by --paxos_node_rpc_deadline. Nodes without a connection are
+  // reported as UNAVAILABLE right away.
+  std::shared_ptr<QuorumCall<paxos_rpc::PrepareResponse>> PrepareAll(
+      const paxos_rpc::PrepareRequest& request);
+  std::shared_ptr<QuorumCall<paxos_rpc::PrepareRangeResponse>> PrepareRangeAll(
+      const paxos_rpc::PrepareRangeRequest& request);
+  std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> AcceptAll(
+      const paxos_rpc::AcceptRequest& request);
+  // Sends the request to node_ids only. Their replies go to call, or to a new
+  // QuorumCall if call is null.
+  std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> AcceptOn(
+      const paxos_rpc::AcceptRequest& request,
+      const std::vector<uint8_t>& node_ids,
+      std::shared_ptr<QuorumCall<paxos_rpc::AcceptResponse>> call = nullptr);
+  // Sends a run of Accepts to every node in a single request, applied by each
+  // with a single log write.
+  std::shared_ptr<QuorumCall<paxos_rpc::AcceptBatchResponse>> AcceptBatchAll(
+      const paxos_rpc::AcceptBatchRequest& request);
+  // Asks every full replica, this node included, for the value a witness
+  // reported only the hash of.
+  std::shared_ptr<QuorumCall<paxos_rpc::FetchValueResponse>>
+  FetchValueFromReplicas(const paxos_rpc::FetchValueRequest& request);
+  // Every node ordered by preference for a thrifty round: this node, the
+  // other full replicas closest first and witnesses last. The first quorum of
+  // them are the ones a thrifty round goes to.
+  std::vector<uint8_t> GetPreferredNodes() const;
+  std::size_t GetQuorum() const { return quorum_; }
+  // Estimates of the round-trip time to node_id as measured by pings, see
+  // FailureDetector. Zero until it has answered one.
+  absl::Duration GetRtt(uint8_t node_id) const {
+    return failure_detectors_[node_id]->Rtt();
+  }
+  absl::Duration GetRttTimeout(uint8_t node_id) const {
+    return failure_detectors_[node_id]->RttTimeout();
+  }
+  // Blocks until the Commit is acked.
   grpc::Status CommitGrpc(uint8_t node_id, paxos_rpc::CommitRequest request,
                           paxos_rpc::CommitResponse* response);
+  grpc::Status CommitBatchGrpc(uint8_t node_id,
+                               paxos_rpc::CommitBatchRequest request,
+                               paxos_rpc::CommitBatchResponse* response);
+  // Asks the leader for the index to apply up to before serving a read on
+  // this follower, see ReadIndex. nullopt if there's no leader to ask, this
+  // node is the leader, or the leader couldn't tell, e.g. having no lease.
+  std::optional<uint64_t> FetchReadIndex();
 
   // Runs a single truncation coordination if it's the leader. Exposed
   // as public for manual use during testing, but normally should be called
@@ -0,0 +1,188 @@
+#include "peer_replicator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <stop_token>
+#include <thread>
+#include <utility>
+
+#include "absl/flags/flag.h"
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/strings/cord.h"
+#include "absl/synchronization/mutex.h"
+
+ABSL_FLAG(uint64_t, paxos_replication_batch_max_entries, 256,
+          "Maximum number of entries sent in one AcceptBatch or CommitBatch");
+ABSL_FLAG(uint64_t, paxos_replication_batch_max_bytes, 1 << 20,
+          "Size in bytes of values at which an AcceptBatch or CommitBatch "
+          "stops growing");
+
+ABSL_FLAG(bool, paxos_value_free_commit, true,
+          "Commit entries to peers by the proposal their value was accepted "
+          "with, only sending values to peers that don't hold them");
+
+ABSL_FLAG(uint64_t, paxos_snapshot_catch_up_lag, 1 << 20,
+          "Number of chosen entries a peer has to be missing to be caught up "
+          "with a snapshot of the application state rather than the entries, "
+          "0 only sends snapshots for entries no longer in the log");
+
+namespace witnesskvs::paxos {
+
+PeerReplicator::PeerReplicator(uint8_t node_id, uint8_t peer_node_id,
+                               std::shared_ptr<ReplicatedLog> rlog,
+                               CommitBatchFn commit_batch,
+                               InstallSnapshotFn install_snapshot)
+    : node_id_{node_id},
+      peer_node_id_{peer_node_id},
+      replicated_log_{std::move(rlog)},
+      commit_batch_{std::move(commit_batch)},
+      install_snapshot_{std::move(install_snapshot)},
+      match_idx_{0},
+      pending_{false} {
+  worker_ = std::jthread(std::bind_front(&PeerReplicator::Run, this));
+}
+
+PeerReplicator::~PeerReplicator() { Stop(); }
+
+void PeerReplicator::Stop() {
+  {
+    absl::MutexLock l(&lock_);
+    worker_.get_stop_source().request_stop();
+  }
+  if (worker_.joinable()) {
+    worker_.join();
+  }
+}
+
+void PeerReplicator::Notify(uint64_t first_unchosen_idx) {
+  absl::MutexLock l(&lock_);
+  // What the peer reports wins over what we worked out, e.g. it may have
+  // lost entries in a restart. At worst a stale report has some entries sent
+  // again.
+  match_idx_ = first_unchosen_idx;
+  if (match_idx_ < replicated_log_->GetFirstUnchosenIdx()) {
+    pending_ = true;
+  }
+}
+
+uint64_t PeerReplicator::GetMatchIdx() const {
+  absl::MutexLock l(&lock_);
+  return match_idx_;
+}
+
+void PeerReplicator::Run(std::stop_token stop_token) {
+  while (true) {
+    uint64_t idx;
+    {
+      absl::MutexLock l(&lock_);
+      auto has_work = [this, &stop_token] {
+        lock_.AssertReaderHeld();
+        return pending_ || stop_token.stop_requested();
+      };
+      lock_.Await(absl::Condition(&has_work));
+      if (stop_token.stop_requested()) {
+        break;
+      }
+      pending_ = false;
+      idx = match_idx_;
+    }
+
+    while (!stop_token.stop_requested() &&
+           idx < replicated_log_->GetFirstUnchosenIdx()) {
+      std::optional<uint64_t> next = CatchUp(idx);
+      if (!next.has_value()) {
+        break;
+      }
+      absl::MutexLock l(&lock_);
+      match_idx_ = std::max(match_idx_, *next);
+      idx = match_idx_;
+    }
+  }
+}
+
+std::optional<uint64_t> PeerReplicator::CatchUp(uint64_t idx) {
+  const bool truncated = idx < replicated_log_->GetTruncatedIdx();
+  const uint64_t max_lag = absl::GetFlag(FLAGS_paxos_snapshot_catch_up_lag);
+  const uint64_t lag = replicated_log_->GetFirstUnchosenIdx() - idx;
+  if (truncated || (max_lag > 0 && lag >= max_lag)) {
+    LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_) << "] Node "
+              << static_cast<uint32_t>(peer_node_id_)
+              << " is missing entries from idx: " << idx
+              << (truncated ? " that were truncated" : "")
+              << ", catching it up with a snapshot";
+    std::optional<uint64_t> next = install_snapshot_();
+    if (next.has_value() && *next > idx) {
+      return next;
+    }
+    if (truncated) {
+      return std::nullopt;
+    }
+  }
+
+  std::optional<uint64_t> next = CommitBatch(idx);
+  if (next.has_value()) {
+    CHECK_LT(idx, *next)
+        << "NODE: [" << static_cast<uint32_t>(node_id_)
+        << "] This index was just committed, the response must return an "
+           "index beyond it";
+  }
+  return next;
+}
+
+std::optional<uint64_t> PeerReplicator::CommitBatch(uint64_t idx) {
+  const uint64_t max_entries = std::max<uint64_t>(
+      absl::GetFlag(FLAGS_paxos_replication_batch_max_entries), 1);
+  const uint64_t max_bytes =
+      absl::GetFlag(FLAGS_paxos_replication_batch_max_bytes);
+  const bool value_free = absl::GetFlag(FLAGS_paxos_value_free_commit);
+
+  // As many of the entries the peer is missing as fit in a batch, counting
+  // the values left out too so that resending them fits in one as well.
+  const uint64_t end =
+      std::min(replicated_log_->GetFirstUnchosenIdx(), idx + max_entries);
+  paxos_rpc::CommitBatchRequest commit_request;
+  std::map<uint64_t, absl::Cord> values;
+  uint64_t bytes = 0;
+  for (uint64_t i = idx; i < end && bytes < max_bytes; ++i) {
+    ReplicatedLogEntry entry = replicated_log_->GetLogEntryAtIdx(i);
+    paxos_rpc::CommitRequest* commit = commit_request.add_commits();
+    commit->set_index(i);
+    bytes += entry.accepted_value_.size();
+    if (value_free && entry.accepted_proposal_ != 0) {
+      // The peer most likely accepted the value in phase 2 already.
+      commit->set_accepted_proposal(entry.accepted_proposal_);
+      values.emplace(i, std::move(entry.accepted_value_));
+    } else {
+      commit->set_value(std::move(entry.accepted_value_));
+    }
+  }
+  paxos_rpc::CommitBatchResponse commit_response;
+
+  grpc::Status status =
+      commit_batch_(std::move(commit_request), &commit_response);
+  if (!status.ok()) {
+    return std::nullopt;
+  }
+  if (commit_response.value_needed_size() > 0) {
+    paxos_rpc::CommitBatchRequest value_request;
+    for (uint64_t i : commit_response.value_needed()) {
+      paxos_rpc::CommitRequest* commit = value_request.add_commits();
+      commit->set_index(i);
+      commit->set_value(values[i]);
+    }
+    VLOG(1) << "NODE: [" << static_cast<uint32_t>(node_id_) << "] Node "
+            << static_cast<uint32_t>(peer_node_id_) << " needs the values of "
+            << value_request.commits_size() << " committed entries";
+    status = commit_batch_(std::move(value_request), &commit_response);
+    if (!status.ok()) {
+      return std::nullopt;
+    }
+  }
+  return commit_response.first_unchosen_index();
+}
+
+}  // namespace witnesskvs::paxos
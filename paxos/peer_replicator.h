@@ -0,0 +1,97 @@
+#ifndef PAXOS_PEER_REPLICATOR_H_
+#define PAXOS_PEER_REPLICATOR_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <stop_token>
+#include <thread>
+
+// GRPC headers
+#include <grpcpp/grpcpp.h>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "paxos.pb.h"
+#include "replicated_log.h"
+
+namespace witnesskvs::paxos {
+
+/**
+ * Catches one peer up on the entries chosen on the leader, on a thread of its
+ * own that lives as long as the node does.
+ *
+ * It keeps the peer's match index, the first unchosen index the peer is
+ * known to have, and while that's behind the log commits the entries in
+ * between with CommitBatch, one batch of up to
+ * --paxos_replication_batch_max_entries / _bytes at a time, sending the next
+ * once the peer acked the last. A lagging peer is fed as fast as it takes
+ * entries and no faster, and the proposer only ever hands it the index
+ * the peer reported, without waiting on it.
+ *
+ * A peer that's missing entries the log no longer has, or more than
+ * --paxos_snapshot_catch_up_lag of them, is sent a snapshot of the
+ * application state instead and caught up from the index it was taken at.
+ *
+ * A batch that fails ends the pass, the next Notify(), e.g. with the next
+ * heartbeat, starts another one from the match index.
+ */
+class PeerReplicator {
+ public:
+  // Sends a CommitBatch to the peer and waits for its response.
+  using CommitBatchFn =
+      std::function<grpc::Status(paxos_rpc::CommitBatchRequest,
+                                 paxos_rpc::CommitBatchResponse*)>;
+  // Sends the peer a snapshot and waits for it to be installed. Returns the
+  // peer's first unchosen index after it, nullopt if it failed.
+  using InstallSnapshotFn = std::function<std::optional<uint64_t>()>;
+
+  PeerReplicator(uint8_t node_id, uint8_t peer_node_id,
+                 std::shared_ptr<ReplicatedLog> rlog,
+                 CommitBatchFn commit_batch,
+                 InstallSnapshotFn install_snapshot);
+  ~PeerReplicator();
+
+  // Disable copy (and move) semantics.
+  PeerReplicator(const PeerReplicator&) = delete;
+  PeerReplicator& operator=(const PeerReplicator&) = delete;
+
+  // Tells the worker that the peer has everything below first_unchosen_idx
+  // chosen, and nothing from it on, and to catch it up if that's behind the
+  // log. Doesn't block on the peer.
+  void Notify(uint64_t first_unchosen_idx) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Stops the worker, waiting for the batch in flight if any. Notify() is a
+  // no-op afterwards.
+  void Stop() ABSL_LOCKS_EXCLUDED(lock_);
+
+  uint64_t GetMatchIdx() const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  void Run(std::stop_token stop_token) ABSL_LOCKS_EXCLUDED(lock_);
+  // Commits the batch of entries starting at idx. Returns the peer's first
+  // unchosen index after it, nullopt if it failed.
+  std::optional<uint64_t> CommitBatch(uint64_t idx);
+  // Catches the peer up from idx with a snapshot, or a batch if it isn't
+  // missing truncated entries and no snapshot could be sent. Same return.
+  std::optional<uint64_t> CatchUp(uint64_t idx);
+
+  const uint8_t node_id_;
+  const uint8_t peer_node_id_;
+  const std::shared_ptr<ReplicatedLog> replicated_log_;
+  const CommitBatchFn commit_batch_;
+  const InstallSnapshotFn install_snapshot_;
+
+  mutable absl::Mutex lock_;
+  // Only ever grows, a peer doesn't forget what got chosen.
+  uint64_t match_idx_ ABSL_GUARDED_BY(lock_);
+  // Whether the peer may be behind since the worker last looked.
+  bool pending_ ABSL_GUARDED_BY(lock_);
+
+  std::jthread worker_;
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_PEER_REPLICATOR_H_
@@ -1,53 +1,376 @@
 #include "proposer.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/declare.h"
 #include "absl/flags/flag.h"
 #include "absl/log/check.h"
+#include "absl/time/clock.h"
 
 ABSL_FLAG(bool, disable_multi_paxos, false, "Disable multi-paxos optimization");
+ABSL_FLAG(bool, paxos_thrifty, false,
+          "Send Accepts to the smallest quorum, full replicas before "
+          "witnesses, and to the other nodes only when it doesn't answer in "
+          "time");
+ABSL_FLAG(absl::Duration, paxos_thrifty_fallback_delay, absl::Milliseconds(50),
+          "How long a thrifty Accept waits on its quorum before it is sent to "
+          "the other nodes too");
+ABSL_FLAG(uint64_t, paxos_max_inflight_proposals, 16,
+          "Maximum number of log indexes the leader has Accepts outstanding "
+          "for at once");
+ABSL_FLAG(absl::Duration, paxos_propose_timeout, absl::Seconds(10),
+          "How long a proposal keeps retrying to get its value chosen before "
+          "it gives up");
+
+ABSL_DECLARE_FLAG(uint64_t, paxos_replication_batch_max_entries);
+ABSL_DECLARE_FLAG(uint64_t, paxos_replication_batch_max_bytes);
 
 namespace witnesskvs::paxos {
+namespace {
+
+// How long a Prepare waits before it is retried when a value only a witness
+// reported the hash of couldn't be fetched, e.g. its full replicas are down.
+constexpr absl::Duration kFetchValueRetryDelay = absl::Milliseconds(100);
+// How long a Prepare waits before it is retried when acceptors refused it
+// because another node's leader lease hasn't run out yet.
+constexpr absl::Duration kLeaseRetryDelay = absl::Milliseconds(100);
+// How long an Accept that didn't reach a quorum waits before it is retried,
+// doubling every time up to the max.
+constexpr absl::Duration kNoQuorumRetryDelay = absl::Milliseconds(10);
+constexpr absl::Duration kMaxNoQuorumRetryDelay = absl::Seconds(1);
+
+// Whether some acceptor refused a Prepare because of another node's lease.
+template <typename Reply>
+bool RefusedForLease(const std::vector<Reply>& replies) {
+  return std::any_of(replies.begin(), replies.end(), [](const Reply& reply) {
+    return reply.status.error_code() == grpc::StatusCode::FAILED_PRECONDITION;
+  });
+}
+
+// Returns a predicate over the replies to a Prepare or Accept for
+// proposal_number that holds once they settle the round: a quorum has
+// promised or accepted, or some acceptor has rejected it.
+auto IsSettled(uint64_t proposal_number, size_t majority_threshold) {
+  return [proposal_number, majority_threshold](const auto& replies) {
+    size_t num_ok = 0;
+    for (const auto& reply : replies) {
+      if (!reply.status.ok()) {
+        continue;
+      }
+      if (reply.response.min_proposal() > proposal_number) {
+        return true;
+      }
+      ++num_ok;
+    }
+    return num_ok >= majority_threshold;
+  };
+}
+
+}  // namespace
+
+bool Proposer::Propose(const absl::Cord& value) {
+  if (absl::GetFlag(FLAGS_disable_multi_paxos)) {
+    ProposeSerialized(value);
+    return true;
+  }
+
+  const absl::Time deadline =
+      absl::Now() + absl::GetFlag(FLAGS_paxos_propose_timeout);
+  while (true) {
+    Slot slot;
+    bool nop_round = false;
+    {
+      absl::MutexLock l(&lock_);
+      const uint64_t max_inflight =
+          std::max<uint64_t>(absl::GetFlag(FLAGS_paxos_max_inflight_proposals), 1);
+      auto has_room = [this, max_inflight]() {
+        return inflight_ < max_inflight && !nop_round_;
+      };
+      auto is_idle = [this]() { return inflight_ == 0; };
+      // A NOP round sends its Accepts without expecting them to be counted,
+      // so it must not overlap our own Accepts for the same index.
+      lock_.Await(value.empty() ? absl::Condition(&is_idle)
+                                : absl::Condition(&has_room));
+      slot = AcquireSlotLocked(value);
+      if (value.empty() && slot.value.empty()) {
+        // Nothing was accepted at the first unchosen index, the NOP round is
+        // only there to learn it and to bring the peers up to date. The index
+        // is handed out again once it's done.
+        next_index_ = slot.index;
+        nop_round_ = nop_round = true;
+      }
+    }
+    if (nop_round) {
+      // Waits on every peer, so it goes out without lock_ held.
+      size_t rejected_by;
+      AcceptPhase(slot.index, slot.proposal_number, slot.value,
+                  /*nop_paxos_round=*/true, &rejected_by);
+      absl::MutexLock l(&lock_);
+      --inflight_;
+      nop_round_ = false;
+      return true;
+    }
+    switch (ProposeSlot(std::move(slot), value, deadline)) {
+      case SlotResult::kChosen:
+        return true;
+      case SlotResult::kGaveUp:
+        return false;
+      case SlotResult::kTaken:
+        // Try again at another index.
+        break;
+    }
+  }
+}
 
-void Proposer::Propose(const std::string& value) {
+Proposer::Slot Proposer::AcquireSlotLocked(const absl::Cord& value) {
+  lock_.AssertHeld();
+  PrepareIfNeededLocked();
+  const uint64_t first_unchosen = this->replicated_log_->GetFirstUnchosenIdx();
+  if (inflight_ == 0) {
+    // Everything we handed out before is chosen or abandoned, start over from
+    // the log so a stale index from an earlier term cannot leave a hole.
+    next_index_ = first_unchosen;
+    abandoned_.clear();
+  }
+  abandoned_.erase(abandoned_.begin(), abandoned_.lower_bound(first_unchosen));
+  Slot slot;
+  if (!abandoned_.empty()) {
+    // Later indexes can't be acknowledged until this one is chosen.
+    slot.index = *abandoned_.begin();
+    abandoned_.erase(abandoned_.begin());
+  } else {
+    slot.index = std::max(next_index_, first_unchosen);
+    next_index_ = slot.index + 1;
+  }
+  slot.proposal_number = proposal_number_;
+  ++inflight_;
+
+  recovered_values_.erase(recovered_values_.begin(),
+                          recovered_values_.lower_bound(first_unchosen));
+  auto it = recovered_values_.find(slot.index);
+  // Copying a Cord only takes a reference to its buffer.
+  slot.value = it != recovered_values_.end() ? it->second : value;
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] Attempting replication at index " << slot.index
+            << " with proposal number: " << slot.proposal_number << " ("
+            << inflight_ << " in flight)";
+  return slot;
+}
+
+void Proposer::PrepareIfNeededLocked() {
+  lock_.AssertHeld();
+  if (proposal_number_ != 0 && !DoPreparePhase()) {
+    return;
+  }
+  // A single range Prepare covers this index and all the following ones
+  // until an acceptor rejects us.
+  PrepareRangePhase(this->replicated_log_->GetFirstUnchosenIdx());
+}
+
+Proposer::SlotResult Proposer::ProposeSlot(Slot slot, const absl::Cord& value,
+                                           absl::Time deadline) {
+  absl::Duration retry_delay = kNoQuorumRetryDelay;
+  while (true) {
+    size_t rejected_by = 0;
+    const AcceptResult result =
+        AcceptPhase(slot.index, slot.proposal_number, slot.value,
+                    /*nop_paxos_round=*/false, &rejected_by);
+    if (result == AcceptResult::kChosen) {
+      {
+        absl::MutexLock l(&lock_);
+        --inflight_;
+      }
+      // Reads see what's below the first unchosen index, so the slot is only
+      // acknowledged once the ones before it are chosen too.
+      if (!this->replicated_log_->WaitUntilChosen(slot.index,
+                                                  deadline - absl::Now())) {
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] Gave up waiting on the indexes before "
+                     << slot.index << " to be chosen";
+        return SlotResult::kGaveUp;
+      }
+      return slot.value == value ? SlotResult::kChosen : SlotResult::kTaken;
+    }
+
+    absl::Duration backoff = absl::ZeroDuration();
+    {
+      absl::MutexLock l(&lock_);
+      if (slot.index < this->replicated_log_->GetFirstUnchosenIdx()) {
+        // Some other proposer got a value chosen here first.
+        --inflight_;
+        return this->replicated_log_->GetLogEntryAtIdx(slot.index)
+                           .accepted_value_ == value
+                   ? SlotResult::kChosen
+                   : SlotResult::kTaken;
+      }
+      if (result == AcceptResult::kRejected) {
+        is_prepare_needed_[rejected_by] = true;
+      } else if (absl::Now() >= deadline ||
+                 !this->paxos_node_->ClusterHasEnoughNodesUp()) {
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] Giving up on index " << slot.index
+                     << ", no quorum accepted it";
+        // Some acceptors may have accepted the value, whoever gets the index
+        // next proposes it again.
+        --inflight_;
+        abandoned_.insert(slot.index);
+        recovered_values_.try_emplace(slot.index, slot.value);
+        return SlotResult::kGaveUp;
+      } else {
+        // Peers that didn't answer in time aren't asked again right away.
+        backoff = std::min(retry_delay, deadline - absl::Now());
+        retry_delay = std::min(retry_delay * 2, kMaxNoQuorumRetryDelay);
+      }
+      // Retry the same index, other proposals keep going behind it. Whatever
+      // a new Prepare recovered for the index takes precedence over our value.
+      PrepareIfNeededLocked();
+      slot.proposal_number = proposal_number_;
+      auto it = recovered_values_.find(slot.index);
+      if (it != recovered_values_.end()) {
+        slot.value = it->second;
+      }
+    }
+    absl::SleepFor(backoff);
+  }
+}
+
+void Proposer::CatchUp() {
+  std::vector<Slot> slots;
+  {
+    absl::MutexLock l(&lock_);
+    auto is_idle = [this]() { return inflight_ == 0; };
+    lock_.Await(absl::Condition(&is_idle));
+    // Whatever was abandoned is covered below.
+    abandoned_.clear();
+    const uint64_t first_unchosen =
+        this->replicated_log_->GetFirstUnchosenIdx();
+    PrepareRangePhase(first_unchosen);
+    // Whatever a quorum accepted has to be chosen again before any new value
+    // goes in, the holes in between get no-ops.
+    const uint64_t end = recovered_values_.empty()
+                             ? first_unchosen
+                             : recovered_values_.rbegin()->first + 1;
+    size_t num_holes = 0;
+    for (uint64_t idx = first_unchosen; idx < end; ++idx) {
+      // Holes have no entry at all.
+      std::optional<ReplicatedLogEntry> entry =
+          this->replicated_log_->FindLogEntryAtIdx(idx);
+      if (entry.has_value() && entry->is_chosen_) {
+        continue;
+      }
+      Slot slot;
+      slot.index = idx;
+      slot.proposal_number = proposal_number_;
+      auto it = recovered_values_.find(idx);
+      if (it != recovered_values_.end()) {
+        slot.value = it->second;
+      } else {
+        ++num_holes;
+      }
+      slots.push_back(std::move(slot));
+    }
+    inflight_ += slots.size();
+    next_index_ = end;
+    LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+              << "] Catching up on indexes [" << first_unchosen << ", " << end
+              << "): " << slots.size() << " to propose again, " << num_holes
+              << " of them holes";
+  }
+
+  // Most of them get chosen by a few AcceptBatch round trips, the others are
+  // driven to be chosen one at a time, a window's worth at once.
+  const std::vector<bool> chosen = AcceptBatchPhase(slots);
+  {
+    absl::MutexLock l(&lock_);
+    size_t num_left = 0;
+    for (size_t k = 0; k < slots.size(); ++k) {
+      if (chosen[k]) {
+        --inflight_;
+      } else {
+        slots[num_left++] = std::move(slots[k]);
+      }
+    }
+    LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_) << "] "
+              << slots.size() - num_left << " chosen in batches, " << num_left
+              << " left";
+    slots.resize(num_left);
+  }
+  // Those given up on are left for the proposals that come next.
+  const absl::Time deadline =
+      absl::Now() + absl::GetFlag(FLAGS_paxos_propose_timeout);
+  std::atomic<size_t> next_slot = 0;
+  const size_t num_workers = std::min<size_t>(
+      slots.size(), absl::GetFlag(FLAGS_paxos_max_inflight_proposals));
+  std::vector<std::jthread> workers;
+  for (size_t i = 0; i < num_workers; ++i) {
+    workers.emplace_back([this, &slots, &next_slot, deadline]() {
+      for (size_t k = next_slot++; k < slots.size(); k = next_slot++) {
+        ProposeSlot(slots[k], slots[k].value, deadline);
+      }
+    });
+  }
+}
+
+void Proposer::ProposeSerialized(const absl::Cord& value) {
   absl::MutexLock l(&lock_);
 
-  bool is_nop = value.empty();
   bool done = false;
   while (!done) {
-    std::string value_for_accept_phase = value;
+    // Copying a Cord only takes a reference to its buffer.
+    absl::Cord value_for_accept_phase = value;
     paxos_rpc::PrepareRequest request;
     request.set_index(this->replicated_log_->GetFirstUnchosenIdx());
     request.set_proposal_number(proposal_number_);
     LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
               << "] Attempting replication at index " << request.index()
               << " with proposal number: " << proposal_number_;
-    if (proposal_number_ == 0 || DoPreparePhase() ||
-        absl::GetFlag(FLAGS_disable_multi_paxos)) {
-      PreparePhase(request, value_for_accept_phase);
-    }
+    PreparePhase(request, value_for_accept_phase);
 
-    const bool nop_paxos_round = (is_nop and (value == value_for_accept_phase));
-    done = AcceptPhase(request, value_for_accept_phase, nop_paxos_round, value);
+    const bool nop_paxos_round =
+        (value.empty() and (value == value_for_accept_phase));
+    size_t rejected_by = 0;
+    const AcceptResult result =
+        AcceptPhase(request.index(), request.proposal_number(),
+                    value_for_accept_phase, nop_paxos_round, &rejected_by);
+    if (result == AcceptResult::kRejected) {
+      is_prepare_needed_[rejected_by] = true;
+    }
+    done = result == AcceptResult::kChosen && value == value_for_accept_phase;
   }
 }
 
 void Proposer::PreparePhase(paxos_rpc::PrepareRequest& request,
-                            std::string& value_for_accept_phase) {
+                            absl::Cord& value_for_accept_phase) {
   // Perform phase 1 of the paxos operation i.e. find a proposal that will be
   // accepted by a quorum of acceptors.
   uint32_t num_promises = 0;
-  proposal_number_ = this->replicated_log_->GetNextProposalNumber();
-  request.set_proposal_number(proposal_number_);
   do {
+    proposal_number_ = this->replicated_log_->GetNextProposalNumber();
+    request.set_proposal_number(proposal_number_);
+    num_promises = 0;
     uint64_t max_proposal_id = 0;
-    for (size_t i = 0; i < this->paxos_node_->GetNumNodes(); i++) {
-      paxos_rpc::PrepareResponse response;
-      grpc::Status status = this->paxos_node_->PrepareGrpc(
-          static_cast<uint8_t>(i), request, &response);
-      if (!status.ok()) {
+    // Set while the highest accepted proposal came from a witness that only
+    // has the hash of the value.
+    std::string value_hash;
+    auto replies =
+        this->paxos_node_->PrepareAll(request)->WaitUntil(IsSettled(
+            request.proposal_number(), majority_threshold_));
+    for (const auto& reply : replies) {
+      const size_t i = reply.node_id;
+      const paxos_rpc::PrepareResponse& response = reply.response;
+      if (!reply.status.ok()) {
         LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
                      << "] Prepare grpc failed for node: " << i
-                     << " with error code: " << status.error_code()
-                     << " and error message: " << status.error_message();
+                     << " with error code: " << reply.status.error_code()
+                     << " and error message: " << reply.status.error_message();
         continue;
       }
       if (response.max_idx_in_log() > request.index()) {
@@ -71,53 +394,333 @@ void Proposer::PreparePhase(paxos_rpc::PrepareRequest& request,
       if (response.has_accepted_value()) {
         if (max_proposal_id < response.accepted_proposal()) {
           max_proposal_id = response.accepted_proposal();
+          value_hash = response.accepted_value_hash();
+          if (value_hash.empty()) {
+            value_for_accept_phase = response.accepted_value();
+            LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                      << "] Current index already has value: "
+                      << value_for_accept_phase;
+          }
+        } else if (max_proposal_id == response.accepted_proposal() &&
+                   !value_hash.empty() &&
+                   response.accepted_value_hash().empty()) {
+          // Same proposal so same value, from a replica that has it.
+          value_hash.clear();
           value_for_accept_phase = response.accepted_value();
-          LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
-                    << "] Current index already has value: "
-                    << value_for_accept_phase;
         }
       }
       ++num_promises;
     }
+    if (num_promises >= majority_threshold_ && !value_hash.empty()) {
+      std::map<uint64_t, absl::Cord> values;
+      if (FetchValues({{request.index(), value_hash}}, &values)) {
+        value_for_accept_phase = values[request.index()];
+      } else {
+        num_promises = 0;
+        absl::SleepFor(kFetchValueRetryDelay);
+      }
+    }
+    if (num_promises < majority_threshold_ && RefusedForLease(replies)) {
+      absl::SleepFor(kLeaseRetryDelay);
+    }
   } while (num_promises < majority_threshold_);
+  this->paxos_node_->SetLeaderProposal(proposal_number_);
+}
+
+void Proposer::PrepareRangePhase(uint64_t index) {
+  paxos_rpc::PrepareRangeRequest request;
+  request.set_index(index);
+  // Highest proposal each recovered value was accepted with, chosen values
+  // win over any other.
+  std::map<uint64_t, uint64_t> recovered_proposals;
+  // Recovered values only a witness reported, by their hash.
+  std::map<uint64_t, std::string> recovered_hashes;
+  uint32_t num_promises = 0;
+  do {
+    proposal_number_ = this->replicated_log_->GetNextProposalNumber();
+    request.set_proposal_number(proposal_number_);
+    recovered_values_.clear();
+    recovered_proposals.clear();
+    recovered_hashes.clear();
+    num_promises = 0;
+    auto replies =
+        this->paxos_node_->PrepareRangeAll(request)->WaitUntil(IsSettled(
+            request.proposal_number(), majority_threshold_));
+    for (const auto& reply : replies) {
+      const size_t i = reply.node_id;
+      const paxos_rpc::PrepareRangeResponse& response = reply.response;
+      if (!reply.status.ok()) {
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] PrepareRange grpc failed for node: " << i
+                     << " with error code: " << reply.status.error_code()
+                     << " and error message: " << reply.status.error_message();
+        continue;
+      }
+      if (response.min_proposal() > request.proposal_number()) {
+        this->replicated_log_->UpdateProposalNumber(response.min_proposal());
+        num_promises = 0;
+        LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                  << "] Saw a proposal number larger than what we sent, "
+                     "retry range Prepare with a bigger proposal.";
+        break;
+      }
+      for (const paxos_rpc::AcceptedEntry& accepted : response.accepted()) {
+        const uint64_t proposal = accepted.is_chosen()
+                                      ? std::numeric_limits<uint64_t>::max()
+                                      : accepted.accepted_proposal();
+        auto [it, inserted] =
+            recovered_proposals.try_emplace(accepted.index(), proposal);
+        if (inserted || proposal > it->second) {
+          it->second = proposal;
+          recovered_values_[accepted.index()] = accepted.value();
+          if (accepted.value_hash().empty()) {
+            recovered_hashes.erase(accepted.index());
+          } else {
+            recovered_hashes[accepted.index()] = accepted.value_hash();
+          }
+        } else if (proposal == it->second &&
+                   accepted.value_hash().empty() &&
+                   recovered_hashes.erase(accepted.index()) > 0) {
+          // Same proposal so same value, from a replica that has it.
+          recovered_values_[accepted.index()] = accepted.value();
+        }
+      }
+      is_prepare_needed_[i] = false;
+      ++num_promises;
+    }
+    if (num_promises >= majority_threshold_ && !recovered_hashes.empty() &&
+        !FetchValues(recovered_hashes, &recovered_values_)) {
+      num_promises = 0;
+      absl::SleepFor(kFetchValueRetryDelay);
+    }
+    if (num_promises < majority_threshold_ && RefusedForLease(replies)) {
+      absl::SleepFor(kLeaseRetryDelay);
+    }
+  } while (num_promises < majority_threshold_);
+  this->paxos_node_->SetLeaderProposal(proposal_number_);
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] Prepared from index: " << index
+            << " with proposal number: " << proposal_number_ << ", recovered "
+            << recovered_values_.size() << " accepted values";
+}
+
+bool Proposer::FetchValues(const std::map<uint64_t, std::string>& hashes,
+                           std::map<uint64_t, absl::Cord>* values) {
+  // Fetch them all at once, each from whichever full replica answers first.
+  std::vector<std::shared_ptr<QuorumCall<paxos_rpc::FetchValueResponse>>>
+      calls;
+  for (const auto& [index, value_hash] : hashes) {
+    paxos_rpc::FetchValueRequest request;
+    request.set_index(index);
+    request.set_value_hash(value_hash);
+    calls.push_back(this->paxos_node_->FetchValueFromReplicas(request));
+  }
+  auto is_found = [](const auto& reply) {
+    return reply.status.ok() && reply.response.found();
+  };
+  auto call = calls.begin();
+  for (const auto& [index, value_hash] : hashes) {
+    auto replies = (*call++)->WaitUntil([&is_found](const auto& replies) {
+      return std::any_of(replies.begin(), replies.end(), is_found);
+    });
+    auto reply = std::find_if(replies.begin(), replies.end(), is_found);
+    if (reply == replies.end()) {
+      LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                   << "] No full replica has the value a witness accepted at "
+                      "index: "
+                   << index << ", retrying";
+      return false;
+    }
+    (*values)[index] = reply->response.value();
+  }
+  return true;
+}
+
+std::vector<bool> Proposer::AcceptBatchPhase(const std::vector<Slot>& slots) {
+  const uint64_t max_entries = std::max<uint64_t>(
+      absl::GetFlag(FLAGS_paxos_replication_batch_max_entries), 1);
+  const uint64_t max_bytes =
+      absl::GetFlag(FLAGS_paxos_replication_batch_max_bytes);
+  std::vector<bool> chosen(slots.size(), false);
+  size_t begin = 0;
+  while (begin < slots.size()) {
+    paxos_rpc::AcceptBatchRequest request;
+    const uint64_t first_unchosen =
+        this->replicated_log_->GetFirstUnchosenIdx();
+    uint64_t bytes = 0;
+    size_t end = begin;
+    for (; end < slots.size() && end - begin < max_entries && bytes < max_bytes;
+         ++end) {
+      const Slot& slot = slots[end];
+      paxos_rpc::AcceptRequest* accept = request.add_accepts();
+      accept->set_index(slot.index);
+      accept->set_proposal_number(slot.proposal_number);
+      accept->set_value(slot.value);
+      accept->set_no_op(slot.value.empty());
+      accept->set_first_unchosen_index(first_unchosen);
+      bytes += slot.value.size();
+    }
+
+    const size_t num_entries = end - begin;
+    auto is_complete = [num_entries](const auto& reply) {
+      return reply.status.ok() &&
+             static_cast<size_t>(reply.response.accepts_size()) == num_entries;
+    };
+    auto replies =
+        this->paxos_node_->AcceptBatchAll(request)->WaitUntil(
+            [this, &is_complete, &request](const auto& replies) {
+              size_t num_ok = 0;
+              for (const auto& reply : replies) {
+                if (!is_complete(reply)) {
+                  continue;
+                }
+                for (int k = 0; k < reply.response.accepts_size(); ++k) {
+                  if (reply.response.accepts(k).min_proposal() >
+                      request.accepts(k).proposal_number()) {
+                    return true;
+                  }
+                }
+                ++num_ok;
+              }
+              return num_ok >= majority_threshold_;
+            });
+
+    std::vector<uint32_t> num_accepted(num_entries, 0);
+    bool rejected = false;
+    for (const auto& reply : replies) {
+      if (!is_complete(reply)) {
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] AcceptBatch failed for node: "
+                     << static_cast<uint32_t>(reply.node_id)
+                     << " with error code: " << reply.status.error_code()
+                     << " and error message: " << reply.status.error_message();
+        continue;
+      }
+      for (size_t k = 0; k < num_entries; ++k) {
+        const uint64_t min_proposal = reply.response.accepts(k).min_proposal();
+        if (min_proposal > request.accepts(k).proposal_number()) {
+          this->replicated_log_->UpdateProposalNumber(min_proposal);
+          absl::MutexLock l(&lock_);
+          is_prepare_needed_[reply.node_id] = true;
+          rejected = true;
+        } else {
+          ++num_accepted[k];
+        }
+      }
+    }
+    // What we proposed is what got chosen, whether or not our own acceptor
+    // has it yet. Runs of the same proposal take a single log write.
+    std::vector<std::pair<uint64_t, absl::Cord>> chosen_entries;
+    uint64_t chosen_proposal = 0;
+    for (size_t k = 0; k < num_entries; ++k) {
+      if (num_accepted[k] < majority_threshold_) {
+        continue;
+      }
+      const Slot& slot = slots[begin + k];
+      if (slot.proposal_number != chosen_proposal && !chosen_entries.empty()) {
+        this->replicated_log_->SetLogEntriesAtIdx(std::move(chosen_entries),
+                                                  chosen_proposal);
+        chosen_entries.clear();
+      }
+      chosen_proposal = slot.proposal_number;
+      chosen_entries.emplace_back(slot.index, slot.value);
+      chosen[begin + k] = true;
+    }
+    if (!chosen_entries.empty()) {
+      this->replicated_log_->SetLogEntriesAtIdx(std::move(chosen_entries),
+                                                chosen_proposal);
+    }
+    if (rejected) {
+      // The rest need a new Prepare, which ProposeSlot() takes care of.
+      break;
+    }
+    begin = end;
+  }
+  return chosen;
 }
 
-bool Proposer::AcceptPhase(paxos_rpc::PrepareRequest& request,
-                           const std::string& value_for_accept_phase,
-                           bool nop_paxos_round, const std::string& value) {
+Proposer::AcceptResult Proposer::AcceptPhase(
+    uint64_t index, uint64_t proposal_number,
+    const absl::Cord& value_for_accept_phase, bool nop_paxos_round,
+    size_t* rejected_by) {
   // Perform phase 2 of paxos operation i.e. try to get the value we
   // determined in phase 1 to be accepted by a quorum of acceptors.
-  bool done = false;
   paxos_rpc::AcceptRequest accept_request;
-  accept_request.set_proposal_number(request.proposal_number());
-  accept_request.set_index(request.index());
+  accept_request.set_proposal_number(proposal_number);
+  accept_request.set_index(index);
   accept_request.set_value(value_for_accept_phase);
-  paxos_rpc::AcceptResponse accept_response;
+  accept_request.set_no_op(value_for_accept_phase.empty() && !nop_paxos_round);
+  // Acceptors learn what got chosen from this, rather than from a Commit per
+  // entry.
+  accept_request.set_first_unchosen_index(
+      this->replicated_log_->GetFirstUnchosenIdx());
   uint32_t accept_majority_count = 0;
-  std::vector<uint64_t> peer_unchosen_idx(this->paxos_node_->GetNumNodes());
+  // Peers we have not heard from yet, or that are caught up up to what the
+  // request told them, are left alone by CommitOnPeerNodes.
+  std::vector<uint64_t> peer_unchosen_idx(this->paxos_node_->GetNumNodes(),
+                                          std::numeric_limits<uint64_t>::max());
 
-  for (size_t i = 0; i < this->paxos_node_->GetNumNodes(); i++) {
-    grpc::Status status = this->paxos_node_->AcceptGrpc(
-        static_cast<uint8_t>(i), accept_request, &accept_response);
-    if (!status.ok()) {
+  const auto settled = IsSettled(proposal_number, majority_threshold_);
+  std::vector<QuorumCall<paxos_rpc::AcceptResponse>::Reply> replies;
+  if (nop_paxos_round) {
+    // A NOP round doesn't count accepts, it waits to hear from every peer so
+    // all of them get brought up to date.
+    replies = this->paxos_node_->AcceptAll(accept_request)->WaitAll();
+  } else if (absl::GetFlag(FLAGS_paxos_thrifty)) {
+    // Witnesses only hear about the value if a full replica fails to accept
+    // it in time.
+    std::vector<uint8_t> nodes = this->paxos_node_->GetPreferredNodes();
+    const size_t quorum =
+        std::min<size_t>(nodes.size(), this->paxos_node_->GetQuorum());
+    // Peers that pings show to be far away get as long as a round trip to
+    // them takes.
+    absl::Duration fallback_delay =
+        absl::GetFlag(FLAGS_paxos_thrifty_fallback_delay);
+    for (size_t k = 0; k < quorum; ++k) {
+      fallback_delay =
+          std::max(fallback_delay, this->paxos_node_->GetRttTimeout(nodes[k]));
+    }
+    auto call = this->paxos_node_->AcceptOn(
+        accept_request,
+        std::vector<uint8_t>(nodes.begin(), nodes.begin() + quorum));
+    replies = call->WaitUntil(settled, fallback_delay);
+    if (!settled(replies) && quorum < nodes.size()) {
+      VLOG(1) << "NODE: [" << static_cast<uint32_t>(node_id_)
+              << "] Thrifty Accept at index: " << index
+              << " falls back to all nodes";
+      this->paxos_node_->AcceptOn(
+          accept_request,
+          std::vector<uint8_t>(nodes.begin() + quorum, nodes.end()), call);
+      replies = call->WaitUntil(settled);
+    }
+  } else {
+    replies = this->paxos_node_->AcceptAll(accept_request)->WaitUntil(settled);
+  }
+  for (const auto& reply : replies) {
+    const size_t i = reply.node_id;
+    const paxos_rpc::AcceptResponse& accept_response = reply.response;
+    if (!reply.status.ok()) {
       LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
                    << "] Accept grpc failed for node: " << i
-                   << " with error code: " << status.error_code()
-                   << " and error message: " << status.error_message();
+                   << " with error code: " << reply.status.error_code()
+                   << " and error message: " << reply.status.error_message();
       continue;
     }
 
-    peer_unchosen_idx[i] = accept_response.first_unchosen_index();
+    if (accept_response.first_unchosen_index() <
+        accept_request.first_unchosen_index()) {
+      // A gap the acceptor couldn't fill from accept_request.
+      peer_unchosen_idx[i] = accept_response.first_unchosen_index();
+    }
     if (nop_paxos_round) {
       continue;
     }
 
-    if (accept_response.min_proposal() > request.proposal_number()) {
+    if (accept_response.min_proposal() > proposal_number) {
       this->replicated_log_->UpdateProposalNumber(
           accept_response.min_proposal());
-      accept_majority_count = 0;
-      is_prepare_needed_[i] = true;
-      return false;
+      *rejected_by = i;
+      return AcceptResult::kRejected;
     }
     ++accept_majority_count;
     LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
@@ -126,31 +729,25 @@ bool Proposer::AcceptPhase(paxos_rpc::PrepareRequest& request,
               << " and accepted value: " << value_for_accept_phase;
   }
 
-  // Since a quorum of acceptors responded with an accept for this value,
-  // we can mark this entry as chosen.
-  if (accept_majority_count >= majority_threshold_) {
-    CHECK(!nop_paxos_round)
-        << "NODE: [" << static_cast<uint32_t>(node_id_)
-        << "] NOP round of paxos should never make log commits.";
-
-    this->replicated_log_->MarkLogEntryChosen(request.index());
-    LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
-              << "] Accepted Proposal number: "
-              << accept_response.min_proposal()
-              << ", accepted value: " << value_for_accept_phase
-              << ", at index: " << request.index() << "\n";
-
-    if (value == value_for_accept_phase) {
-      done = true;
-      VLOG(1) << "NODE: [" << static_cast<uint32_t>(node_id_)
-              << "] Got the value of interest committed: " << value;
-    }
+  if (nop_paxos_round) {
+    this->paxos_node_->CommitOnPeerNodes(peer_unchosen_idx);
+    return AcceptResult::kChosen;
   }
 
-  if (done || nop_paxos_round) {
-    done = true;
-    this->paxos_node_->CommitOnPeerNodes(peer_unchosen_idx);
+  // Since a quorum of acceptors responded with an accept for this value,
+  // we can mark this entry as chosen.
+  if (accept_majority_count < majority_threshold_) {
+    return AcceptResult::kNoQuorum;
   }
-  return done;
+  // Our own Accept may not have landed yet, what got chosen is what we
+  // proposed rather than whatever our acceptor holds.
+  this->replicated_log_->SetLogEntryAtIdx(index, value_for_accept_phase,
+                                          proposal_number);
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] Accepted Proposal number: " << proposal_number
+            << ", accepted value: " << value_for_accept_phase
+            << ", at index: " << index << "\n";
+  this->paxos_node_->CommitOnPeerNodes(peer_unchosen_idx);
+  return AcceptResult::kChosen;
 }
 }  // namespace witnesskvs::paxos
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include <grpc/grpc.h>
 #include <grpcpp/server_builder.h>
 
+#include <set>
+
 #include "paxos_node.h"
 
 namespace witnesskvs::paxos {
@@ -20,10 +22,46 @@ class Proposer {
   int majority_threshold_;
 
   absl::Mutex lock_;
+  // Next log index handed out to a proposal and the number of proposals
+  // whose Accepts are still outstanding.
+  uint64_t next_index_ ABSL_GUARDED_BY(lock_);
+  uint64_t inflight_ ABSL_GUARDED_BY(lock_);
+  // Set while a NOP round, counted in inflight_, is under way. No slot is
+  // handed out meanwhile.
+  bool nop_round_ ABSL_GUARDED_BY(lock_);
+  // Indexes below next_index_ whose proposals gave up before they were
+  // chosen, handed out again before any new one.
+  std::set<uint64_t> abandoned_ ABSL_GUARDED_BY(lock_);
 
   std::shared_ptr<ReplicatedLog> replicated_log_;
   std::shared_ptr<PaxosNode> paxos_node_;
   std::vector<bool> is_prepare_needed_;
+  // Values a quorum reported as accepted in the last range Prepare, or that
+  // an abandoned proposal may have got accepted, which must be proposed again
+  // for their index before anything else.
+  std::map<uint64_t, absl::Cord> recovered_values_;
+
+ private:
+  struct Slot {
+    uint64_t index;
+    uint64_t proposal_number;
+    absl::Cord value;
+  };
+  Slot AcquireSlotLocked(const absl::Cord& value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void PrepareIfNeededLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  enum class SlotResult { kChosen, kTaken, kGaveUp };
+  // Drives slot until it is chosen, and every index before it too. Returns
+  // kChosen if it was chosen with value and kTaken if with another one. Gives
+  // up, returning kGaveUp, once deadline passes or quorum is lost.
+  SlotResult ProposeSlot(Slot slot, const absl::Cord& value,
+                         absl::Time deadline) ABSL_LOCKS_EXCLUDED(lock_);
+  // The single index at a time path used when multi-paxos is disabled.
+  void ProposeSerialized(const absl::Cord& value) ABSL_LOCKS_EXCLUDED(lock_);
+  // Phase 2 for every slot at once, in AcceptBatch requests. Returns which of
+  // them got chosen, the others are left for ProposeSlot().
+  std::vector<bool> AcceptBatchPhase(const std::vector<Slot>& slots)
+      ABSL_LOCKS_EXCLUDED(lock_);
 
  public:
   Proposer(int num_acceptors, uint8_t nodeId,
@@ -32,17 +70,44 @@ class Proposer {
       : majority_threshold_{num_acceptors / 2 + 1},
         node_id_{nodeId},
         proposal_number_{0},
+        next_index_{0},
+        inflight_{0},
+        nop_round_{false},
         replicated_log_{rlog},
         paxos_node_{paxos_node},
         is_prepare_needed_(num_acceptors, false) {}
   ~Proposer() = default;
 
-  void Propose(const std::string& value);
+  // Proposals from concurrent callers are pipelined: each gets its own log
+  // index and up to `paxos_max_inflight_proposals` of them wait on their
+  // Accepts at once. They get chosen in any order, but a proposal only
+  // returns once every index up to its own is chosen, so that a read, which
+  // sees what's below the first unchosen index, sees every write acknowledged
+  // before it. Returns false if it gave up after `paxos_propose_timeout`, in
+  // which case value may still get chosen later.
+  bool Propose(const absl::Cord& value);
+  // Run by a new leader before it takes proposals. A single range Prepare
+  // recovers what earlier leaders got accepted, which is then proposed again
+  // along with no-ops for the holes in between, all in parallel.
+  void CatchUp() ABSL_LOCKS_EXCLUDED(lock_);
   void PreparePhase(paxos_rpc::PrepareRequest& request,
-                    std::string& value_for_accept_phase);
-  bool AcceptPhase(paxos_rpc::PrepareRequest& request,
-                   const std::string& value_for_accept_phase,
-                   bool is_nop_paxos_round, const std::string& value);
+                    absl::Cord& value_for_accept_phase);
+  // Phase 1 for index and every index after it at once, filling
+  // recovered_values_.
+  void PrepareRangePhase(uint64_t index);
+
+  // Fetches the values with the given hashes, by index, from the full
+  // replicas into values. Returns false if one of them couldn't be found.
+  bool FetchValues(const std::map<uint64_t, std::string>& hashes,
+                   std::map<uint64_t, absl::Cord>* values);
+
+  enum class AcceptResult { kChosen, kRejected, kNoQuorum };
+  // Phase 2 for a single index. A NOP round reports kChosen once the Accepts
+  // went out. On kRejected, `rejected_by` is the acceptor that holds a
+  // higher proposal.
+  AcceptResult AcceptPhase(uint64_t index, uint64_t proposal_number,
+                           const absl::Cord& value_for_accept_phase,
+                           bool nop_paxos_round, size_t* rejected_by);
   bool DoPreparePhase() {
     return std::any_of(is_prepare_needed_.begin(), is_prepare_needed_.end(),
                        [](bool v) { return v; });
@@ -0,0 +1,84 @@
+#ifndef PAXOS_QUORUM_CALL_H_
+#define PAXOS_QUORUM_CALL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// GRPC headers
+#include <grpcpp/support/status.h>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+
+namespace witnesskvs::paxos {
+
+/**
+ * Collects the replies to one request sent to several acceptors at once.
+ *
+ * Every outstanding RPC holds a reference to its QuorumCall, so a proposer can
+ * go ahead as soon as it has heard from enough acceptors and leave the
+ * stragglers to complete in the background.
+ */
+template <typename Response>
+class QuorumCall {
+ public:
+  struct Reply {
+    uint8_t node_id;
+    grpc::Status status;
+    Response response;
+  };
+
+  explicit QuorumCall(size_t num_calls) : outstanding_{num_calls} {}
+
+  // Disable copy (and move) semantics.
+  QuorumCall(const QuorumCall&) = delete;
+  QuorumCall& operator=(const QuorumCall&) = delete;
+
+  // Accounts for num_calls more RPCs, made after construction.
+  void Expect(size_t num_calls) ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::MutexLock l(&lock_);
+    outstanding_ += num_calls;
+  }
+
+  // Records the outcome of the RPC to node_id, once per RPC.
+  void Add(uint8_t node_id, grpc::Status status, Response response)
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::MutexLock l(&lock_);
+    replies_.push_back({node_id, std::move(status), std::move(response)});
+    --outstanding_;
+  }
+
+  // Blocks until done(replies) holds or every RPC has completed, and returns
+  // the replies received so far in the order they arrived.
+  template <typename Pred>
+  std::vector<Reply> WaitUntil(Pred done) ABSL_LOCKS_EXCLUDED(lock_) {
+    return WaitUntil(std::move(done), absl::InfiniteDuration());
+  }
+
+  // Like above, but gives up waiting after timeout.
+  template <typename Pred>
+  std::vector<Reply> WaitUntil(Pred done, absl::Duration timeout)
+      ABSL_LOCKS_EXCLUDED(lock_) {
+    absl::MutexLock l(&lock_);
+    auto ready = [this, &done]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+      return outstanding_ == 0 || done(replies_);
+    };
+    lock_.AwaitWithTimeout(absl::Condition(&ready), timeout);
+    return replies_;
+  }
+
+  std::vector<Reply> WaitAll() ABSL_LOCKS_EXCLUDED(lock_) {
+    return WaitUntil([](const std::vector<Reply>&) { return false; });
+  }
+
+ private:
+  absl::Mutex lock_;
+  size_t outstanding_ ABSL_GUARDED_BY(lock_);
+  std::vector<Reply> replies_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace witnesskvs::paxos
+#endif  // PAXOS_QUORUM_CALL_H_
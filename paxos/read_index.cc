@@ -0,0 +1,34 @@
+#include "read_index.h"
+
+#include <utility>
+
+namespace witnesskvs::paxos {
+
+ReadIndex::ReadIndex(FetchFn fetch)
+    : fetch_{std::move(fetch)}, started_{0}, completed_{0}, fetching_{false} {}
+
+std::optional<uint64_t> ReadIndex::Get() {
+  absl::MutexLock l(&lock_);
+  // The request out right now, if any, may have been answered already.
+  const uint64_t needed = started_ + 1;
+  while (completed_ < needed) {
+    if (fetching_) {
+      auto ready = [this, needed]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+        return completed_ >= needed || !fetching_;
+      };
+      lock_.Await(absl::Condition(&ready));
+      continue;
+    }
+    fetching_ = true;
+    const uint64_t fetch = ++started_;
+    lock_.Unlock();
+    std::optional<uint64_t> index = fetch_();
+    lock_.Lock();
+    fetching_ = false;
+    completed_ = fetch;
+    index_ = index;
+  }
+  return index_;
+}
+
+}  // namespace witnesskvs::paxos
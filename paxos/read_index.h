@@ -0,0 +1,52 @@
+#ifndef PAXOS_READ_INDEX_H_
+#define PAXOS_READ_INDEX_H_
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+
+namespace witnesskvs::paxos {
+
+/**
+ * Gets followers the index reads have to wait to be applied up to before
+ * they're served locally, asking the leader once for all the reads that
+ * arrive together.
+ *
+ * A read can only go by an index the leader reported after the read started,
+ * or writes acked in the meantime could be missing from it. So a read that
+ * arrives while a request to the leader is out waits for the next one, which
+ * every read that arrived in the meantime shares.
+ */
+class ReadIndex {
+ public:
+  // Asks the leader for its read index, nullopt if it couldn't.
+  using FetchFn = std::function<std::optional<uint64_t>()>;
+
+  explicit ReadIndex(FetchFn fetch);
+
+  // Disable copy (and move) semantics.
+  ReadIndex(const ReadIndex&) = delete;
+  ReadIndex& operator=(const ReadIndex&) = delete;
+
+  // Returns an index the leader reported after the call, or nullopt if the
+  // request made for it failed.
+  std::optional<uint64_t> Get() ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  const FetchFn fetch_;
+
+  absl::Mutex lock_;
+  // Requests to the leader made and completed so far, one at a time.
+  uint64_t started_ ABSL_GUARDED_BY(lock_);
+  uint64_t completed_ ABSL_GUARDED_BY(lock_);
+  bool fetching_ ABSL_GUARDED_BY(lock_);
+  // What the last completed request got.
+  std::optional<uint64_t> index_ ABSL_GUARDED_BY(lock_);
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_READ_INDEX_H_
@@ -2,21 +2,51 @@
 
 #include <google/protobuf/util/message_differencer.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "log/log_reader.h"
 #include "log/logs_loader.h"
+#include "value_hash.h"
 
 ABSL_FLAG(std::string, paxos_log_directory, "/var/tmp", "Paxos Log directory");
 
 ABSL_FLAG(std::string, paxos_log_file_prefix, "replicated_log",
           "Paxos log file prefix");
 
+ABSL_FLAG(uint64_t, paxos_log_max_in_memory_entries, 1 << 16,
+          "Maximum number of log entries held in memory. Older chosen entries "
+          "are evicted and read back from disk when needed. 0 means no "
+          "limit.");
+
+ABSL_FLAG(uint64_t, paxos_log_max_entries_ahead, 1 << 20,
+          "How far past the first unchosen index entries are created. "
+          "Requests for indexes further ahead are refused rather than growing "
+          "the log to reach them.");
+
+ABSL_FLAG(uint64_t, paxos_log_page_entries, 256,
+          "Number of consecutive entries read back from disk at once when an "
+          "evicted entry is needed.");
+
 namespace witnesskvs::paxos {
 
+uint64_t GetLogIdx(const Log::Message &msg) {
+  if (msg.has_truncation()) {
+    return msg.truncation().idx();
+  }
+  return msg.has_promise() ? msg.promise().idx() : msg.paxos().idx();
+}
+
 std::function<bool(const Log::Message &a, const Log::Message &b)>
 GetLogSortFn() {
   static auto fn = [](const Log::Message &a, const Log::Message &b) {
-    if (a.paxos().idx() < b.paxos().idx()) {
+    if (GetLogIdx(a) < GetLogIdx(b)) {
       return true;
-    } else if (a.paxos().idx() == b.paxos().idx()) {
+    } else if (GetLogIdx(a) == GetLogIdx(b)) {
       if (a.paxos().is_chosen() == b.paxos().is_chosen()) {
         return false;  // for strict weak ordering criteria.
       }
@@ -31,54 +61,158 @@ GetLogSortFn() {
 }
 
 ReplicatedLog::ReplicatedLog(uint8_t node_id)
-    : node_id_{node_id}, first_unchosen_index_{0}, proposal_number_{0} {
+    : node_id_{node_id},
+      first_unchosen_index_{0},
+      max_idx_{0},
+      proposal_number_{0},
+      metadata_only_{false},
+      evicted_idx_{0},
+      truncated_idx_{0},
+      range_idx_{0},
+      range_min_proposal_{0},
+      stable_chosen_idx_{0},
+      evicted_reads_{0},
+      segment_reads_{0} {
   CHECK_LT(node_id, max_node_id_) << "Node initialization has gone wrong.";
 
   const std::string prefix =
       absl::GetFlag(FLAGS_paxos_log_file_prefix) + std::to_string(node_id);
 
-  witnesskvs::log::SortingLogsLoader log_loader{
-      absl::GetFlag(FLAGS_paxos_log_directory), prefix, GetLogSortFn()};
+  manifest_ = std::make_shared<log::Manifest>(
+      absl::GetFlag(FLAGS_paxos_log_directory), prefix, GetLogIdx);
+  witnesskvs::log::SortingLogsLoader log_loader{*manifest_, GetLogSortFn()};
   for (auto &log_msg : log_loader) {
-    ReplicatedLogEntry &entry = log_entries_[log_msg.paxos().idx()];
-    entry.idx_ = log_msg.paxos().idx();
-    entry.min_proposal_ = log_msg.paxos().min_proposal();
-    entry.accepted_proposal_ = log_msg.paxos().accepted_proposal();
-    entry.accepted_value_ = log_msg.paxos().accepted_value();
-    entry.is_chosen_ = log_msg.paxos().is_chosen();
-
-    proposal_number_ =
-        std::max(proposal_number_, log_msg.paxos().min_proposal());
-  }
-
-  for (const auto &[key, value] : log_entries_) {
-    if (value.is_chosen_) {
-      first_unchosen_index_ = value.idx_ + 1;
-    } else {
-      first_unchosen_index_ = value.idx_;
-      break;
+    if (log_msg.has_truncation()) {
+      truncated_idx_ = std::max(truncated_idx_, log_msg.truncation().idx());
+      continue;
     }
+    if (log_msg.has_promise() && log_msg.promise().range()) {
+      // A later range promise can only be higher, or cover more indexes.
+      const Log::Message::Promise &promise = log_msg.promise();
+      if (promise.min_proposal() > range_min_proposal_) {
+        range_idx_ = promise.idx();
+        range_min_proposal_ = promise.min_proposal();
+      } else if (promise.min_proposal() == range_min_proposal_) {
+        range_idx_ = std::min(range_idx_, promise.idx());
+      }
+      proposal_number_ = std::max(proposal_number_, promise.min_proposal());
+      continue;
+    }
+    if (log_msg.has_promise()) {
+      const Log::Message::Promise &promise = log_msg.promise();
+      ReplicatedLogEntry &entry = log_entries_[promise.idx()];
+      entry.idx_ = promise.idx();
+      entry.min_proposal_ =
+          std::max(entry.min_proposal_, promise.min_proposal());
+      proposal_number_ = std::max(proposal_number_, promise.min_proposal());
+      continue;
+    }
+    const Log::Message::Paxos &paxos = log_msg.paxos();
+    ReplicatedLogEntry &entry = log_entries_[paxos.idx()];
+    entry.idx_ = paxos.idx();
+    // Records for the same idx aren't necessarily sorted in the order they
+    // were written, so fold them together rather than letting the last one
+    // win. Proposals only ever go up, and a chosen record has the final value.
+    entry.min_proposal_ = std::max(entry.min_proposal_, paxos.min_proposal());
+    if (!entry.is_chosen_ &&
+        (paxos.is_chosen() ||
+         paxos.accepted_proposal() >= entry.accepted_proposal_)) {
+      entry.accepted_proposal_ = paxos.accepted_proposal();
+      entry.accepted_value_ = paxos.accepted_value();
+      entry.value_hash_ = paxos.value_hash();
+    }
+    entry.is_chosen_ = entry.is_chosen_ || paxos.is_chosen();
+
+    proposal_number_ = std::max(proposal_number_, paxos.min_proposal());
+  }
+
+  // Records of entries a truncation hadn't gotten to delete yet. Everything
+  // below the truncation point was chosen and applied.
+  log_entries_.TruncatePrefix(truncated_idx_);
+  first_unchosen_index_ = truncated_idx_;
+  if (truncated_idx_ > 0) {
+    max_idx_ = truncated_idx_ - 1;
+  }
+  if (!log_entries_.empty()) {
+    max_idx_ = log_entries_.last_index();
+    for (Index idx = log_entries_.first_index();
+         idx <= log_entries_.last_index(); ++idx) {
+      const ReplicatedLogEntry *value = log_entries_.find(idx);
+      if (value == nullptr) {
+        continue;
+      }
+      if (value->is_chosen_) {
+        first_unchosen_index_ = value->idx_ + 1;
+      } else {
+        first_unchosen_index_ = value->idx_;
+        break;
+      }
+    }
+  }
+
+  // Whatever was chosen before we went down counts as applied, unless the
+  // application says otherwise when it registers.
+  applier_ = std::make_unique<Applier>(first_unchosen_index_);
+  stable_chosen_idx_ = first_unchosen_index_.load();
+  {
+    absl::MutexLock l(&lock_);
+    MaybeEvictLocked();
   }
 
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
             << "] Constructed Replicated log with first unchosen index : "
-            << first_unchosen_index_ << " and proposal number "
-            << proposal_number_;
+            << first_unchosen_index_ << ", truncated idx: " << truncated_idx_
+            << " and proposal number " << proposal_number_;
 
   logs_truncator_ = std::make_unique<log::LogsTruncator>(
-      absl::GetFlag(FLAGS_paxos_log_directory), prefix,
-      [](const Log::Message &msg) { return msg.paxos().idx(); });
+      absl::GetFlag(FLAGS_paxos_log_directory), prefix, GetLogIdx, manifest_);
   log_writer_ = std::make_unique<witnesskvs::log::LogWriter>(
-      absl::GetFlag(FLAGS_paxos_log_directory), prefix,
-      [](const Log::Message &msg) { return msg.paxos().idx(); });
+      absl::GetFlag(FLAGS_paxos_log_directory), prefix, GetLogIdx);
+  log_writer_->RegisterCreateCallback(manifest_->GetCreateCallbackFn());
+  log_writer_->RegisterSealCallback(manifest_->GetSealCallbackFn());
   log_writer_->RegisterRotateCallback(logs_truncator_->GetCallbackFn());
 }
 
 ReplicatedLog::~ReplicatedLog() {}
 
-uint64_t ReplicatedLog::GetFirstUnchosenIdx() {
+void ReplicatedLog::RegisterAppCallback(IndexedAppCallback callback,
+                                        uint64_t applied_idx) {
+  // The entries it's missing are gone, only a snapshot can catch it up.
+  const uint64_t truncated_idx = GetTruncatedIdx();
+  CHECK_GE(applied_idx, truncated_idx)
+      << "NODE: [" << static_cast<uint32_t>(node_id_)
+      << "] The application applied up to idx: " << applied_idx
+      << ", but the log is truncated up to idx: " << truncated_idx;
+  applier_->RegisterCallback(
+      std::move(callback), applied_idx,
+      [this](uint64_t idx) -> std::optional<absl::Cord> {
+        std::optional<ReplicatedLogEntry> entry = FindLogEntryAtIdx(idx);
+        if (!entry.has_value() || !entry->is_chosen_) {
+          return std::nullopt;
+        }
+        return std::move(entry->accepted_value_);
+      });
+}
+
+uint64_t ReplicatedLog::GetFirstUnchosenIdx() const {
+  return first_unchosen_index_.load(std::memory_order_acquire);
+}
+
+bool ReplicatedLog::WaitUntilChosen(uint64_t idx, absl::Duration timeout) {
+  if (GetFirstUnchosenIdx() > idx) {
+    return true;
+  }
+  // The first unchosen index only moves with lock_ held, which re-evaluates
+  // the condition.
   absl::MutexLock l(&lock_);
-  return first_unchosen_index_;
+  auto is_chosen = [this, idx]() { return GetFirstUnchosenIdx() > idx; };
+  return lock_.AwaitWithTimeout(absl::Condition(&is_chosen), timeout);
+}
+
+bool ReplicatedLog::IsTooFarAhead(uint64_t idx) const {
+  const Index first_unchosen = GetFirstUnchosenIdx();
+  const uint64_t max_ahead = absl::GetFlag(FLAGS_paxos_log_max_entries_ahead);
+  return idx > first_unchosen && idx - first_unchosen > max_ahead;
 }
 
 uint64_t ReplicatedLog::GetNextProposalNumber() {
@@ -100,144 +234,713 @@ void ReplicatedLog::UpdateProposalNumber(uint64_t prop_num) {
 
 void ReplicatedLog::UpdateFirstUnchosenIdx() {
   lock_.AssertHeld();
-  for (uint64_t i = first_unchosen_index_; i <= log_entries_.rbegin()->first;
-       i++) {
-    auto it = log_entries_.find(i);
-    if (it == log_entries_.end()) {
-      break;
-    }
-    if (!it->second.is_chosen_) {
+  Index idx = first_unchosen_index_.load(std::memory_order_relaxed);
+  while (true) {
+    const ReplicatedLogEntry *entry = log_entries_.find(idx);
+    if (entry == nullptr || !entry->is_chosen_) {
       break;
     }
 
     // This entry is chosen and it is now safe to be applied to application
-    // state. The update to the application state happens as the
+    // state. The entry is handed to the applier as the
     // `first_unchosen_index_` is incremented. This ensures that even if the
     // paxos log has holes, the callback is invoked in log order instead of
     // commit order.
-    if (this->app_callback_) {
-      LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
-                << "] Calling App registered callback";
-      this->app_callback_(it->second.accepted_value_);
-    }
-    first_unchosen_index_++;
+    applier_->Enqueue(idx, entry->accepted_value_);
+    idx++;
   }
+  first_unchosen_index_.store(idx, std::memory_order_release);
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
-            << "] updated First unchosen index: " << first_unchosen_index_;
+            << "] updated First unchosen index: " << idx;
+  MaybeEvictLocked();
+}
+
+void ReplicatedLog::AdvanceStableChosenIdx(Index idx) {
+  Index current = stable_chosen_idx_.load(std::memory_order_relaxed);
+  while (current < idx && !stable_chosen_idx_.compare_exchange_weak(
+                              current, idx, std::memory_order_release,
+                              std::memory_order_relaxed)) {
+  }
+}
+
+void ReplicatedLog::MaybeEvictLocked() {
+  lock_.AssertHeld();
+  const uint64_t max_entries =
+      absl::GetFlag(FLAGS_paxos_log_max_in_memory_entries);
+  if (max_entries == 0 || log_entries_.empty()) {
+    return;
+  }
+  const Index first = log_entries_.first_index();
+  const Index last = log_entries_.last_index();
+  if (last - first + 1 <= max_entries) {
+    return;
+  }
+  // Only entries that can be read back from disk may go.
+  const Index evict_to =
+      std::min(last + 1 - max_entries,
+               stable_chosen_idx_.load(std::memory_order_acquire));
+  if (evict_to <= first) {
+    return;
+  }
+  VLOG(1) << "NODE: [" << static_cast<uint32_t>(node_id_)
+          << "] evicting entries below idx: " << evict_to;
+  log_entries_.TruncatePrefix(evict_to);
+  evicted_idx_ = std::max(evicted_idx_, evict_to);
+}
+
+std::optional<ReplicatedLogEntry> ReplicatedLog::ReadEvictedEntry(
+    Index idx) const {
+  const uint64_t evicted_reads =
+      evicted_reads_.fetch_add(1, std::memory_order_relaxed) + 1;
+  LOG_EVERY_N_SEC(INFO, 60)
+      << "NODE: [" << static_cast<uint32_t>(node_id_)
+      << "] served " << evicted_reads << " evicted entries by scanning "
+      << segment_reads_.load(std::memory_order_relaxed) << " log segments";
+  {
+    absl::MutexLock l(&page_lock_);
+    auto it = page_.find(idx);
+    if (it != page_.end()) {
+      return it->second;
+    }
+  }
+
+  const uint64_t page_entries =
+      std::max<uint64_t>(1, absl::GetFlag(FLAGS_paxos_log_page_entries));
+  std::map<Index, ReplicatedLogEntry> page =
+      ReadEvictedRange(idx, idx + page_entries);
+
+  absl::MutexLock l(&page_lock_);
+  page_ = std::move(page);
+  auto it = page_.find(idx);
+  if (it == page_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
 }
 
-void ReplicatedLog::MakeLogEntryStable(const ReplicatedLogEntry &entry) {
+std::map<ReplicatedLog::Index, ReplicatedLogEntry>
+ReplicatedLog::ReadEvictedRange(Index begin, Index end) const {
+  std::map<Index, ReplicatedLogEntry> entries;
+  auto add = [&entries](const Log::Message::Paxos &paxos) {
+    ReplicatedLogEntry &entry = entries[paxos.idx()];
+    entry.idx_ = paxos.idx();
+    entry.min_proposal_ = paxos.min_proposal();
+    entry.accepted_proposal_ = paxos.accepted_proposal();
+    entry.accepted_value_ = paxos.accepted_value();
+    entry.value_hash_ = paxos.value_hash();
+    entry.is_chosen_ = true;
+  };
+
+  const std::vector<log::Manifest::Segment> segments = manifest_->segments();
+  {
+    // Forget the segments truncated since.
+    absl::MutexLock l(&page_lock_);
+    std::erase_if(segment_indexes_, [&segments](const auto &it) {
+      return std::none_of(segments.begin(), segments.end(),
+                          [&it](const log::Manifest::Segment &segment) {
+                            return segment.filename == it.first;
+                          });
+    });
+  }
+  // Segments are indexed by their min and max idx, except for the one being
+  // written to.
+  for (const log::Manifest::Segment &segment : segments) {
+    if (segment.sealed && (end <= segment.min_idx || begin > segment.max_idx)) {
+      continue;
+    }
+    if (!std::filesystem::exists(segment.filename)) {
+      // Truncated in the meantime.
+      continue;
+    }
+    log::LogReader reader(segment.filename);
+
+    long scanned_pos = 0;
+    bool complete = false;
+    {
+      absl::MutexLock l(&page_lock_);
+      auto it = segment_indexes_.find(segment.filename);
+      if (it != segment_indexes_.end()) {
+        scanned_pos = it->second.scanned_pos;
+        complete = it->second.complete;
+      }
+    }
+    if (!complete) {
+      long pos = scanned_pos;
+      if (pos == 0) {
+        absl::StatusOr<long> first = reader.FirstMessagePos();
+        if (!first.ok()) {
+          continue;
+        }
+        pos = *first;
+        segment_reads_.fetch_add(1, std::memory_order_relaxed);
+      }
+      std::map<Index, long> offsets;
+      while (true) {
+        const long msg_pos = pos;
+        absl::StatusOr<Log::Message> msg = reader.ReadMessageAt(pos);
+        if (!msg.ok()) {
+          break;
+        }
+        if (msg->paxos().is_chosen()) {
+          offsets[msg->paxos().idx()] = msg_pos;
+        }
+        scanned_pos = pos;
+      }
+      absl::MutexLock l(&page_lock_);
+      SegmentIndex &index = segment_indexes_[segment.filename];
+      index.offsets.merge(offsets);
+      index.scanned_pos = std::max(index.scanned_pos, scanned_pos);
+      // A sealed segment isn't written to anymore, it's scanned to the end.
+      index.complete = segment.sealed;
+    }
+
+    std::vector<std::pair<Index, long>> positions;
+    {
+      absl::MutexLock l(&page_lock_);
+      const std::map<Index, long> &offsets =
+          segment_indexes_[segment.filename].offsets;
+      for (auto it = offsets.lower_bound(begin);
+           it != offsets.end() && it->first < end; ++it) {
+        positions.push_back(*it);
+      }
+    }
+    for (auto [idx, pos] : positions) {
+      absl::StatusOr<Log::Message> msg = reader.ReadMessageAt(pos);
+      if (!msg.ok()) {
+        LOG(WARNING) << "NODE: [" << static_cast<uint32_t>(node_id_)
+                     << "] failed to read idx: " << idx << " back from "
+                     << segment.filename << ": " << msg.status();
+        continue;
+      }
+      add(msg->paxos());
+    }
+  }
+  return entries;
+}
+
+void ReplicatedLog::SetValueLocked(ReplicatedLogEntry &entry,
+                                   absl::Cord value) {
+  lock_.AssertHeld();
+  if (metadata_only_ && !value.empty()) {
+    entry.value_hash_ = HashValue(value);
+    entry.accepted_value_.Clear();
+    return;
+  }
+  entry.value_hash_.clear();
+  entry.accepted_value_ = std::move(value);
+}
+
+ReplicatedLogEntry *ReplicatedLog::GetOrCreateEntryLocked(Index idx) {
+  lock_.AssertHeld();
+  if (idx < truncated_idx_ || IsTooFarAhead(idx)) {
+    LOG_EVERY_N_SEC(WARNING, 10)
+        << "NODE: [" << static_cast<uint32_t>(node_id_)
+        << "] Not creating an entry at idx: " << idx
+        << ", outside of the log from truncated idx: " << truncated_idx_
+        << " to first unchosen idx: " << GetFirstUnchosenIdx() << " + "
+        << absl::GetFlag(FLAGS_paxos_log_max_entries_ahead);
+    return nullptr;
+  }
+  ReplicatedLogEntry &entry = log_entries_[idx];
+  entry.idx_ = idx;
+  if (idx > max_idx_.load(std::memory_order_relaxed)) {
+    max_idx_.store(idx, std::memory_order_release);
+  }
+  return &entry;
+}
+
+log::LogWriter::Pending ReplicatedLog::MakeLogEntryStable(
+    const ReplicatedLogEntry &entry) {
+  lock_.AssertHeld();
   Log::Message log_message;
   log_message.mutable_paxos()->set_idx(entry.idx_);
   log_message.mutable_paxos()->set_min_proposal(entry.min_proposal_);
   log_message.mutable_paxos()->set_accepted_proposal(entry.accepted_proposal_);
   log_message.mutable_paxos()->set_accepted_value(entry.accepted_value_);
+  log_message.mutable_paxos()->set_value_hash(entry.value_hash_);
   log_message.mutable_paxos()->set_is_chosen(entry.is_chosen_);
 
   LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
             << "] stable entry at idx: " << entry.idx_
             << " with value: " << entry.accepted_value_
             << " with chosenness: " << entry.is_chosen_;
-  absl::Status status = log_writer_->Log(log_message);
+  absl::StatusOr<log::LogWriter::Pending> pending =
+      log_writer_->Enqueue(log_message);
+  CHECK_OK(pending);
+  return *std::move(pending);
+}
+
+log::LogWriter::Pending ReplicatedLog::MakePromiseStable(
+    const ReplicatedLogEntry &entry) {
+  lock_.AssertHeld();
+  Log::Message log_message;
+  log_message.mutable_promise()->set_idx(entry.idx_);
+  log_message.mutable_promise()->set_min_proposal(entry.min_proposal_);
+
+  VLOG(1) << "NODE: [" << static_cast<uint32_t>(node_id_)
+          << "] stable promise at idx: " << entry.idx_
+          << " with min proposal: " << entry.min_proposal_;
+  absl::StatusOr<log::LogWriter::Pending> pending =
+      log_writer_->Enqueue(log_message);
+  CHECK_OK(pending);
+  return *std::move(pending);
+}
+
+log::LogWriter::Pending ReplicatedLog::MakeRangePromiseStable() {
+  lock_.AssertHeld();
+  Log::Message log_message;
+  log_message.mutable_promise()->set_idx(range_idx_);
+  log_message.mutable_promise()->set_min_proposal(range_min_proposal_);
+  log_message.mutable_promise()->set_range(true);
 
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] stable range promise from idx: " << range_idx_
+            << " with min proposal: " << range_min_proposal_;
+  absl::StatusOr<log::LogWriter::Pending> pending =
+      log_writer_->Enqueue(log_message);
+  CHECK_OK(pending);
+  return *std::move(pending);
+}
+
+void ReplicatedLog::WaitStable(log::LogWriter::Pending pending) {
+  absl::Status status = log_writer_->Wait(std::move(pending));
   CHECK_EQ(status, absl::OkStatus());
 }
 
 void ReplicatedLog::MarkLogEntryChosen(uint64_t idx) {
-  absl::MutexLock l(&lock_);
-  ReplicatedLogEntry &entry = log_entries_[idx];
-  entry.idx_ = idx;
-  entry.is_chosen_ = true;
-  CHECK_EQ(entry.idx_, idx);
+  log::LogWriter::Pending pending;
+  Index chosen_idx;
+  {
+    absl::MutexLock l(&lock_);
+    if (IsEvictedLocked(idx)) {
+      // Already chosen and durable.
+      return;
+    }
+    ReplicatedLogEntry *entry = GetOrCreateEntryLocked(idx);
+    if (entry == nullptr) {
+      // Chosen and truncated already, or a stray index.
+      return;
+    }
+    entry->is_chosen_ = true;
 
-  MakeLogEntryStable(entry);
+    pending = MakeLogEntryStable(*entry);
 
-  UpdateFirstUnchosenIdx();
+    UpdateFirstUnchosenIdx();
+    chosen_idx = first_unchosen_index_.load(std::memory_order_relaxed);
+  }
+  WaitStable(std::move(pending));
+  // Log records are written in order, so everything chosen before ours is
+  // durable too.
+  AdvanceStableChosenIdx(chosen_idx);
 }
 
-void ReplicatedLog::SetLogEntryAtIdx(uint64_t idx, std::string value) {
-  absl::MutexLock l(&lock_);
-  ReplicatedLogEntry &entry = log_entries_[idx];
-  if (entry.accepted_value_ != value) {
-    // This is fine, as it is possible we may be the only node that accepted a
-    // value but that value never got quorum, some other value won and now we
-    // are learning about it.
+void ReplicatedLog::MarkChosenUpTo(uint64_t idx, uint64_t proposal_number) {
+  if (proposal_number == 0 ||
+      idx <= first_unchosen_index_.load(std::memory_order_acquire)) {
+    return;
+  }
+  log::LogWriter::Pending pending;
+  bool marked = false;
+  Index chosen_idx;
+  {
+    absl::MutexLock l(&lock_);
+    const Index end = std::min<Index>(idx, max_idx_.load() + 1);
+    for (Index i = first_unchosen_index_.load(std::memory_order_relaxed);
+         i < end; ++i) {
+      ReplicatedLogEntry *entry = log_entries_.find(i);
+      if (entry == nullptr || entry->is_chosen_ ||
+          entry->accepted_proposal_ != proposal_number) {
+        continue;
+      }
+      entry->is_chosen_ = true;
+      // Records are written in order, waiting for the last one is enough.
+      pending = MakeLogEntryStable(*entry);
+      marked = true;
+    }
+    if (!marked) {
+      return;
+    }
+    UpdateFirstUnchosenIdx();
+    chosen_idx = first_unchosen_index_.load(std::memory_order_relaxed);
+  }
+  WaitStable(std::move(pending));
+  AdvanceStableChosenIdx(chosen_idx);
+}
+
+void ReplicatedLog::SetLogEntryAtIdx(uint64_t idx, absl::Cord value,
+                                     uint64_t accepted_proposal) {
+  std::vector<std::pair<uint64_t, absl::Cord>> entries;
+  entries.emplace_back(idx, std::move(value));
+  SetLogEntriesAtIdx(std::move(entries), accepted_proposal);
+}
+
+void ReplicatedLog::SetLogEntriesAtIdx(
+    std::vector<std::pair<uint64_t, absl::Cord>> entries,
+    uint64_t accepted_proposal) {
+  std::optional<log::LogWriter::Pending> pending;
+  Index chosen_idx;
+  {
+    absl::MutexLock l(&lock_);
+    for (auto &[idx, value] : entries) {
+      SetLogEntryAtIdxLocked(idx, std::move(value), accepted_proposal,
+                             &pending);
+    }
+    if (!pending.has_value()) {
+      return;
+    }
+    UpdateFirstUnchosenIdx();
+    chosen_idx = first_unchosen_index_.load(std::memory_order_relaxed);
+  }
+  // Records are written in order, waiting for the last one is enough.
+  WaitStable(*std::move(pending));
+  AdvanceStableChosenIdx(chosen_idx);
+}
+
+std::vector<uint64_t> ReplicatedLog::MarkLogEntriesChosen(
+    const std::vector<std::pair<uint64_t, uint64_t>> &entries) {
+  std::vector<uint64_t> value_needed;
+  std::optional<log::LogWriter::Pending> pending;
+  Index chosen_idx;
+  {
+    absl::MutexLock l(&lock_);
+    for (const auto &[idx, accepted_proposal] : entries) {
+      if (IsEvictedLocked(idx)) {
+        // Already chosen and durable.
+        continue;
+      }
+      ReplicatedLogEntry *entry = log_entries_.find(idx);
+      if (entry == nullptr || entry->accepted_proposal_ != accepted_proposal) {
+        value_needed.push_back(idx);
+        continue;
+      }
+      if (entry->is_chosen_) {
+        continue;
+      }
+      entry->is_chosen_ = true;
+      pending = MakeLogEntryStable(*entry);
+    }
+    if (!pending.has_value()) {
+      return value_needed;
+    }
+    UpdateFirstUnchosenIdx();
+    chosen_idx = first_unchosen_index_.load(std::memory_order_relaxed);
+  }
+  // Records are written in order, waiting for the last one is enough.
+  WaitStable(*std::move(pending));
+  AdvanceStableChosenIdx(chosen_idx);
+  return value_needed;
+}
+
+void ReplicatedLog::SetLogEntryAtIdxLocked(
+    Index idx, absl::Cord value, uint64_t accepted_proposal,
+    std::optional<log::LogWriter::Pending> *pending) {
+  lock_.AssertHeld();
+  if (IsEvictedLocked(idx)) {
+    // Already chosen and durable.
+    return;
+  }
+  ReplicatedLogEntry *entry_ptr = GetOrCreateEntryLocked(idx);
+  if (entry_ptr == nullptr) {
+    // Chosen and truncated already, or too far ahead to be held yet.
+    return;
+  }
+  ReplicatedLogEntry &entry = *entry_ptr;
+  const bool same_value = entry.value_hash_.empty()
+                              ? entry.accepted_value_ == value
+                              : entry.value_hash_ == HashValue(value);
+  if (!same_value) {
+    // This is fine, as it is possible we may be the only node that accepted
+    // a value but that value never got quorum, some other value won and now
+    // we are learning about it.
     LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
               << "] Choosing a different value (" << value
               << ") than what was previously accepted ("
               << entry.accepted_value_ << ")";
+    // The value wasn't accepted here, so its proposal isn't known unless we
+    // proposed it. Keeping the old one would have MarkLogEntriesChosen() match
+    // it against the old value on peers.
+    entry.accepted_proposal_ = accepted_proposal;
+  } else if (accepted_proposal != 0) {
+    entry.accepted_proposal_ = accepted_proposal;
   }
 
-  entry.idx_ = idx;
-  entry.accepted_value_ = value;
+  SetValueLocked(entry, std::move(value));
   entry.is_chosen_ = true;
 
-  MakeLogEntryStable(entry);
-  UpdateFirstUnchosenIdx();
+  *pending = MakeLogEntryStable(entry);
 }
 
 uint64_t ReplicatedLog::GetMinProposalForIdx(uint64_t idx) {
-  absl::MutexLock l(&lock_);
-  ReplicatedLogEntry &entry = log_entries_[idx];
-  entry.idx_ = idx;
-  return entry.min_proposal_;
+  {
+    absl::MutexLock l(&lock_);
+    if (!IsEvictedLocked(idx)) {
+      const ReplicatedLogEntry *entry = GetOrCreateEntryLocked(idx);
+      return entry != nullptr ? MinProposalLocked(*entry) : 0;
+    }
+  }
+  std::optional<ReplicatedLogEntry> entry = ReadEvictedEntry(idx);
+  return entry.has_value() ? entry->min_proposal_ : 0;
 }
 
 void ReplicatedLog::UpdateMinProposalForIdx(uint64_t idx,
                                             uint64_t new_min_proposal) {
-  absl::MutexLock l(&lock_);
-  auto it = log_entries_.find(idx);
-  CHECK(it != log_entries_.end()) << "Attempting to update min proposal for "
-                                     "a log entry that does not exist.";
+  log::LogWriter::Pending pending;
+  {
+    absl::MutexLock l(&lock_);
+    if (IsEvictedLocked(idx) || idx < truncated_idx_) {
+      // Chosen, so the min proposal doesn't matter anymore.
+      return;
+    }
+    ReplicatedLogEntry *entry = log_entries_.find(idx);
+    CHECK(entry != nullptr) << "Attempting to update min proposal for "
+                               "a log entry that does not exist.";
 
-  CHECK(new_min_proposal > it->second.min_proposal_)
-      << "Cannot attempt to make an update to min proposal with a lower value.";
+    CHECK(new_min_proposal > entry->min_proposal_)
+        << "Cannot attempt to make an update to min proposal with a lower "
+           "value.";
 
-  it->second.idx_ = idx;
-  it->second.min_proposal_ = new_min_proposal;
-  MakeLogEntryStable(it->second);
+    entry->idx_ = idx;
+    entry->min_proposal_ = new_min_proposal;
+    pending = MakePromiseStable(*entry);
+  }
+  WaitStable(std::move(pending));
 }
 
-ReplicatedLogEntry ReplicatedLog::GetLogEntryAtIdx(uint64_t idx) {
-  absl::MutexLock l(&lock_);
-  auto it = log_entries_.find(idx);
-  it->second.idx_ = idx;
-  return it->second;
+ReplicatedLogEntry ReplicatedLog::GetLogEntryAtIdx(uint64_t idx) const {
+  {
+    absl::ReaderMutexLock l(&lock_);
+    const ReplicatedLogEntry *entry = log_entries_.find(idx);
+    if (entry != nullptr) {
+      return *entry;
+    }
+    CHECK(IsEvictedLocked(idx)) << "No log entry at idx: " << idx;
+  }
+  std::optional<ReplicatedLogEntry> entry = ReadEvictedEntry(idx);
+  CHECK(entry.has_value()) << "No log entry at idx: " << idx;
+  return *std::move(entry);
+}
+
+std::optional<ReplicatedLogEntry> ReplicatedLog::FindLogEntryAtIdx(
+    uint64_t idx) const {
+  {
+    absl::ReaderMutexLock l(&lock_);
+    const ReplicatedLogEntry *entry = log_entries_.find(idx);
+    if (entry != nullptr) {
+      return *entry;
+    }
+    if (!IsEvictedLocked(idx)) {
+      return std::nullopt;
+    }
+  }
+  return ReadEvictedEntry(idx);
 }
 
 uint64_t ReplicatedLog::UpdateLogEntry(const ReplicatedLogEntry &new_entry) {
-  absl::MutexLock l(&lock_);
-  ReplicatedLogEntry &current_entry = log_entries_[new_entry.idx_];
-  if (new_entry.min_proposal_ >= current_entry.min_proposal_) {
-    current_entry.idx_ = new_entry.idx_;
+  std::optional<log::LogWriter::Pending> pending;
+  uint64_t min_proposal;
+  {
+    absl::MutexLock l(&lock_);
+    min_proposal = UpdateLogEntryLocked(new_entry, &pending);
+  }
+  if (pending.has_value()) {
+    WaitStable(*std::move(pending));
+  }
+  return min_proposal;
+}
+
+std::vector<uint64_t> ReplicatedLog::UpdateLogEntries(
+    const std::vector<ReplicatedLogEntry> &new_entries) {
+  std::optional<log::LogWriter::Pending> pending;
+  std::vector<uint64_t> min_proposals;
+  min_proposals.reserve(new_entries.size());
+  {
+    absl::MutexLock l(&lock_);
+    for (const ReplicatedLogEntry &new_entry : new_entries) {
+      min_proposals.push_back(UpdateLogEntryLocked(new_entry, &pending));
+    }
+  }
+  // Records are written in order, waiting for the last one is enough.
+  if (pending.has_value()) {
+    WaitStable(*std::move(pending));
+  }
+  return min_proposals;
+}
+
+uint64_t ReplicatedLog::UpdateLogEntryLocked(
+    const ReplicatedLogEntry &new_entry,
+    std::optional<log::LogWriter::Pending> *pending) {
+  lock_.AssertHeld();
+  if (IsEvictedLocked(new_entry.idx_) || new_entry.idx_ < truncated_idx_) {
+    // Chosen already, so this can only be the chosen value again.
+    return new_entry.min_proposal_;
+  }
+  ReplicatedLogEntry *entry = GetOrCreateEntryLocked(new_entry.idx_);
+  CHECK(entry != nullptr) << "Updating the entry at idx: " << new_entry.idx_
+                          << ", callers must refuse IsTooFarAhead() indexes";
+  ReplicatedLogEntry &current_entry = *entry;
+  if (new_entry.min_proposal_ >= MinProposalLocked(current_entry)) {
     current_entry.min_proposal_ = new_entry.min_proposal_;
     current_entry.accepted_proposal_ = new_entry.accepted_proposal_;
-    current_entry.accepted_value_ = new_entry.accepted_value_;
+    SetValueLocked(current_entry, new_entry.accepted_value_);
 
     if (!current_entry.is_chosen_) {
       current_entry.is_chosen_ = new_entry.is_chosen_;
     }
-    MakeLogEntryStable(current_entry);
+    *pending = MakeLogEntryStable(current_entry);
+  }
+  return MinProposalLocked(current_entry);
+}
+
+uint64_t ReplicatedLog::PrepareRange(uint64_t idx, uint64_t proposal_number,
+                                     std::vector<ReplicatedLogEntry> *accepted) {
+  std::optional<log::LogWriter::Pending> pending;
+  Index evicted_begin;
+  Index evicted_end;
+  {
+    absl::MutexLock l(&lock_);
+    // The range promise covers part of [idx, inf) whatever its range_idx_.
+    uint64_t promised = range_min_proposal_;
+    if (!log_entries_.empty()) {
+      for (Index i = std::max(idx, log_entries_.first_index());
+           i <= log_entries_.last_index(); ++i) {
+        const ReplicatedLogEntry *entry = log_entries_.find(i);
+        if (entry != nullptr) {
+          promised = std::max(promised, entry->min_proposal_);
+        }
+      }
+    }
+    if (promised > proposal_number) {
+      return promised;
+    }
+
+    if (proposal_number > range_min_proposal_ || idx < range_idx_) {
+      // Only ever extend the range downwards, a higher promise for the
+      // indexes it covered already is still a valid one.
+      range_idx_ = range_min_proposal_ == 0 ? idx : std::min(range_idx_, idx);
+      range_min_proposal_ = proposal_number;
+      pending = MakeRangePromiseStable();
+    }
+
+    if (!log_entries_.empty()) {
+      for (Index i = std::max(idx, log_entries_.first_index());
+           i <= log_entries_.last_index(); ++i) {
+        const ReplicatedLogEntry *entry = log_entries_.find(i);
+        if (entry != nullptr &&
+            (entry->accepted_proposal_ != 0 || entry->is_chosen_)) {
+          accepted->push_back(*entry);
+        }
+      }
+    }
+    evicted_begin = std::max(idx, truncated_idx_);
+    evicted_end = evicted_idx_;
+  }
+  if (pending.has_value()) {
+    WaitStable(*std::move(pending));
+  }
+
+  // Evicted entries are chosen, so the new leader needs them too. They're
+  // read in a single pass over the segments holding them.
+  std::vector<ReplicatedLogEntry> evicted;
+  if (evicted_begin < evicted_end) {
+    evicted_reads_.fetch_add(evicted_end - evicted_begin,
+                             std::memory_order_relaxed);
+    for (auto &it : ReadEvictedRange(evicted_begin, evicted_end)) {
+      evicted.push_back(std::move(it.second));
+    }
+  }
+  accepted->insert(accepted->begin(), std::make_move_iterator(evicted.begin()),
+                   std::make_move_iterator(evicted.end()));
+  return proposal_number;
+}
+
+log::LogWriter::Pending ReplicatedLog::MakeTruncationStable(Index index) {
+  lock_.AssertHeld();
+  Log::Message log_message;
+  log_message.mutable_truncation()->set_idx(index);
+
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] stable truncation below idx: " << index;
+  absl::StatusOr<log::LogWriter::Pending> pending =
+      log_writer_->Enqueue(log_message);
+  CHECK_OK(pending);
+  return *std::move(pending);
+}
+
+bool ReplicatedLog::InstallSnapshot(uint64_t idx, const std::string &dir) {
+  if (idx <= GetFirstUnchosenIdx() || !applier_->Install(idx, dir)) {
+    return false;
+  }
+  // Recorded before the log moves on, so that a restart resumes from the
+  // snapshot rather than from the entries it superseded.
+  std::optional<log::LogWriter::Pending> pending;
+  {
+    absl::MutexLock l(&lock_);
+    if (truncated_idx_ < idx) {
+      pending = MakeTruncationStable(idx);
+    }
+  }
+  if (pending.has_value()) {
+    WaitStable(*std::move(pending));
+  }
+  {
+    absl::MutexLock l(&lock_);
+    if (first_unchosen_index_.load(std::memory_order_relaxed) < idx) {
+      // Whatever we hold below idx is superseded by the snapshot.
+      log_entries_.TruncatePrefix(idx);
+      truncated_idx_ = std::max(truncated_idx_, idx);
+      if (max_idx_.load(std::memory_order_relaxed) < idx - 1) {
+        max_idx_.store(idx - 1, std::memory_order_release);
+      }
+      AdvanceStableChosenIdx(idx);
+      first_unchosen_index_.store(idx, std::memory_order_release);
+      // Entries from idx on may have been chosen already.
+      UpdateFirstUnchosenIdx();
+    }
   }
-  return current_entry.min_proposal_;
+  LOG(INFO) << "NODE: [" << static_cast<uint32_t>(node_id_)
+            << "] Installed snapshot as of idx: " << idx;
+  // Drops the records below idx from disk too, its truncation point is
+  // recorded already.
+  Truncate(idx);
+  return true;
 }
 
 void ReplicatedLog::Truncate(uint64_t index) {
   // Note maybe we should put this under a lock and make sure
   // we're not shutting down / going through destruction.
   CHECK(logs_truncator_ != nullptr);
-  log_writer_->MaybeForceRotate();
-  logs_truncator_->Truncate(index);
-  absl::MutexLock l(&lock_);
-  std::vector<Index> erase;
-  for (const auto &[cur_index, _] : log_entries_) {
-    if (cur_index < index) {
-      erase.push_back(cur_index);
+  {
+    // The range promise's record would be truncated away, so record it again
+    // for the indexes that remain. The truncation point is recorded before any
+    // of the records below it go, so that they can't come back on restart.
+    std::optional<log::LogWriter::Pending> range_pending;
+    std::optional<log::LogWriter::Pending> truncation_pending;
+    {
+      absl::MutexLock l(&lock_);
+      if (range_min_proposal_ != 0 && range_idx_ < index) {
+        range_idx_ = index;
+        range_pending = MakeRangePromiseStable();
+      }
+      if (index > truncated_idx_) {
+        truncation_pending = MakeTruncationStable(index);
+      }
+    }
+    if (range_pending.has_value()) {
+      WaitStable(*std::move(range_pending));
+    }
+    if (truncation_pending.has_value()) {
+      WaitStable(*std::move(truncation_pending));
     }
   }
-  for (const Index index : erase) {
-    log_entries_.erase(index);
+  log_writer_->MaybeForceRotate();
+  logs_truncator_->Truncate(index);
+  {
+    absl::MutexLock l(&lock_);
+    log_entries_.TruncatePrefix(index);
+    truncated_idx_ = std::max(truncated_idx_, index);
   }
+  absl::MutexLock l(&page_lock_);
+  page_.clear();
 }
 
 }  // namespace witnesskvs::paxos
@@ -1,9 +1,21 @@
 #ifndef PAXOS_REPLICATED_LOG_H_
 #define PAXOS_REPLICATED_LOG_H_
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/cord.h"
+#include "applier.h"
 #include "common.h"
 #include "log/log_writer.h"
 #include "log/logs_truncator.h"
+#include "log/manifest.h"
+#include "log_window.h"
 
 namespace witnesskvs::paxos {
 
@@ -11,7 +23,13 @@ struct ReplicatedLogEntry {
   uint64_t idx_{};
   uint64_t min_proposal_{};
   uint64_t accepted_proposal_{};
-  std::string accepted_value_{};
+  // Shares its buffer with the request it came from and the log record and
+  // requests made from it, so copying an entry doesn't copy the value.
+  absl::Cord accepted_value_{};
+  // Set instead of accepted_value_ on witnesses that only store metadata, see
+  // ReplicatedLog::SetMetadataOnly(). Empty whenever accepted_value_ is the
+  // value, no-ops included.
+  std::string value_hash_{};
   bool is_chosen_{};
 };
 
@@ -21,58 +39,280 @@ class ReplicatedLog {
 
   mutable absl::Mutex lock_;
   using Index = uint64_t;
-  Index first_unchosen_index_ ABSL_GUARDED_BY(lock_);
+  // Watermarks, only written with lock_ held but read without it so that hot
+  // paths (e.g. Prepare, Accept) don't contend with writers.
+  std::atomic<Index> first_unchosen_index_;
+  std::atomic<Index> max_idx_;  // Highest idx ever held in the log.
   uint64_t proposal_number_ ABSL_GUARDED_BY(lock_);
-  std::map<Index, ReplicatedLogEntry> log_entries_ ABSL_GUARDED_BY(lock_);
+  bool metadata_only_ ABSL_GUARDED_BY(lock_);
+  LogWindow<ReplicatedLogEntry> log_entries_ ABSL_GUARDED_BY(lock_);
+
+  // Entries from truncated_idx_ up to evicted_idx_ are chosen and were dropped
+  // from log_entries_ to bound memory, they're read back from disk on demand.
+  // Entries below truncated_idx_ are gone altogether.
+  Index evicted_idx_ ABSL_GUARDED_BY(lock_);
+  Index truncated_idx_ ABSL_GUARDED_BY(lock_);
+
+  // Promise made by a range Prepare: no proposal below range_min_proposal_ is
+  // accepted for range_idx_ or any index after it.
+  Index range_idx_ ABSL_GUARDED_BY(lock_);
+  uint64_t range_min_proposal_ ABSL_GUARDED_BY(lock_);
+  // Every entry below this is chosen and its chosen record is durable, so it
+  // can be evicted. Advanced once the record's write is waited on.
+  std::atomic<Index> stable_chosen_idx_;
+
+  // The last page of evicted entries read back from disk, so that sequential
+  // reads (e.g. a PeerReplicator catching up a peer) don't rescan the segment
+  // for every entry.
+  mutable absl::Mutex page_lock_;
+  mutable std::map<Index, ReplicatedLogEntry> page_ ABSL_GUARDED_BY(page_lock_);
+  // Where each chosen entry's record is in a segment, filled as the segment
+  // is scanned so that later reads of it seek straight to the entries they
+  // need. The segment being written to is only scanned past what was scanned
+  // of it already.
+  struct SegmentIndex {
+    std::map<Index, long> offsets;
+    long scanned_pos = 0;  // 0 until the first scan.
+    bool complete = false;
+  };
+  mutable std::map<std::string, SegmentIndex> segment_indexes_
+      ABSL_GUARDED_BY(page_lock_);
+  mutable std::atomic<uint64_t> evicted_reads_;
+  mutable std::atomic<uint64_t> segment_reads_;
 
   static constexpr uint8_t num_bits_for_node_id_ = 3;
   static constexpr uint8_t max_node_id_ = (1ull << num_bits_for_node_id_) - 1;
   static constexpr uint64_t mask_ = ~(max_node_id_);
 
+  // Declared ahead of logs_truncator_ and log_writer_ which report to it, so
+  // it's destroyed after them.
+  std::shared_ptr<witnesskvs::log::Manifest> manifest_;
   std::unique_ptr<witnesskvs::log::LogsTruncator> logs_truncator_;
   std::unique_ptr<witnesskvs::log::LogWriter> log_writer_;
 
-  void UpdateFirstUnchosenIdx();
+  void UpdateFirstUnchosenIdx() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // The bodies of UpdateLogEntry() and SetLogEntryAtIdx(), setting pending to
+  // the record written if any.
+  uint64_t UpdateLogEntryLocked(const ReplicatedLogEntry &new_entry,
+                                std::optional<log::LogWriter::Pending> *pending)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void SetLogEntryAtIdxLocked(Index idx, absl::Cord value,
+                              uint64_t accepted_proposal,
+                              std::optional<log::LogWriter::Pending> *pending)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Sets the entry's value, or only its hash if metadata_only_.
+  void SetValueLocked(ReplicatedLogEntry &entry, absl::Cord value)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Returns the entry at idx, creating it if needed. Returns nullptr rather
+  // than creating one below truncated_idx_, which would bring truncated state
+  // back, or past IsTooFarAhead().
+  ReplicatedLogEntry *GetOrCreateEntryLocked(Index idx)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  bool IsEvictedLocked(Index idx) const ABSL_SHARED_LOCKS_REQUIRED(lock_) {
+    return idx >= truncated_idx_ && idx < evicted_idx_;
+  }
+  // The entry's min proposal, including the range promise if it covers it.
+  uint64_t MinProposalLocked(const ReplicatedLogEntry &entry) const
+      ABSL_SHARED_LOCKS_REQUIRED(lock_) {
+    return entry.idx_ >= range_idx_
+               ? std::max(entry.min_proposal_, range_min_proposal_)
+               : entry.min_proposal_;
+  }
+  void AdvanceStableChosenIdx(Index idx);
+  // Drops the oldest chosen entries from log_entries_ once it holds more than
+  // --paxos_log_max_in_memory_entries.
+  void MaybeEvictLocked() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Reads an evicted entry back from the log segments. Returns nullopt if it's
+  // no longer on disk, i.e. it was truncated in the meantime.
+  std::optional<ReplicatedLogEntry> ReadEvictedEntry(Index idx) const
+      ABSL_LOCKS_EXCLUDED(lock_, page_lock_);
+  // Reads the chosen entries in [begin, end) that are still on disk back from
+  // the log segments, reading each segment at most once.
+  std::map<Index, ReplicatedLogEntry> ReadEvictedRange(Index begin,
+                                                       Index end) const
+      ABSL_LOCKS_EXCLUDED(lock_, page_lock_);
 
-  void MakeLogEntryStable(const ReplicatedLogEntry &entry);
+  // Enqueues entry to be written to the log. The order entries are enqueued in
+  // under lock_ is the order they're written in, but durability is only
+  // guaranteed once WaitStable() returns, which must be called without lock_
+  // held so that other callers aren't serialized behind the fsync. Callers
+  // must not acknowledge a change (e.g. reply to an RPC) before then.
+  log::LogWriter::Pending MakeLogEntryStable(const ReplicatedLogEntry &entry)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  void WaitStable(log::LogWriter::Pending pending) ABSL_LOCKS_EXCLUDED(lock_);
+  // Like MakeLogEntryStable() but only records the entry's min_proposal, in a
+  // record a few bytes long rather than one the size of its value.
+  log::LogWriter::Pending MakePromiseStable(const ReplicatedLogEntry &entry)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Records the range promise, a single record however many indexes it covers.
+  log::LogWriter::Pending MakeRangePromiseStable()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Records that entries below index are truncated, restored on restart into
+  // truncated_idx_.
+  log::LogWriter::Pending MakeTruncationStable(Index index)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
-  std::function<void(std::string)> app_callback_;
+  // Applies chosen entries to the application, off of lock_.
+  std::unique_ptr<Applier> applier_;
 
  public:
   ReplicatedLog(uint8_t node_id);
   ~ReplicatedLog();
 
-  void RegisterAppCallback(std::function<void(std::string)> callback) {
+  // Stores the hash of accepted values rather than the values themselves, so
+  // that a witness's disk and memory don't grow with value sizes. Set before
+  // the log serves any request. Entries already held keep their values.
+  void SetMetadataOnly(bool metadata_only) {
     absl::MutexLock l(&lock_);
-    app_callback_ = callback;
+    metadata_only_ = metadata_only;
+  }
+
+  void RegisterAppCallback(AppCallback callback) {
+    applier_->RegisterCallback(std::move(callback));
+  }
+  // For an application that stores how far it applied the log, see
+  // Applier::RegisterCallback(). Chosen entries it's missing are read back
+  // from the log, so applied_idx can't be below the truncated idx.
+  void RegisterAppCallback(IndexedAppCallback callback, uint64_t applied_idx);
+  void RegisterSnapshotCallbacks(SnapshotCallback snapshot,
+                                 InstallSnapshotCallback install) {
+    applier_->RegisterSnapshotCallbacks(std::move(snapshot),
+                                        std::move(install));
   }
 
-  uint64_t GetFirstUnchosenIdx();
+  // Writes a snapshot of the application state into dir, see
+  // Applier::Snapshot(). Returns the index below which it reflects every
+  // entry, nullopt if it couldn't.
+  std::optional<uint64_t> CreateSnapshot(const std::string &dir) {
+    return applier_->Snapshot(dir);
+  }
+  // Installs the snapshot in dir, taken with every entry below idx applied,
+  // and moves the log on to idx: entries below it count as chosen and are
+  // truncated. Returns false if the log is at idx already, or the snapshot
+  // couldn't be installed.
+  bool InstallSnapshot(uint64_t idx, const std::string &dir);
+
+  // Returns the index below which all chosen entries have been applied.
+  uint64_t GetAppliedIdx() { return applier_->applied_idx(); }
+
+  // Returns the highest index the log has held an entry for, even if that
+  // entry has since been truncated. Doesn't take lock_.
+  uint64_t GetMaxIdx() const {
+    return max_idx_.load(std::memory_order_acquire);
+  }
+
+  // Blocks until all entries below idx have been applied, or timeout expires.
+  bool WaitUntilApplied(uint64_t idx,
+                        absl::Duration timeout = absl::InfiniteDuration()) {
+    return applier_->WaitUntilApplied(idx, timeout);
+  }
+
+  // Doesn't take lock_.
+  uint64_t GetFirstUnchosenIdx() const;
+  // Blocks until every entry up to and including idx is chosen, or timeout
+  // expires. Returns whether they were.
+  bool WaitUntilChosen(uint64_t idx,
+                       absl::Duration timeout = absl::InfiniteDuration())
+      ABSL_LOCKS_EXCLUDED(lock_);
+  // Whether idx is more than --paxos_log_max_entries_ahead past the first
+  // unchosen index. No entry is created for it, requests for it are to be
+  // refused. Doesn't take lock_.
+  bool IsTooFarAhead(uint64_t idx) const;
   uint64_t GetNextProposalNumber();
   void UpdateProposalNumber(uint64_t prop_num);
   void MarkLogEntryChosen(uint64_t idx);
-  void SetLogEntryAtIdx(uint64_t idx, std::string value);
+  // Marks every entry below idx that was accepted with proposal_number as
+  // chosen. The leader sends its first unchosen index along with its current
+  // proposal number, the values it proposed with that number below the index
+  // are the ones that got chosen.
+  void MarkChosenUpTo(uint64_t idx, uint64_t proposal_number);
+  // Records value as chosen at idx. The proposer that got it chosen passes
+  // the proposal it was accepted with, its own Accept may not have landed
+  // yet.
+  void SetLogEntryAtIdx(uint64_t idx, absl::Cord value,
+                        uint64_t accepted_proposal = 0);
+  // Like SetLogEntryAtIdx() for a run of (idx, value), under a single lock
+  // acquisition and waiting on a single log write.
+  void SetLogEntriesAtIdx(std::vector<std::pair<uint64_t, absl::Cord>> entries,
+                          uint64_t accepted_proposal = 0);
+  // Marks each (idx, accepted_proposal) in entries chosen if the value held
+  // for idx was accepted with accepted_proposal, under a single lock
+  // acquisition and waiting on a single log write. Returns the indexes it
+  // couldn't, whose values must be set with SetLogEntryAtIdx() instead.
+  std::vector<uint64_t> MarkLogEntriesChosen(
+      const std::vector<std::pair<uint64_t, uint64_t>> &entries);
 
   uint64_t GetMinProposalForIdx(uint64_t idx);
+  // The proposal number promised by the last range Prepare, 0 if none.
+  uint64_t GetRangeMinProposal() const {
+    absl::ReaderMutexLock l(&lock_);
+    return range_min_proposal_;
+  }
+  // Returns the id of the node that generated proposal_number.
+  static uint8_t GetProposalNodeId(uint64_t proposal_number) {
+    return proposal_number & max_node_id_;
+  }
+
+  // Phase 1 of paxos for idx and every index after it at once. Promises not to
+  // accept proposals below proposal_number for any of them, unless a higher
+  // proposal was promised already. Returns the proposal number promised, i.e.
+  // a higher one if rejected. If not rejected, accepted is filled with every
+  // entry from idx on with an accepted value.
+  uint64_t PrepareRange(uint64_t idx, uint64_t proposal_number,
+                        std::vector<ReplicatedLogEntry> *accepted);
   void UpdateMinProposalForIdx(uint64_t idx, uint64_t new_min_proposal);
-  ReplicatedLogEntry GetLogEntryAtIdx(uint64_t idx);
+  // Only takes lock_ shared, the copy shares the entry's value. Entries that
+  // were evicted from memory are read back from disk.
+  ReplicatedLogEntry GetLogEntryAtIdx(uint64_t idx) const;
+  // Like GetLogEntryAtIdx() but returns nullopt rather than crashing if there
+  // is no entry at idx, e.g. it was truncated.
+  std::optional<ReplicatedLogEntry> FindLogEntryAtIdx(uint64_t idx) const;
+
+  struct PagingStats {
+    uint64_t evicted_reads;  // Lookups of entries evicted from memory.
+    uint64_t segment_reads;  // Log segments scanned from disk to serve them.
+  };
+  PagingStats GetPagingStats() const {
+    return {evicted_reads_.load(std::memory_order_relaxed),
+            segment_reads_.load(std::memory_order_relaxed)};
+  }
 
   // Updates the log entry if the existing entry has a lower min_proposal than
   // new_entry. Regardless returns the proposal number needed for this entry to
   // be updated.
   uint64_t UpdateLogEntry(const ReplicatedLogEntry &new_entry);
+  // Like UpdateLogEntry() for each of new_entries, under a single lock
+  // acquisition and waiting on a single log write. Returns the proposal number
+  // needed for each entry, in order.
+  std::vector<uint64_t> UpdateLogEntries(
+      const std::vector<ReplicatedLogEntry> &new_entries);
 
   // Enqueues index in the truncator for log truncation.
   void Truncate(uint64_t index);
+  // Entries below this are gone from the log, peers missing any of them can
+  // only catch up with a snapshot.
+  uint64_t GetTruncatedIdx() const {
+    absl::ReaderMutexLock l(&lock_);
+    return truncated_idx_;
+  }
 
-  // Useful for unit testing.
+  // Useful for unit testing. Only returns the entries held in memory.
   std::map<uint64_t, ReplicatedLogEntry> GetLogEntries() const {
     absl::ReaderMutexLock l(&lock_);
-    return log_entries_;
+    std::map<uint64_t, ReplicatedLogEntry> entries;
+    log_entries_.ForEach([&entries](Index idx, const ReplicatedLogEntry &entry) {
+      entries.emplace_hint(entries.end(), idx, entry);
+    });
+    return entries;
   }
 };
 
 std::function<bool(const Log::Message& a, const Log::Message& b)> GetLogSortFn();
 
+// Returns the idx of the entry a log record is for.
+uint64_t GetLogIdx(const Log::Message& msg);
+
 }  // namespace witnesskvs::paxos
 #endif  // PAXOS_REPLICATED_LOG_H_
@@ -0,0 +1,230 @@
+#include "replication_stream.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/log/log.h"
+#include "absl/time/clock.h"
+
+ABSL_FLAG(uint64_t, paxos_replication_stream_window, 64,
+          "Maximum number of Accepts and Commits outstanding at once on the "
+          "replication stream to a peer");
+
+namespace witnesskvs::paxos {
+namespace {
+
+constexpr absl::Duration kMinBackoff = absl::Milliseconds(50);
+constexpr absl::Duration kMaxBackoff = absl::Seconds(1);
+
+}  // namespace
+
+ReplicationStream::ReplicationStream(const std::string& address)
+    : address_{address},
+      stub_{paxos_rpc::Acceptor::NewStub(
+          grpc::CreateChannel(address, grpc::InsecureChannelCredentials()))},
+      stopping_{false},
+      next_seq_{0},
+      in_flight_{0},
+      broken_{false},
+      backoff_{kMinBackoff},
+      reconnect_after_{absl::InfinitePast()} {
+  writer_ = std::jthread(&ReplicationStream::WriterThread, this);
+}
+
+ReplicationStream::~ReplicationStream() {
+  {
+    absl::MutexLock l(&lock_);
+    stopping_ = true;
+  }
+  writer_.join();
+}
+
+void ReplicationStream::Send(paxos_rpc::ReplicationRequest request,
+                             absl::Time deadline, Done done) {
+  {
+    absl::MutexLock l(&lock_);
+    if (!stopping_ &&
+        (stream_ != nullptr || absl::Now() >= reconnect_after_)) {
+      const uint64_t seq = next_seq_++;
+      request.set_seq(seq);
+      pending_.emplace(seq, Pending{deadline, false, std::move(done)});
+      queue_.push_back(std::move(request));
+      return;
+    }
+  }
+  done(grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                    "Acceptor not available right now."),
+       paxos_rpc::ReplicationResponse());
+}
+
+void ReplicationStream::ExpireLocked(absl::Time now,
+                                     std::vector<Failed>* failed) {
+  lock_.AssertHeld();
+  // Deadlines are handed out in seq order, the oldest request expires first.
+  while (!pending_.empty() && pending_.begin()->second.deadline <= now) {
+    auto expired = pending_.extract(pending_.begin());
+    if (expired.mapped().written) {
+      --in_flight_;
+    }
+    failed->push_back({std::move(expired.mapped().done),
+                       grpc::Status(grpc::StatusCode::DEADLINE_EXCEEDED,
+                                    "Deadline Exceeded")});
+  }
+}
+
+void ReplicationStream::FailAllLocked(const grpc::Status& status,
+                                      std::vector<Failed>* failed) {
+  lock_.AssertHeld();
+  for (auto& [seq, pending] : pending_) {
+    failed->push_back({std::move(pending.done), status});
+  }
+  pending_.clear();
+  queue_.clear();
+  in_flight_ = 0;
+}
+
+void ReplicationStream::WriterThread() {
+  while (true) {
+    std::vector<Failed> failed;
+    paxos_rpc::ReplicationRequest request;
+    Stream* stream = nullptr;
+    grpc::ClientContext* context = nullptr;
+    bool connect = false;
+    bool disconnect = false;
+    bool stopped = false;
+    {
+      absl::MutexLock l(&lock_);
+      const std::size_t window = std::max<uint64_t>(
+          absl::GetFlag(FLAGS_paxos_replication_stream_window), 1);
+      auto ready = [this, window]() ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) {
+        return stopping_ || broken_ ||
+               (!queue_.empty() &&
+                (stream_ == nullptr || in_flight_ < window));
+      };
+      lock_.AwaitWithDeadline(absl::Condition(&ready),
+                              pending_.empty()
+                                  ? absl::InfiniteFuture()
+                                  : pending_.begin()->second.deadline);
+      ExpireLocked(absl::Now(), &failed);
+      if (stopping_ && stream_ == nullptr) {
+        FailAllLocked(grpc::Status(grpc::StatusCode::CANCELLED,
+                                   "Replication stream shut down."),
+                      &failed);
+        stopped = true;
+      } else if (stopping_ || broken_) {
+        disconnect = true;
+      } else if (!queue_.empty() && stream_ == nullptr) {
+        connect = true;
+      } else if (!queue_.empty() && in_flight_ < window) {
+        request = std::move(queue_.front());
+        queue_.pop_front();
+        auto it = pending_.find(request.seq());
+        // Otherwise it expired while queued.
+        if (it != pending_.end()) {
+          it->second.written = true;
+          ++in_flight_;
+          stream = stream_.get();
+          context = context_.get();
+        }
+      }
+    }
+
+    for (Failed& f : failed) {
+      f.done(std::move(f.status), paxos_rpc::ReplicationResponse());
+    }
+    if (stopped) {
+      return;
+    }
+    if (disconnect) {
+      Disconnect();
+    } else if (connect) {
+      Connect();
+    } else if (stream != nullptr && !stream->Write(request)) {
+      // The stream is gone, make sure the reader notices.
+      context->TryCancel();
+    }
+  }
+}
+
+void ReplicationStream::Connect() {
+  // Not bounded by a deadline, the stream lives until it breaks.
+  auto context = std::make_unique<grpc::ClientContext>();
+  std::unique_ptr<Stream> stream = stub_->Replicate(context.get());
+  VLOG(1) << "Replication stream to " << address_ << " set up";
+
+  absl::MutexLock l(&lock_);
+  context_ = std::move(context);
+  stream_ = std::move(stream);
+  broken_ = false;
+  reader_ =
+      std::jthread(&ReplicationStream::ReaderThread, this, stream_.get());
+}
+
+void ReplicationStream::Disconnect() {
+  std::unique_ptr<grpc::ClientContext> context;
+  std::unique_ptr<Stream> stream;
+  std::jthread reader;
+  {
+    absl::MutexLock l(&lock_);
+    // Unblocks the reader if the stream is only being shut down.
+    context_->TryCancel();
+    context = std::move(context_);
+    stream = std::move(stream_);
+    reader = std::move(reader_);
+  }
+  reader.join();
+  const grpc::Status status = stream->Finish();
+
+  std::vector<Failed> failed;
+  {
+    absl::MutexLock l(&lock_);
+    broken_ = false;
+    FailAllLocked(status.ok() ? grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                                             "Replication stream closed.")
+                              : status,
+                  &failed);
+    reconnect_after_ = absl::Now() + backoff_;
+    backoff_ = std::min(2 * backoff_, kMaxBackoff);
+    if (!stopping_) {
+      LOG(WARNING) << "Replication stream to " << address_
+                   << " broke with error code: " << status.error_code()
+                   << " and error message: " << status.error_message();
+    }
+  }
+  for (Failed& f : failed) {
+    f.done(std::move(f.status), paxos_rpc::ReplicationResponse());
+  }
+}
+
+void ReplicationStream::ReaderThread(Stream* stream) {
+  paxos_rpc::ReplicationResponse response;
+  while (stream->Read(&response)) {
+    Done done;
+    {
+      absl::MutexLock l(&lock_);
+      backoff_ = kMinBackoff;
+      auto it = pending_.find(response.seq());
+      if (it == pending_.end()) {
+        // Expired while it was being processed.
+        continue;
+      }
+      --in_flight_;
+      done = std::move(it->second.done);
+      pending_.erase(it);
+    }
+    grpc::Status status =
+        response.error_code() == grpc::StatusCode::OK
+            ? grpc::Status::OK
+            : grpc::Status(
+                  static_cast<grpc::StatusCode>(response.error_code()),
+                  response.error_message());
+    done(std::move(status), std::move(response));
+    response.Clear();
+  }
+  absl::MutexLock l(&lock_);
+  broken_ = true;
+}
+
+}  // namespace witnesskvs::paxos
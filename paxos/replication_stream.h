@@ -0,0 +1,109 @@
+#ifndef PAXOS_REPLICATION_STREAM_H_
+#define PAXOS_REPLICATION_STREAM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+// GRPC headers
+#include <grpcpp/grpcpp.h>
+
+#include "absl/base/thread_annotations.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "paxos.grpc.pb.h"
+
+namespace witnesskvs::paxos {
+
+/**
+ * A long-lived bidirectional stream to one acceptor carrying Accepts and
+ * Commits and their acks, so that replicating an entry doesn't pay for
+ * setting up an RPC of its own.
+ *
+ * Requests are sequenced and acked in any order. At most
+ * --paxos_replication_stream_window of them are outstanding on the stream at
+ * once, the others wait their turn. A request that isn't acked by its
+ * deadline fails with DEADLINE_EXCEEDED. When the stream breaks, everything
+ * outstanding fails with its status and the stream is set up again for the
+ * next request, backing off while the acceptor stays unreachable.
+ */
+class ReplicationStream {
+ public:
+  // Called exactly once per request, without any lock held.
+  using Done =
+      std::function<void(grpc::Status, paxos_rpc::ReplicationResponse)>;
+
+  explicit ReplicationStream(const std::string& address);
+  ~ReplicationStream();
+
+  // Disable copy (and move) semantics.
+  ReplicationStream(const ReplicationStream&) = delete;
+  ReplicationStream& operator=(const ReplicationStream&) = delete;
+
+  // Queues request, setting its seq. If the acceptor was unreachable moments
+  // ago, done is called right away with UNAVAILABLE.
+  void Send(paxos_rpc::ReplicationRequest request, absl::Time deadline,
+            Done done) ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  using Stream = grpc::ClientReaderWriter<paxos_rpc::ReplicationRequest,
+                                          paxos_rpc::ReplicationResponse>;
+  struct Pending {
+    absl::Time deadline;
+    bool written = false;
+    Done done;
+  };
+  struct Failed {
+    Done done;
+    grpc::Status status;
+  };
+
+  // Connects, writes queued requests as the window allows and fails expired
+  // ones. Tears the stream down once it breaks.
+  void WriterThread();
+  // Dispatches the acks read from stream until it breaks.
+  void ReaderThread(Stream* stream);
+
+  // Takes every request that's past its deadline out of pending_ as of now.
+  void ExpireLocked(absl::Time now, std::vector<Failed>* failed)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Takes every request out of pending_, e.g. once the stream broke.
+  void FailAllLocked(const grpc::Status& status, std::vector<Failed>* failed)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+  // Sets up a stream and starts reading from it.
+  void Connect() ABSL_LOCKS_EXCLUDED(lock_);
+  // Waits for the broken stream's reader and fails what was outstanding on it.
+  void Disconnect() ABSL_LOCKS_EXCLUDED(lock_);
+
+  const std::string address_;
+  std::unique_ptr<paxos_rpc::Acceptor::Stub> stub_;
+
+  absl::Mutex lock_;
+  bool stopping_ ABSL_GUARDED_BY(lock_);
+  uint64_t next_seq_ ABSL_GUARDED_BY(lock_);
+  // Every request not done yet by seq, whether written or still in queue_.
+  std::map<uint64_t, Pending> pending_ ABSL_GUARDED_BY(lock_);
+  std::deque<paxos_rpc::ReplicationRequest> queue_ ABSL_GUARDED_BY(lock_);
+  // Written to the stream but neither acked nor expired yet.
+  std::size_t in_flight_ ABSL_GUARDED_BY(lock_);
+
+  // The current stream, only set up and torn down by the writer thread.
+  std::unique_ptr<grpc::ClientContext> context_ ABSL_GUARDED_BY(lock_);
+  std::unique_ptr<Stream> stream_ ABSL_GUARDED_BY(lock_);
+  std::jthread reader_ ABSL_GUARDED_BY(lock_);
+  // Set by the reader once the stream has broken.
+  bool broken_ ABSL_GUARDED_BY(lock_);
+  absl::Duration backoff_ ABSL_GUARDED_BY(lock_);
+  absl::Time reconnect_after_ ABSL_GUARDED_BY(lock_);
+
+  std::jthread writer_;
+};
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_REPLICATION_STREAM_H_
@@ -0,0 +1,28 @@
+#include "value_hash.h"
+
+#include <openssl/evp.h>
+
+#include <memory>
+#include <string>
+
+#include "absl/log/check.h"
+#include "absl/strings/string_view.h"
+
+namespace witnesskvs::paxos {
+
+std::string HashValue(const absl::Cord& value) {
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(
+      EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  CHECK(ctx != nullptr);
+  CHECK_EQ(EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr), 1);
+  // Hash the value chunk by chunk rather than flattening it.
+  for (absl::string_view chunk : value.Chunks()) {
+    CHECK_EQ(EVP_DigestUpdate(ctx.get(), chunk.data(), chunk.size()), 1);
+  }
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  CHECK_EQ(EVP_DigestFinal_ex(ctx.get(), digest, &digest_size), 1);
+  return std::string(reinterpret_cast<const char*>(digest), digest_size);
+}
+
+}  // namespace witnesskvs::paxos
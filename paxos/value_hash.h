@@ -0,0 +1,16 @@
+#ifndef PAXOS_VALUE_HASH_H_
+#define PAXOS_VALUE_HASH_H_
+
+#include <string>
+
+#include "absl/strings/cord.h"
+
+namespace witnesskvs::paxos {
+
+// Returns the SHA-256 digest of value, 32 raw bytes. Witnesses that only store
+// metadata keep this in place of the values they accept.
+std::string HashValue(const absl::Cord& value);
+
+}  // namespace witnesskvs::paxos
+
+#endif  // PAXOS_VALUE_HASH_H_
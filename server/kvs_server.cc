@@ -12,6 +12,17 @@ ABSL_FLAG(bool, kvs_enable_linearizability_checks, false, "");
 ABSL_FLAG(std::string, kvs_linearizability_json_file, "history.json",
           "kvs_linearizability_json_file");
 
+// Holds the index below which every chosen operation is in the database,
+// written along with them. Clients can't use it.
+static constexpr char kAppliedIdxKey[] = "__paxos_applied_idx__";
+
+// Where the contents of a snapshot being installed are staged, next to the
+// database. Once the file is there the install is finished even if we crash,
+// see KvsPaxosInstallSnapshotCallback().
+static std::string StagedSnapshotPath(const std::string& db_path) {
+  return db_path + ".snapshot.sst";
+}
+
 KvsServiceImpl::KvsServiceImpl(std::vector<std::unique_ptr<Node>> nodes)
     : nodes_{std::move(nodes)} {}
 
@@ -26,53 +37,244 @@ void KvsServiceImpl::InitRocksDb(const std::string& db_path) {
     if (!status.ok()) {
       LOG(FATAL) << "[KVS]: Failed to open RocksDB: " << status.ToString();
     }
+    db_path_ = db_path;
+
+    // A snapshot that was never completely staged doesn't count, one that was
+    // is installed before anything reads the database.
+    std::error_code ec;
+    std::filesystem::remove(StagedSnapshotPath(db_path_) + ".tmp", ec);
+    if (std::filesystem::exists(StagedSnapshotPath(db_path_))) {
+      LOG(INFO) << "[KVS]: Finishing the install of a snapshot interrupted by "
+                   "a restart";
+      absl::MutexLock l(&snapshot_lock_);
+      status = InstallStagedSnapshot();
+      if (!status.ok()) {
+        LOG(FATAL) << "[KVS]: Installing snapshot failed with error : "
+                   << status.ToString();
+      }
+    }
 
-    auto callback = std::bind(&KvsServiceImpl::KvsPaxosCommitCallback, this,
-                              std::placeholders::_1);
+    // Operations chosen after it may not have been applied before we went
+    // down, paxos applies them again.
+    uint64_t applied_idx = 0;
+    std::string applied_idx_value;
+    status = db_->Get(rocksdb::ReadOptions(), kAppliedIdxKey,
+                      &applied_idx_value);
+    if (status.ok()) {
+      CHECK(absl::SimpleAtoi(applied_idx_value, &applied_idx))
+          << "[KVS]: Malformed applied index: " << applied_idx_value;
+    } else if (!status.IsNotFound()) {
+      LOG(FATAL) << "[KVS]: Failed to read the applied index: "
+                 << status.ToString();
+    }
+
+    auto callback = [this](const std::vector<absl::Cord>& values,
+                           uint64_t applied_idx) {
+      KvsPaxosCommitCallback(values, applied_idx);
+    };
     if (witnesskvs::paxos::PAXOS_OK !=
-        this->paxos_->RegisterAppCallback(callback)) {
+        this->paxos_->RegisterAppCallback(callback, applied_idx)) {
       LOG(FATAL) << "[KVS]: Failed Regsiter DB callback with paxos";
     }
-    LOG(INFO) << "[KVS]: Registered Database callback.";
+    LOG(INFO) << "[KVS]: Registered Database callback, applied up to index: "
+              << applied_idx;
+
+    if (witnesskvs::paxos::PAXOS_OK !=
+        this->paxos_->RegisterSnapshotCallbacks(
+            [this](const std::string& dir) {
+              return KvsPaxosSnapshotCallback(dir);
+            },
+            [this](const std::string& dir) {
+              return KvsPaxosInstallSnapshotCallback(dir);
+            })) {
+      LOG(FATAL) << "[KVS]: Failed to register snapshot callbacks with paxos";
+    }
   }
 }
 
-KvsServiceImpl::~KvsServiceImpl() { delete db_; }
+KvsServiceImpl::~KvsServiceImpl() {
+  // Stop paxos first, its applier calls back into db_.
+  paxos_.reset();
+  delete db_;
+}
 
 void KvsServiceImpl::InitPaxos(void) {
   paxos_ = std::make_unique<witnesskvs::paxos::Paxos>(
       absl::GetFlag(FLAGS_kvs_node_id));
 }
 
-void KvsServiceImpl::KvsPaxosCommitCallback(std::string value) {
-  KeyValueStore::OperationType op;
-  if (!op.ParseFromString(value)) {
-    LOG(FATAL) << "[KVS]: Parse from string failed!";
-  }
+void KvsServiceImpl::KvsPaxosCommitCallback(
+    const std::vector<absl::Cord>& values, uint64_t applied_idx) {
+  // Apply the whole batch of chosen operations with a single write, which
+  // records how far they go too. A batch that isn't written is lost, so the
+  // write failing is fatal: paxos applies it again after a restart.
+  rocksdb::WriteBatch batch;
+  for (const absl::Cord& value : values) {
+    if (value.empty()) {
+      // NOP paxos round.
+      continue;
+    }
+    KeyValueStore::OperationType op;
+    if (!op.ParseFromCord(value)) {
+      LOG(FATAL) << "[KVS]: Parse from cord failed!";
+    }
 
-  switch (op.type()) {
-    case KeyValueStore::OperationType_Type_PUT: {
-      rocksdb::Status status = this->db_->Put(
-          rocksdb::WriteOptions(), op.put_data().key(), op.put_data().value());
-      if (!status.ok()) {
-        LOG(WARNING) << "[KVS]: Put operation failed with error : "
+    switch (op.type()) {
+      case KeyValueStore::OperationType_Type_PUT: {
+        rocksdb::Status status =
+            batch.Put(op.put_data().key(), op.put_data().value());
+        if (!status.ok()) {
+          LOG(FATAL) << "[KVS]: Put operation failed with error : "
                      << status.ToString();
+        }
+        break;
       }
-      break;
-    }
-    case KeyValueStore::OperationType_Type_DELETE: {
-      rocksdb::Status status =
-          this->db_->Delete(rocksdb::WriteOptions(), op.del_data().key());
-      if (!status.ok()) {
-        LOG(WARNING) << "[KVS]: Delete operation failed with error : "
+      case KeyValueStore::OperationType_Type_DELETE: {
+        rocksdb::Status status = batch.Delete(op.del_data().key());
+        if (!status.ok()) {
+          LOG(FATAL) << "[KVS]: Delete operation failed with error : "
                      << status.ToString();
+        }
+        break;
       }
-      break;
+      default:
+        LOG(FATAL) << "[KVS]: Unknown operation type requested on rocks db";
+        break;
     }
-    default:
-      LOG(FATAL) << "[KVS]: Unknown operation type requested on rocks db";
-      break;
   }
+  rocksdb::Status status =
+      batch.Put(kAppliedIdxKey, absl::StrCat(applied_idx));
+  if (status.ok()) {
+    status = this->db_->Write(rocksdb::WriteOptions(), &batch);
+  }
+  if (!status.ok()) {
+    LOG(FATAL) << "[KVS]: Write of " << batch.Count()
+               << " operations up to index: " << applied_idx
+               << " failed with error : " << status.ToString();
+  }
+}
+
+bool KvsServiceImpl::KvsPaxosSnapshotCallback(const std::string& dir) {
+  // Hard links to the SST files, after flushing the memtable into one.
+  rocksdb::Checkpoint* checkpoint = nullptr;
+  rocksdb::Status status = rocksdb::Checkpoint::Create(db_, &checkpoint);
+  if (status.ok()) {
+    status = checkpoint->CreateCheckpoint(dir);
+  }
+  delete checkpoint;
+  if (!status.ok()) {
+    LOG(WARNING) << "[KVS]: Checkpoint failed with error : "
+                 << status.ToString();
+    return false;
+  }
+  return true;
+}
+
+bool KvsServiceImpl::KvsPaxosInstallSnapshotCallback(const std::string& dir) {
+  // The checkpoint's own SST files can't be ingested as they are, copy its
+  // contents into a single one that can. It carries the checkpoint's applied
+  // index along, so the database and its applied index are replaced together.
+  rocksdb::Options options;
+  rocksdb::DB* checkpoint_db = nullptr;
+  rocksdb::Status status =
+      rocksdb::DB::OpenForReadOnly(options, dir, &checkpoint_db);
+  if (!status.ok()) {
+    LOG(WARNING) << "[KVS]: Opening snapshot failed with error : "
+                 << status.ToString();
+    return false;
+  }
+  std::unique_ptr<rocksdb::DB> checkpoint(checkpoint_db);
+  const std::string staged_path = StagedSnapshotPath(db_path_);
+  const std::string temp_path = staged_path + ".tmp";
+  rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), options);
+  uint64_t num_keys = 0;
+  bool has_applied_idx = false;
+  status = writer.Open(temp_path);
+  std::unique_ptr<rocksdb::Iterator> it(
+      checkpoint->NewIterator(rocksdb::ReadOptions()));
+  for (it->SeekToFirst(); status.ok() && it->Valid(); it->Next()) {
+    status = writer.Put(it->key(), it->value());
+    has_applied_idx = has_applied_idx || it->key() == kAppliedIdxKey;
+    ++num_keys;
+  }
+  if (status.ok()) {
+    status = it->status();
+  }
+  if (status.ok() && !has_applied_idx) {
+    status = rocksdb::Status::InvalidArgument("snapshot has no applied index");
+  }
+  if (status.ok()) {
+    status = writer.Finish();
+  }
+  it.reset();
+  checkpoint.reset();
+  std::error_code ec;
+  if (status.ok()) {
+    // Only a complete file is staged, the rename is the point of no return.
+    std::filesystem::rename(temp_path, staged_path, ec);
+    if (ec) {
+      status = rocksdb::Status::IOError(ec.message());
+    }
+  }
+  if (!status.ok()) {
+    std::filesystem::remove(temp_path, ec);
+    LOG(WARNING) << "[KVS]: Preparing snapshot failed with error : "
+                 << status.ToString();
+    return false;
+  }
+  witnesskvs::log::FileWriter::SyncDir(
+      std::filesystem::path(staged_path).parent_path().string());
+
+  absl::MutexLock l(&snapshot_lock_);
+  status = InstallStagedSnapshot();
+  if (!status.ok()) {
+    // What the database holds is unknown now, the install is finished on
+    // restart instead.
+    LOG(FATAL) << "[KVS]: Installing snapshot failed with error : "
+               << status.ToString();
+  }
+  LOG(INFO) << "[KVS]: Installed snapshot of " << num_keys << " keys.";
+  return true;
+}
+
+rocksdb::Status KvsServiceImpl::InstallStagedSnapshot() {
+  const std::string staged_path = StagedSnapshotPath(db_path_);
+  // Drop everything, the ingested file is written over the range deletion.
+  // Running this again after a crash part way through ends up the same.
+  rocksdb::WriteOptions write_options;
+  write_options.sync = true;
+  rocksdb::Status status;
+  std::unique_ptr<rocksdb::Iterator> db_it(
+      db_->NewIterator(rocksdb::ReadOptions()));
+  db_it->SeekToFirst();
+  if (db_it->Valid()) {
+    const std::string first = db_it->key().ToString();
+    db_it->SeekToLast();
+    const std::string last = db_it->key().ToString();
+    status = db_->DeleteRange(write_options, db_->DefaultColumnFamily(), first,
+                              last);
+    if (status.ok()) {
+      status = db_->Delete(write_options, last);
+    }
+  }
+  db_it.reset();
+  if (status.ok()) {
+    rocksdb::IngestExternalFileOptions ingest_options;
+    ingest_options.move_files = true;
+    status = db_->IngestExternalFile({staged_path}, ingest_options);
+  }
+  if (!status.ok()) {
+    return status;
+  }
+  // The staged file must not be installed again over later writes.
+  std::error_code ec;
+  std::filesystem::remove(staged_path, ec);
+  if (ec) {
+    return rocksdb::Status::IOError(ec.message());
+  }
+  witnesskvs::log::FileWriter::SyncDir(
+      std::filesystem::path(staged_path).parent_path().string());
+  return status;
 }
 
 // Helper function to convert rocks db errors to grpc errors
@@ -89,7 +291,7 @@ static Status convertRocksDbErrorToGrpcError(const rocksdb::Status& status) {
   }
 }
 
-Status KvsServiceImpl::PaxosProposeWrapper(const std::string& value,
+Status KvsServiceImpl::PaxosProposeWrapper(const absl::Cord& value,
                                            bool is_read = false) {
   using witnesskvs::paxos::PaxosResult;
   using witnesskvs::paxos::PaxosResult::PAXOS_ERROR_NOT_PERMITTED;
@@ -130,6 +332,10 @@ Status KvsServiceImpl::PaxosProposeWrapper(const std::string& value,
 
 Status KvsServiceImpl::Put(ServerContext* context, const PutRequest* request,
                            PutResponse* response) {
+  if (request->key() == kAppliedIdxKey) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "[KVS]: Key is reserved.");
+  }
   auto entry = LinearizabilityLogBegin();
 
   KeyValueStore::OperationType op;
@@ -138,10 +344,10 @@ Status KvsServiceImpl::Put(ServerContext* context, const PutRequest* request,
   kv_put->set_key(request->key());
   kv_put->set_value(request->value());
 
-  std::string serialized_request;
-  if (!op.SerializeToString(&serialized_request)) {
-    LOG(WARNING)
-        << "[KVS]: SerializeToString to string failed in Put operation.";
+  // Paxos shares this buffer from here on rather than copying it.
+  absl::Cord serialized_request;
+  if (!op.SerializeToCord(&serialized_request)) {
+    LOG(WARNING) << "[KVS]: SerializeToCord failed in Put operation.";
     return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
                         "[KVS]: Failed to serialize Put request.");
   }
@@ -160,14 +366,17 @@ Status KvsServiceImpl::Get(ServerContext* context, const GetRequest* request,
                            GetResponse* response) {
   auto entry = LinearizabilityLogBegin();
 
-  Status statusGrpc = PaxosProposeWrapper("", true);
+  Status statusGrpc = PaxosProposeWrapper(absl::Cord(), true);
   if (!statusGrpc.ok()) {
     return statusGrpc;
   }
 
   std::string value;
-  rocksdb::Status status =
-      db_->Get(rocksdb::ReadOptions(), request->key(), &value);
+  rocksdb::Status status;
+  {
+    absl::ReaderMutexLock l(&snapshot_lock_);
+    status = db_->Get(rocksdb::ReadOptions(), request->key(), &value);
+  }
   if (!status.ok()) {
     LOG(WARNING) << "[KVS]: Get operation for key: " << request->key()
                  << " failed with error: " << status.ToString();
@@ -184,15 +393,18 @@ Status KvsServiceImpl::Get(ServerContext* context, const GetRequest* request,
 Status KvsServiceImpl::Delete(ServerContext* context,
                               const DeleteRequest* request,
                               DeleteResponse* response) {
+  if (request->key() == kAppliedIdxKey) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "[KVS]: Key is reserved.");
+  }
   KeyValueStore::OperationType op;
   op.set_type(KeyValueStore::OperationType_Type_DELETE);
   KeyValueStore::DeleteRequest* kv_del = op.mutable_del_data();
   kv_del->set_key(request->key());
 
-  std::string serialized_request;
-  if (!op.SerializeToString(&serialized_request)) {
-    LOG(WARNING)
-        << "[KVS]: SerializeToString to string failed in Delete operation.";
+  absl::Cord serialized_request;
+  if (!op.SerializeToCord(&serialized_request)) {
+    LOG(WARNING) << "[KVS]: SerializeToCord failed in Delete operation.";
     return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
                         "Failed to serialize Delete request.");
   }
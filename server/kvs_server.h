@@ -7,12 +7,14 @@
 #include <grpcpp/grpcpp.h>
 #include <rocksdb/status.h>
 
+#include <filesystem>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <nlohmann/json.hpp>
 #include <optional>
 #include <string>
+#include <system_error>
 #include <vector>
 
 #include "absl/flags/flag.h"
@@ -21,12 +23,19 @@
 #include "absl/log/initialize.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
+#include "absl/strings/cord.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/str_format.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "kvs.grpc.pb.h"
+#include "log/file_writer.h"
 #include "paxos/paxos.h"
 #include "rocksdb/db.h"
+#include "rocksdb/sst_file_writer.h"
+#include "rocksdb/utilities/checkpoint.h"
+#include "rocksdb/write_batch.h"
 #include "util/node.h"
 
 using grpc::Server;
@@ -100,7 +109,8 @@ class KvsServiceImpl final : public Kvs::Service {
       google::protobuf::Empty* response) override;
 
  private:
-  rocksdb::DB* db_;
+  rocksdb::DB* db_ = nullptr;
+  std::string db_path_;
   std::unique_ptr<witnesskvs::paxos::Paxos> paxos_;
 
   std::vector<std::unique_ptr<Node>> nodes_;
@@ -108,8 +118,21 @@ class KvsServiceImpl final : public Kvs::Service {
   absl::Mutex lock_;
   std::unique_ptr<LinearizabilityChecker> checker_ ABSL_GUARDED_BY(lock_);
 
-  Status PaxosProposeWrapper(const std::string& value, bool is_read);
-  void KvsPaxosCommitCallback(std::string value);
+  // Held shared by reads, so that none sees db_ halfway through installing a
+  // snapshot.
+  absl::Mutex snapshot_lock_;
+
+  Status PaxosProposeWrapper(const absl::Cord& value, bool is_read);
+  // Applies values and stores applied_idx with them, in a single write.
+  void KvsPaxosCommitCallback(const std::vector<absl::Cord>& values,
+                              uint64_t applied_idx);
+  // Paxos snapshot callbacks. A snapshot is a RocksDB checkpoint, installed
+  // by ingesting its contents in place of what db_ holds.
+  bool KvsPaxosSnapshotCallback(const std::string& dir);
+  bool KvsPaxosInstallSnapshotCallback(const std::string& dir);
+  // Replaces what db_ holds with the staged snapshot, see StagedSnapshotPath().
+  rocksdb::Status InstallStagedSnapshot()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(snapshot_lock_);
 
   LinearizabilityChecker::JSONLogEntry LinearizabilityLogBegin() {
     absl::MutexLock l(&lock_);